@@ -0,0 +1,62 @@
+/***********************************
+
+File: piface_control.h
+
+The binary protocol spoken on the server's Unix domain socket, for
+control programs running on the same Pi. Start the server with
+control=1, then connect a SOCK_SEQPACKET socket to
+PIFACE_CONTROL_PATH.
+
+Every message, in either direction, is one Control_Frame in the
+byte order of the Pi. Each request gets exactly one reply of the
+same type, carrying the tag of the request and the state of the
+inputs and outputs after it was carried out:
+
+CONTROL_READ         Read the digital inputs and outputs.
+CONTROL_WRITE        Set the outputs picked out by mask to the
+                     corresponding bits of value.
+CONTROL_SUBSCRIBE    Be sent a CONTROL_EVENT each time the inputs
+                     or outputs change, from now on.
+CONTROL_UNSUBSCRIBE  Stop being sent events.
+
+A write is refused with CONTROL_BUSY, and the outputs left as they
+were, when the outputs are already being written as often as the
+server's write_rate allows.
+
+A subscriber that does not read its events is sent only the latest
+state once it catches up, rather than every change it missed. A
+program that leaves no room for a reply for a second is disconnected,
+so it sees the connection close rather than wait for ever.
+
+***********************************/
+
+#ifndef PIFACE_CONTROL_H
+#define PIFACE_CONTROL_H
+
+#include <stdint.h>
+
+#define PIFACE_CONTROL_PATH "/run/piface_digital_2.sock"
+
+//  Message types
+#define CONTROL_READ         1
+#define CONTROL_WRITE        2
+#define CONTROL_SUBSCRIBE    3
+#define CONTROL_UNSUBSCRIBE  4
+#define CONTROL_EVENT        5
+
+//  Reply status
+#define CONTROL_OK           0
+#define CONTROL_BAD_REQUEST  1
+#define CONTROL_BUSY         2
+
+struct Control_Frame {
+	uint8_t  type;
+	uint8_t  status;
+	uint8_t  mask;
+	uint8_t  value;
+	uint8_t  input;
+	uint8_t  output;
+	uint16_t tag;
+};
+
+#endif
@@ -1,18 +1,142 @@
+//  The page keeps what it last showed, and changes only the cells
+//  that differ, once per animation frame however many events arrive.
+//  Outputs the user has toggled show the wanted value until the
+//  server confirms it, or puts them back if the server refuses.
+
+//  Inputs and outputs as the server last sent them, bit 0 first
+var inputs = null;
+var outputs = null;
+
+//  What each cell shows, and the cells themselves
+var shown = [];
+var cells = null;
+
+//  Outputs toggled and not yet confirmed, with their wanted values
+var wanted_mask = 0;
+var wanted_value = 0;
+
+//  Outputs toggled and not yet sent
+var pending_mask = 0;
+
+//  The request on its way, if any
+var in_flight = null;
+var sequence = 0;
+var frame_wanted = false;
+
+function render() {
+  var i;
+  var text;
+  frame_wanted = false;
+  if ( cells == null ) {
+    cells = [];
+    for ( i = 0; i < 8; i++ ) {
+      cells[i] = document.getElementById("di" + i);
+      cells[i+8] = document.getElementById("t" + i);
+    }
+    for ( i = 0; i < 16; i++ ) {
+      shown[i] = cells[i].textContent;
+    }
+  }
+  for ( i = 0; i < 16; i++ ) {
+    if ( i >= 8 && ( wanted_mask & ( 1 << (i-8) ) ) ) {
+      text = ( wanted_value & ( 1 << (i-8) ) ) ? "1" : "0";
+    } else if ( i < 8 && inputs != null ) {
+      text = inputs.charAt(i);
+    } else if ( i >= 8 && outputs != null ) {
+      text = outputs.charAt(i-8);
+    } else {
+      continue;
+    }
+    if ( shown[i] != text ) {
+      cells[i].textContent = text;
+      shown[i] = text;
+    }
+  }
+}
+
+function schedule_render() {
+  if ( !frame_wanted ) {
+    frame_wanted = true;
+    requestAnimationFrame(render);
+  }
+}
+
+//  Called with the data of each event from events.qif: eight inputs
+//  then, if they are sent, eight outputs
+function piface_event(data) {
+  inputs = data.substr(0, 8);
+  if ( data.length > 8 ) {
+    outputs = data.substr(8, 8);
+  }
+  schedule_render();
+}
+
+function output_shown(index) {
+  if ( wanted_mask & ( 1 << index ) ) {
+    return ( wanted_value >> index ) & 1;
+  }
+  return outputs.charAt(index) == "1" ? 1 : 0;
+}
+
+//  Sends every output toggled since the last request in one PUT,
+//  numbered so that its answer can be matched to it
+function send() {
+  var i;
+  var url;
+  if ( in_flight != null || pending_mask == 0 ) {
+    return;
+  }
+  sequence++;
+  in_flight = { seq: sequence, mask: pending_mask };
+  url = "set_bit.qif?seq=" + sequence;
+  for ( i = 0; i < 8; i++ ) {
+    if ( pending_mask & ( 1 << i ) ) {
+      url += "&t" + i + "=" + ( ( wanted_value >> i ) & 1 );
+    }
+  }
+  pending_mask = 0;
+  fetch(url, { method: 'PUT', headers: { 'Content-Type': 'application/text' }, body: '0' })
+    .then((response) => response.ok ? response.json() : null)
+    .catch(() => null)
+    .then(acknowledged);
+}
+
+//  Takes the outputs the server reports as the truth, or, if it
+//  refused or could not be reached, shows the outputs as they were.
+//  Outputs toggled again meanwhile keep their wanted value.
+function acknowledged(reply) {
+  var i;
+  var done = in_flight.mask & ~pending_mask;
+  if ( reply != null && reply.seq == in_flight.seq ) {
+    outputs = "";
+    for ( i = 0; i < 8; i++ ) {
+      outputs += ( reply.output >> i ) & 1;
+    }
+  }
+  wanted_mask &= ~done;
+  in_flight = null;
+  schedule_render();
+  send();
+}
+
 function toggle(index) {
-  var id = "t" + index;
-  var t = document.getElementById(id);
-  if ( t.textContent == "0" ) {
-    t.textContent = "1";
+  var bit = 1 << index;
+  var i;
+
+  //  Until the first event, the outputs are as the page was served
+  if ( outputs == null ) {
+    outputs = "";
+    for ( i = 0; i < 8; i++ ) {
+      outputs += document.getElementById("t" + i).textContent;
+    }
+  }
+  if ( output_shown(index) ) {
+    wanted_value &= ~bit;
   } else {
-    t.textContent = "0";
-  }
-const url = "set_bit.qif?"+id+"="+t.textContent;
-const options = {
-  method: 'PUT',
-  headers: {
-    'Content-Type': 'application/text'
-  },
-  body: '0'
-};
-fetch(url, options);
+    wanted_value |= bit;
+  }
+  wanted_mask |= bit;
+  pending_mask |= bit;
+  schedule_render();
+  send();
 }
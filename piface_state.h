@@ -0,0 +1,128 @@
+/***********************************
+
+File: piface_state.h
+
+The state page the server publishes in shared memory when started
+with shm=1, and a reader for it. Programs on the same Pi that only
+need the current state can map the page and read it without any
+system call, and without adding to the load on the server or the
+SPI bus.
+
+Usage:
+    struct State_Page * page = state_page_map ( );
+    struct State_Snapshot state;
+    if ( page ) {
+        state_page_read ( page, &state );
+    }
+
+The page is rewritten after every sample of the inputs, and every
+change to the outputs. It is guarded by a sequence lock: the writer
+makes lock odd while it changes the page, and even again when it
+has finished, so a reader that sees lock change, or sees it odd,
+simply reads again.
+
+With udp=address:port the server also sends the state, as a
+State_Datagram, to a multicast group or a single collector each time
+it changes, and every keyframe seconds regardless. Every field is in
+network byte order. The sequence number goes up by one with each
+datagram, so a gap in it means datagrams were lost.
+
+***********************************/
+
+#ifndef PIFACE_STATE_H
+#define PIFACE_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PIFACE_STATE_NAME    "/piface_digital_2"
+#define PIFACE_STATE_MAGIC   0x50494632
+#define PIFACE_STATE_VERSION 1
+
+//  A consistent copy of the state
+struct State_Snapshot {
+	uint8_t  input;
+	uint8_t  output;
+
+	//  Count of times the state has been written
+	uint64_t sequence;
+
+	//  CLOCK_MONOTONIC time of the last write, in nanoseconds
+	uint64_t time;
+
+	//  Count of changes seen on each input, bit 0 first
+	uint32_t edges[8];
+};
+
+struct State_Page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t lock;
+	uint32_t unused;
+	struct State_Snapshot state;
+};
+
+#define STATE_DATAGRAM_VERSION  1
+#define STATE_DATAGRAM_KEYFRAME 1
+
+struct State_Datagram {
+	uint8_t  version;
+	uint8_t  flags;
+	uint16_t board;
+	uint32_t sequence;
+
+	//  CLOCK_REALTIME time of the change, in nanoseconds
+	uint64_t time;
+	uint8_t  input;
+	uint8_t  output;
+	uint8_t  unused[6];
+};
+
+/*
+Maps the state page read only.
+
+Returns NULL if the server is not publishing it.
+*/
+static inline struct State_Page *state_page_map ( void ) {
+	struct State_Page * page;
+	int fd;
+
+	fd = shm_open ( PIFACE_STATE_NAME, O_RDONLY, 0 );
+	if ( fd < 0 ) {
+		return NULL;
+	}
+	page = ( struct State_Page * ) mmap ( 0, sizeof ( *page ), PROT_READ, MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( page == MAP_FAILED ) {
+		return NULL;
+	}
+	if ( page->magic != PIFACE_STATE_MAGIC || page->version != PIFACE_STATE_VERSION ) {
+		munmap ( page, sizeof ( *page ) );
+		return NULL;
+	}
+	return page;
+}
+
+/*
+Copies the state out of the page, trying again for as long as the
+server is part way through writing it.
+*/
+static inline void state_page_read ( const struct State_Page * page, struct State_Snapshot * state ) {
+	uint32_t lock;
+	for (;;) {
+		lock = __atomic_load_n ( &page->lock, __ATOMIC_ACQUIRE );
+		if ( lock & 1 ) {
+			continue;
+		}
+		memcpy ( state, ( const void * ) &page->state, sizeof ( *state ) );
+		__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+		if ( __atomic_load_n ( &page->lock, __ATOMIC_RELAXED ) == lock ) {
+			return;
+		}
+	}
+}
+
+#endif
@@ -5,12 +5,14 @@ File: server.cpp
 Basic usage:    $ sudo ./server 80
 Verbose usage:  $ sudo ./server 80 v
 Version usage:  $ ./server 80 a
+Options:        $ sudo ./server 80 name=value ...  (see README)
 
 This is a very simple web server that supplies a web page that
 can be used to drive a PiFace Digital 2.
 
 The port number (80) is mandatory, and provides HTTP connection
-only. HTTPS is not supported.
+only. HTTPS is not supported. HTTP/2 is spoken, without TLS (h2c),
+to clients that ask for it.
 
 In lieu of <?PHP ... ?> tag with corresponding *.php files, this
 server uses "*.qif" pseudo files, which "files" are redirected
@@ -29,15 +31,20 @@ output state is sent once to each known web connection.
 Note about socket names
 
 listen_socket_fd:
-Listens for connection requests from web browsers. This runs
-in the main thread.
+Listens for connection requests from web browsers. There is one
+per core, sharing the port through SO_REUSEPORT, each with its own
+acceptor thread pinned to that core.
 
 service_socket_fd:
-Responds to HTPP requests. Runs in a separate thread.
+Responds to HTPP requests. Runs in one of a fixed pool of worker
+threads, fed from the listener's bounded queue of accepted
+connections, and pinned to the same core as the acceptor.
 
 event_socket_fd:
 This is identical to service_socket_fd. It is separate from
-service_socket_fd for the purpose of clarity.
+service_socket_fd for the purpose of clarity. Once its header has
+been sent it is handed over to the event thread, which samples the
+inputs and writes to every event stream, leaving the worker free.
 
 ***********************************/
 
@@ -50,18 +57,30 @@ service_socket_fd for the purpose of clarity.
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <errno.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sched.h>
 #include <time.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <arpa/inet.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <pthread.h>
+#include <zlib.h>
 #include "pifacedigital.h"
+#include "piface_control.h"
+#include "piface_state.h"
 
 #include "utils.c"
 
@@ -75,29 +94,497 @@ using namespace std;
 #define REQUEST_GET       1
 #define REQUEST_PUT       2
 
+#define ENCODING_GZIP     1
+#define ENCODING_BROTLI   2
+
+#define MAX_ASSETS       32
+
+#define MAX_REQUEST_SIZE 5000
+
+//  The io_uring backend needs multishot accept, from Linux 5.19
+#if defined(__NR_io_uring_setup) && defined(IORING_ACCEPT_MULTISHOT)
+#define HAVE_URING
+#endif
+
 //  Forward declarations
-void  *accept_connection (void *ptr);
+struct Asset;
+struct Connection_Queue;
+struct Control_Client;
+struct Event_Frame;
+struct Event_Stream;
+struct H2_Adopted;
+struct H2_Connection;
+struct H2_Stream;
+struct H2_Table;
+struct Rate_Bucket;
+struct Route;
+struct Sequence_Step;
+struct Stats_Window;
+struct Template_Slot;
+struct Upstream;
+struct Upstream_Command;
+bool   buffer_append_iov ( char **, int *, struct iovec *, int );
+char  *buffer_get ( int );
+void   buffer_preallocate ( );
+void   buffer_put ( char * );
+int    buffer_size ( char * );
 void   cleanup_server_connections(int);
+void   close_event_stream ( struct Event_Stream * );
+int    control_open ( );
+void   control_publish ( int, int );
+bool   control_request ( struct Control_Client * );
+void  *control_server ( void * );
+int    connection_queue_pop ( struct Connection_Queue * );
+bool   connection_queue_push ( struct Connection_Queue *, int );
+void   deflate_cleanup ( void * );
+void   drain_event_streams ( const struct timespec * );
 void   error(const char *);
-int    expand_page(char *, char *, int);
-int    get_page( char *, char *, int, char *, int );
+struct Event_Frame *event_frame_get ( bool );
+void   event_frame_put ( struct Event_Frame * );
+int    expand_page ( char *, char *, int, struct Template_Slot *, int * );
+struct Asset *find_asset ( char * );
+bool   flush_event_stream ( struct Event_Stream * );
+void   gateway_answer ( struct Upstream_Command *, int );
+void   gateway_commands ( struct Upstream *, time_t );
+void   gateway_connect ( struct Upstream *, time_t );
+void   gateway_data ( struct Upstream *, unsigned char *, int );
+void   gateway_drop ( struct Upstream *, time_t );
+void   gateway_event ( struct Upstream *, char * );
+bool   gateway_frame ( struct H2_Connection *, int, int, unsigned, unsigned char *, int );
+struct Event_Frame *gateway_frame_get ( bool );
+int    gateway_open ( );
+bool   gateway_publish ( bool );
+bool   gateway_request ( struct Upstream *, unsigned, bool, const char * );
+void  *gateway_server ( void * );
+void   gateway_start ( struct Upstream * );
+int    get_accept_encoding ( char * );
+char  *get_header ( char *, const char * );
 int    get_page_name( char *, char *, int, char *, char * );
+in_addr_t get_peer_address ( int );
+char  *get_query ( char * );
+int    get_query_number ( char *, const char *, int );
+int    get_query_value ( char *, const char * );
+int    get_request_length ( char *, int );
 int    get_request_type ( char * );
+char  *gzip_buffer ( char *, int, int * );
+bool   h2_adopt ( int, char *, int, bool );
+void   h2_close ( struct H2_Connection * );
+int    h2_decode ( struct H2_Connection *, unsigned char *, int, char *, int );
+void   h2_dispatch ( struct H2_Connection *, struct H2_Stream * );
+void   h2_finish ( );
+bool   h2_flush ( struct H2_Connection * );
+bool   h2_frame ( struct H2_Connection *, int, int, unsigned, unsigned char *, int );
+bool   h2_goaway ( struct H2_Connection *, int );
+bool   h2_header_block ( struct H2_Connection *, unsigned );
+bool   h2_headers ( struct H2_Connection *, struct H2_Stream *, const char *, int, bool );
+int    h2_huffman ( unsigned char *, int, char *, int );
+void   h2_huffman_build ( );
+bool   h2_input ( struct H2_Connection * );
+bool   h2_integer ( unsigned char **, unsigned char *, int, int * );
+bool   h2_put_frame ( struct H2_Connection *, int, int, unsigned, const void *, int );
+int    h2_put_integer ( unsigned char *, unsigned, int, int );
+bool   h2_put_window ( struct H2_Connection *, unsigned, int );
+bool   h2_read ( struct H2_Connection * );
+bool   h2_request ( struct H2_Stream *, char *, int );
+void   h2_reset ( struct H2_Connection *, unsigned, int );
+void   h2_respond ( struct H2_Connection *, struct H2_Stream *, char *, int );
+void   h2_send_events ( struct H2_Connection * );
+void   h2_send_pending ( struct H2_Connection * );
+void  *h2_server ( void * );
+bool   h2_settings ( struct H2_Connection *, unsigned char *, int );
+void   h2_start ( struct H2_Adopted * );
+int    h2_static_find ( const char *, int );
+struct H2_Stream *h2_stream ( struct H2_Connection *, unsigned );
+void   h2_stream_close ( struct H2_Stream * );
+int    h2_string ( unsigned char **, unsigned char *, char *, int );
+bool   h2_table_add ( struct H2_Table *, const char *, int, const char *, int );
+bool   h2_table_field ( struct H2_Table *, int, const char **, int *, const char **, int * );
+void   h2_table_resize ( struct H2_Table *, int );
+void   h2_wake ( );
+int    h2_wanted ( char *, int );
+void  *h2_worker ( void * );
 void   initialise();
+bool   load_asset ( struct Asset *, char * );
 int    locate_char (char, char *);
+void   log_flush ( );
+void   log_message ( int, const char *, ... ) __attribute__ (( format ( printf, 2, 3 ) ));
+struct Log_Ring *log_register ( );
+void   log_start ( );
+void  *log_thread ( void * );
+bool   match_etag ( char *, const char * );
 int    main(int, char *[]);
-void   open_event_stream ( int );
-void   process_get_request ( char *, int );
-void   process_put_request ( char *, int );
-void   register_event_stream ( int );
+bool   open_event_stream ( int, bool, bool );
+int    open_listen_socket ( int, bool );
+bool   process_config_request ( char *, int );
+bool   process_gateway_request ( char *, int );
+bool   process_get_request ( char *, int );
+bool   process_log_request ( char *, int );
+bool   process_put_request ( char *, int );
+bool   process_request ( char *, int, int );
+bool   process_sequence_request ( char *, int );
+bool   process_trace_request ( char *, int );
+void   publish_state ( void );
+bool   rate_admit ( struct Rate_Bucket *, int, int, int, unsigned long long );
+bool   rate_allow ( in_addr_t, int );
+bool   rate_allow_write ( int );
+void   rate_open ( );
+int    rate_status ( char * );
+char  *read_file ( char *, int * );
+int    read_inputs ( int );
+void   reject_connection ( int, const char *, int );
+unsigned ring_size ( int );
+void   route_benchmark ( );
+bool   route_config ( char *, int );
+bool   route_events ( char *, int );
+bool   route_gateway ( char *, int );
+const struct Route *route_find ( int, char * );
+bool   route_limits ( char *, int );
+bool   route_log ( char *, int );
+bool   route_sequence ( char *, int );
+bool   route_state ( char *, int );
+bool   route_stats ( char *, int );
+bool   route_trace ( char *, int );
+bool   route_upstreams ( char *, int );
 int    send_error( char * );
-void   send_events(int);
-void   serve_page(int, char *, int, bool);
-void   server( int );
+bool   send_event ( struct Event_Stream * );
+void  *send_events ( void * );
+int    sequence_parse ( char *, struct Sequence_Step * );
+int    sequence_status ( char * );
+void  *sequence_thread ( void * );
+int    sample_period ( int, bool );
+void   serve_json ( int, char *, int );
+void   serve_asset ( int, struct Asset *, int, char * );
+void   serve_not_found ( int );
+bool   serve_page(int, char *, int, bool);
+bool   serve_state ( int, char * );
+void   serve_template ( int, struct Asset *, char * );
+void  *server ( void * );
+bool   service_connection ( int );
+bool   set_option ( char * );
+void   set_stack_size ( pthread_attr_t * );
+void   set_tcp_option ( int, int, int );
 void   sigpipe_handler ( int );
-void   thread_error(const char *);
-void   unregister_event_stream ( int );
-void   write_header ( int, char *, int);
+void   start_threads ( int );
+bool   state_page_create ( );
+void   state_page_write ( int, int );
+int    state_json ( char * );
+void   state_notify ( int, int );
+void  *state_wait_thread ( void * );
+void   state_wake ( );
+void   stats_account ( unsigned long long );
+int    stats_json ( char * );
+void   stats_load ( );
+void   stats_save ( );
+void   stats_update ( int, int );
+void   stats_window_add ( struct Stats_Window *, unsigned long long, int, unsigned long long, unsigned long long );
+int    trace_dump ( char ** );
+inline void trace_end ( const char *, unsigned long long );
+void   trace_record ( const char *, unsigned long long );
+void   trace_signal_handler ( int );
+inline unsigned long long trace_start ( );
+void   trace_write_file ( );
+bool   udp_open ( );
+void   udp_publish ( int, int );
+bool   unregister_event_stream ( int );
+struct Uring;
+struct Uring_Connection;
+bool   uring_capture_iov ( struct iovec *, int );
+void   uring_complete ( struct Uring *, struct io_uring_cqe * );
+void   uring_complete_event ( unsigned long long, int );
+void   uring_complete_recv ( struct Uring_Connection *, int, unsigned );
+void   uring_complete_write ( struct Uring_Connection *, int, bool );
+void   uring_free_connection ( struct Uring_Connection * );
+struct io_uring_sqe *uring_get_sqe ( struct Uring *, unsigned long long );
+bool   uring_init ( struct Uring * );
+void   uring_make_room ( struct Uring *, unsigned );
+void   uring_queue_accept ( struct Uring * );
+void   uring_queue_close ( struct Uring_Connection * );
+bool   uring_queue_event ( struct Event_Stream * );
+void   uring_queue_recv ( struct Uring_Connection * );
+void   uring_queue_write ( struct Uring_Connection *, bool );
+void   uring_provide_buffers ( struct Uring *, int, int );
+void  *uring_server ( void * );
+void   uring_submit ( struct Uring *, int );
+void  *worker_thread ( void * );
+bool   write_header ( int, const char *, int);
+int    write_iov ( int, struct iovec *, int );
+int    write_outputs ( int, int );
+
+//  Prebuilt HTTP header fragments. Responses are assembled from
+//  these as iovecs and sent with a single writev().
+static const char header_ok_html[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: ";
+static const char header_end[] = "\r\n\r\n";
+static const char header_put_ack[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: 0\r\n\r\n";
+static const char header_ok_json[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-store\r\nContent-Length: ";
+static const char header_bad_request[] =
+	"HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+static const char header_conflict[] =
+	"HTTP/1.1 409 Conflict\r\nContent-Length: 0\r\n\r\n";
+static const char header_event_stream[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream; charset=UTF-8\r\n\r\n";
+static const char header_event_stream_gzip[] =
+	"HTTP/1.1 200 OK\r\nContent-Type: text/event-stream; charset=UTF-8\r\n"
+	"Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n\r\n";
+static const char header_too_many[] =
+	"HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+static const char header_switching[] =
+	"HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+static const char header_accepted[] =
+	"HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n";
+static const char header_bad_gateway[] =
+	"HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n";
+static const char header_gateway_timeout[] =
+	"HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\n\r\n";
+static const char header_unavailable[] =
+	"HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+static const char header_not_found[] =
+	"HTTP/1.1 404 Not Found\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: ";
+static const char header_content_length[] = "Content-Length: ";
+static const char header_gzip[] = "Content-Encoding: gzip\r\n";
+static const char header_brotli[] = "Content-Encoding: br\r\n";
+static const char header_vary[] = "Vary: Accept-Encoding\r\n";
+static const char header_not_modified[] = "HTTP/1.1 304 Not Modified\r\n";
+static const char header_etag[] = "ETag: ";
+static const char header_line_end[] = "\r\n";
+static const char page_not_found[] =
+	"<html><head></head><body>404: File not found</body></html>";
+
+//  Run time options, given on the command line as name=value
+int   opt_sse_gzip;
+int   opt_cache_html = 0;
+int   opt_cache_script = 0;
+int   opt_cache_image = 86400;
+int   opt_workers = 4;
+int   opt_queue = 32;
+int   opt_uring;
+int   opt_sse_timeout = 10;
+int   opt_listeners;
+int   opt_backlog = 128;
+int   opt_control;
+int   opt_shm;
+int   opt_board;
+int   opt_keyframe = 1;
+int   opt_trace;
+int   opt_log_level = 2;
+int   opt_log_rate = 1000;
+int   opt_log_records = 32;
+int   opt_trace_spans = 512;
+int   opt_input_age = 5;
+int   opt_stack = 64;
+int   opt_sample = 1000000;
+int   opt_sample_min;
+int   opt_connect_rate = 20;
+int   opt_connect_burst = 40;
+int   opt_put_rate = 10;
+int   opt_put_burst = 20;
+int   opt_write_rate = 50;
+int   opt_h2 = 1;
+int   opt_stats_save = 300;
+const char * opt_udp;
+const char * opt_udp_interface;
+const char * opt_upstream;
+const char * opt_gateway_peer;
+const char * opt_stats_file = "/var/tmp/piface_digital_2_stats";
+struct Option {
+	const char * name;
+	int        * value;
+};
+static struct Option options[] = {
+	{ "sse_gzip",     &opt_sse_gzip },
+	{ "cache_html",   &opt_cache_html },
+	{ "cache_script", &opt_cache_script },
+	{ "cache_image",  &opt_cache_image },
+	{ "workers",      &opt_workers },
+	{ "queue",        &opt_queue },
+	{ "uring",        &opt_uring },
+	{ "sse_timeout",  &opt_sse_timeout },
+	{ "listeners",    &opt_listeners },
+	{ "backlog",      &opt_backlog },
+	{ "control",      &opt_control },
+	{ "shm",          &opt_shm },
+	{ "board",        &opt_board },
+	{ "keyframe",     &opt_keyframe },
+	{ "trace",        &opt_trace },
+	{ "log_level",    &opt_log_level },
+	{ "log_rate",     &opt_log_rate },
+	{ "log_records",  &opt_log_records },
+	{ "trace_spans",  &opt_trace_spans },
+	{ "input_age",    &opt_input_age },
+	{ "stack",        &opt_stack },
+	{ "sample",       &opt_sample },
+	{ "sample_min",   &opt_sample_min },
+	{ "connect_rate", &opt_connect_rate },
+	{ "connect_burst", &opt_connect_burst },
+	{ "put_rate",     &opt_put_rate },
+	{ "put_burst",    &opt_put_burst },
+	{ "write_rate",   &opt_write_rate },
+	{ "h2",           &opt_h2 },
+	{ "stats_save",   &opt_stats_save },
+};
+
+//  Options whose value is text
+struct Text_Option {
+	const char *  name;
+	const char ** value;
+};
+static struct Text_Option text_options[] = {
+	{ "udp",          &opt_udp },
+	{ "udp_interface", &opt_udp_interface },
+	{ "stats_file",   &opt_stats_file },
+	{ "upstream",     &opt_upstream },
+	{ "gateway_peer", &opt_gateway_peer },
+};
+
+//  The requests that are not for files on disk, and the routine that
+//  services each. A new one needs only a line here. The routes are
+//  found by a perfect hash of the method and name, worked out by the
+//  compiler: it looks for a seed under which no two routes share a
+//  slot, and refuses to build if there is none.
+#define ROUTE_SLOTS 32
+
+struct Route {
+	int          method;
+	const char * name;
+	bool      ( *handler ) ( char *, int );
+};
+
+static constexpr struct Route routes[] = {
+	{ REQUEST_GET, "config.qif",   route_config },
+	{ REQUEST_GET, "events.qif",   route_events },
+	{ REQUEST_GET, "gateway.qif",  route_gateway },
+	{ REQUEST_GET, "limits.qif",   route_limits },
+	{ REQUEST_GET, "log.qif",      route_log },
+	{ REQUEST_GET, "trace.qif",    route_trace },
+	{ REQUEST_GET, "upstreams.qif", route_upstreams },
+	{ REQUEST_GET, "sequence.qif", route_sequence },
+	{ REQUEST_GET, "state.qif",    route_state },
+	{ REQUEST_GET, "stats.qif",    route_stats },
+	{ REQUEST_PUT, "config.qif",   process_config_request },
+	{ REQUEST_PUT, "gateway.qif",  process_gateway_request },
+	{ REQUEST_PUT, "log.qif",      process_log_request },
+	{ REQUEST_PUT, "sequence.qif", process_sequence_request },
+	{ REQUEST_PUT, "set_bit.qif",  process_put_request },
+	{ REQUEST_PUT, "trace.qif",    process_trace_request },
+};
+static constexpr int route_count = sizeof ( routes ) / sizeof ( routes[0] );
+
+//  Like gperf, the hash looks at the method, the length and three of
+//  the characters of the name, so it takes the same time however long
+//  the name is. The whole name is compared once the route is found.
+constexpr unsigned route_hash ( unsigned seed, int method, const char * name, int length ) {
+	unsigned hash = 0;
+	if ( length == 0 ) {
+		return 0;
+	}
+	hash = ( seed ^ method ^ ( length << 8 ) ^ ( (unsigned char) name[0] << 16 ) ) * 2654435761U;
+	hash = ( hash ^ (unsigned char) name[length / 2] ^ ( (unsigned char) name[length - 1] << 8 ) ) * 2246822519U;
+	return hash ^ ( hash >> 16 );
+}
+
+constexpr int route_length ( const char * name ) {
+	int length = 0;
+	while ( name[length] ) {
+		length++;
+	}
+	return length;
+}
+
+//  The first seed that puts every route in a slot of its own, or 0
+constexpr unsigned route_seed ( ) {
+	for ( unsigned seed = 1; seed < 10000; seed++ ) {
+		bool used[ROUTE_SLOTS] = { };
+		bool perfect = true;
+		for ( int i = 0; i < route_count && perfect; i++ ) {
+			unsigned slot = route_hash ( seed, routes[i].method, routes[i].name,
+				route_length ( routes[i].name ) ) % ROUTE_SLOTS;
+			perfect = !used[slot];
+			used[slot] = true;
+		}
+		if ( perfect ) {
+			return seed;
+		}
+	}
+	return 0;
+}
+static constexpr unsigned route_seed_value = route_seed ( );
+static_assert ( route_seed_value != 0, "no perfect hash for the routes: two look alike to route_hash, "
+	"or ROUTE_SLOTS needs to be bigger" );
+
+//  One more than the index of the route in each slot, 0 if none
+struct Route_Slots {
+	unsigned char route[ROUTE_SLOTS];
+};
+constexpr struct Route_Slots route_slots_build ( ) {
+	struct Route_Slots slots = { };
+	for ( int i = 0; i < route_count; i++ ) {
+		slots.route[route_hash ( route_seed_value, routes[i].method, routes[i].name,
+			route_length ( routes[i].name ) ) % ROUTE_SLOTS] = i + 1;
+	}
+	return slots;
+}
+static constexpr struct Route_Slots route_slots = route_slots_build ( );
+
+//  Status line and content type for each kind of file served
+//  from disk, and the option holding how many seconds browsers
+//  may cache it for. The last entry is the default.
+struct Content_Type {
+	const char * extension;
+	const char * header;
+	bool         text;
+	int        * max_age;
+};
+static const struct Content_Type content_types[] = {
+	{ ".html", "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n", true, &opt_cache_html },
+	{ ".js",   "HTTP/1.1 200 OK\r\nContent-Type: application/javascript; charset=UTF-8\r\n", true, &opt_cache_script },
+	{ ".css",  "HTTP/1.1 200 OK\r\nContent-Type: text/css; charset=UTF-8\r\n", true, &opt_cache_script },
+	{ ".png",  "HTTP/1.1 200 OK\r\nContent-Type: image/png\r\n", false, &opt_cache_image },
+	{ ".ico",  "HTTP/1.1 200 OK\r\nContent-Type: image/x-icon\r\n", false, &opt_cache_image },
+	{ "",      "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\n", true, &opt_cache_html },
+};
+
+//  Files served from disk are read, compressed and given their
+//  validators once. After loading, an asset is never modified or
+//  freed, so it can be read without holding asset_mutex.
+//  Each variant has its own strong ETag, as required for
+//  differently encoded representations.
+//  A page may show the state as it is when the page is served, with
+//  {{di0}} to {{di7}} for the inputs and {{t0}} to {{t7}} for the
+//  outputs. Pages are compiled when they are loaded: the body keeps
+//  the text between the placeholders, and each placeholder becomes a
+//  slot saying where in the body its one character goes, and which
+//  bit it shows.
+#define MAX_TEMPLATE_SLOTS 32
+#define SLOT_INPUT         0
+#define SLOT_OUTPUT        1
+
+struct Template_Slot {
+	int offset;
+	int kind;
+	int bit;
+};
+
+struct Asset {
+	char   name[300];
+	const struct Content_Type * type;
+	char   cache_control[48];
+	char * body;
+	int    body_length;
+	char   etag[20];
+	char * gzip;
+	int    gzip_length;
+	char   gzip_etag[20];
+	char * brotli;
+	int    brotli_length;
+	char   brotli_etag[20];
+	struct Template_Slot * slots;
+	int    slot_count;
+};
+static struct Asset    assets[MAX_ASSETS];
+static int             asset_count;
+static pthread_mutex_t asset_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 //  Version control
 char   version[] = "v0.0.1";
@@ -106,697 +593,7436 @@ char   version[] = "v0.0.1";
 int   verbose;
 int   try_catch_count;
 
-//  Interface between the main application and the threads
-//  used to service web browser requests
-pthread_t thread;
-struct Thread_Args {
-	int fd;
-	int counter_unused;
-	char * extra_unused;
+//  Logging. Messages at or below opt_log_level are formatted by the
+//  thread logging them into a ring of its own, with no lock, and
+//  written out in batches by the log thread, so a slow terminal
+//  never holds up a request. Verbose ("v") is log_level=3. Each
+//  thread may log at most log_rate messages a second; messages over
+//  the rate, or that find the ring full, are counted and dropped.
+//  A ring holds log_records messages, rounded up to a power of two,
+//  and is allocated on the thread's first message.
+#define LOG_ERROR        0
+#define LOG_WARN         1
+#define LOG_INFO         2
+#define LOG_DEBUG        3
+
+#define LOG_RECORD_SIZE  256
+
+struct Log_Ring {
+	char            ( * record )[LOG_RECORD_SIZE];
+	unsigned           size;
+	unsigned           head;
+	unsigned           tail;
+	unsigned           dropped;
+	int                thread;
+
+	//  The rate limit, and the time of day of the last message
+	double             tokens;
+	struct timespec    refilled;
+	time_t             second;
+	char               clock[16];
+	struct Log_Ring  * next;
+};
+static struct Log_Ring *         log_rings;
+static pthread_mutex_t           log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long        log_dropped;
+static __thread struct Log_Ring * log_ring;
+
+//  Interface between an acceptor thread and the worker threads used
+//  to service web browser requests. Accepted sockets wait here for
+//  a free worker; when it is full, new connections are turned away
+//  so that a flood of them cannot use up memory.
+struct Connection_Queue {
+	int           * fd;
+	int             size;
+	int             head;
+	int             count;
+	pthread_mutex_t mutex;
+	pthread_cond_t  not_empty;
 };
 
 //  When an output is changed in one web browser, all the other
 //  currently connected web browsers need to be informed.
-//  The variables below support this need.
-#define MAX_EVENT_STREAM 10
-static int  event_stream[MAX_EVENT_STREAM];
-static bool event_waiting[MAX_EVENT_STREAM];
+//  The variables below support this need. The event streams
+//  belong to the event thread once registered, and are guarded by
+//  event_mutex, as is the output state they report.
+//  Event stream sockets never block. Each stream holds at most the
+//  one event being written; the next is only built once that has
+//  gone, so a web browser that falls behind skips to the latest
+//  state instead of building up a backlog.
+//  Each event is written out once, into a frame from the buffer pool
+//  that every stream sending it shares, counting its references.
+//  There are two current frames, with and without the outputs, and
+//  each is only built again once the state it carries is out of
+//  date. A stream sends the outputs when the number of the last
+//  change to them differs from the one it last sent. Compressed
+//  streams each have a deflate history of their own, so each
+//  compresses the shared frame into one of its own.
+#define MAX_EVENT_STREAM   64
+#define EVENT_SEND_BUFFER  2048
+#define EVENT_FRAME_SIZE   300
+
+struct Event_Frame {
+	int                references;
+	int                length;
+	int                input;
+	unsigned long long output_sequence;
+	char               data[EVENT_FRAME_SIZE];
+};
+
+struct Event_Stream {
+	int      fd;
+	bool     gzip;
+	z_stream deflate;
+	unsigned long long output_sequence;
+
+	//  For a stream of gateway.qif, the round of gateway events it
+	//  was last sent
+	bool     gateway;
+	unsigned long long gateway_round;
+
+	//  The event being written and how much of it has gone, and
+	//  since when the web browser has been unable to take more
+	struct Event_Frame * frame;
+	int      frame_sent;
+	bool     stalled;
+	time_t   stalled_since;
+
+	//  With the io_uring backend, the ring the stream was accepted
+	//  on, whether the stream is waiting on the ring, whether the
+	//  kernel is still sending its frame, and a count of the times
+	//  the slot has been reused, so that late completions are
+	//  ignored. A slot is not reused while its frame is being sent.
+	struct Uring * ring;
+	bool     busy;
+	bool     sending;
+	int      generation;
+};
+//  The inputs are sampled every sample microseconds. Given a
+//  sample_min as well, the sampler goes to that as soon as an input
+//  changes, then doubles the period each quiet sample until it is
+//  back to sample. Browsers are sent an event when the state changes,
+//  and once a second regardless.
+#define MIN_SAMPLE_PERIOD  100
+#define MAX_SAMPLE_PERIOD  1000000
+#define EVENT_HEARTBEAT    1000000000ULL
+
+static int sample_current = MAX_SAMPLE_PERIOD;
+
+static struct Event_Stream  event_stream[MAX_EVENT_STREAM];
+static struct Event_Frame * event_frames[2];
+static pthread_mutex_t      event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long   output_sequence = 1;
+
+//  Held while publish_state takes the state and passes it on, so that
+//  the followers are given states in the order they happened
+static pthread_mutex_t      publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//  Count of the rounds of events sent, for the HTTP/2 event streams
+static unsigned long long   event_round;
 static char output[8];
 
-//  PiFace digital 2 variables
+//  Control programs on the same Pi, connected to the Unix domain
+//  socket opened with control=1 (see piface_control.h). The control
+//  thread reads their requests. Events are sent to subscribers by
+//  whichever thread changes the state, holding control_mutex, and
+//  never wait: a subscriber that cannot take one is marked behind
+//  and sent the latest state at the next chance. A reply to a
+//  request waits up to CONTROL_REPLY_TIME milliseconds for room,
+//  after which the control program is dropped rather than left
+//  waiting for a reply that never comes.
+#define MAX_CONTROL_CLIENT 16
+#define CONTROL_REPLY_TIME 1000
+struct Control_Client {
+	int  fd;
+	bool subscribed;
+	bool behind;
+};
+static struct Control_Client control_client[MAX_CONTROL_CLIENT];
+static pthread_mutex_t       control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int                   control_input = -1;
+static int                   control_output = -1;
+
+//  The output sequence started with a PUT to sequence.qif. Its steps
+//  are checked once, up front, then carried out by the sequence
+//  thread against absolute deadlines, so that the time between them
+//  owes nothing to the browser or the network. One sequence runs at
+//  a time; a new one must wait until it finishes or is cancelled.
+#define MAX_SEQUENCE_STEP   64
+#define MAX_SEQUENCE_DELAY  60000
+
+#define SEQUENCE_IDLE       0
+#define SEQUENCE_RUNNING    1
+#define SEQUENCE_DONE       2
+#define SEQUENCE_CANCELLED  3
+
+struct Sequence_Step {
+	int mask;
+	int value;
+
+	//  Milliseconds to wait before the next step
+	int delay;
+};
+struct Sequence {
+	struct Sequence_Step step[MAX_SEQUENCE_STEP];
+	int             count;
+	int             done;
+	int             id;
+	int             state;
+	pthread_mutex_t mutex;
+	pthread_cond_t  changed;
+};
+static struct Sequence sequence;
+static const char * sequence_state_name[] = { "idle", "running", "done", "cancelled" };
+
+//  Tracing, turned on with trace=1 or a PUT of trace.qif?on. Each thread
+//  records the stages of the requests it handles as spans in a ring
+//  of its own, so recording takes no lock; the oldest spans are
+//  overwritten. A ring holds trace_spans spans, rounded up to a power
+//  of two, and is allocated on the thread's first span. With tracing
+//  off, a stage costs one test of tracing.
+//  The rings are dumped as Chrome trace_event JSON from trace.qif,
+//  or to TRACE_FILE on SIGUSR1. A dump carries at most
+//  TRACE_DUMP_SPANS spans, the latest of each thread's, shared out
+//  between the threads, and each takes at most TRACE_SPAN_JSON bytes.
+#define TRACE_DUMP_SPANS 2048
+#define TRACE_SPAN_JSON  128
+#define TRACE_FILE       "/tmp/piface_digital_2_trace.json"
+
+struct Trace_Span {
+	const char *       name;
+	unsigned long long start;
+	unsigned long long duration;
+};
+struct Trace_Ring {
+	struct Trace_Span * span;
+	unsigned           size;
+	unsigned           head;
+	int                thread;
+	struct Trace_Ring * next;
+};
+static bool                        tracing;
+static volatile sig_atomic_t       trace_dump_wanted;
+static struct Trace_Ring *         trace_rings;
+static pthread_mutex_t             trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct Trace_Ring * trace_ring;
+
+//  The state as seen by state.qif, numbered so that a script can ask
+//  to hear of the next change. Requests waiting for a change are
+//  parked here, socket, the state they wait to see change and
+//  deadline, rather than holding a thread. The thread that sees the
+//  state change only notes it and wakes the state wait thread, which
+//  answers them, or answers them when their time is up. A reply the
+//  socket will not take at once is finished as it drains, or dropped
+//  after STATE_REPLY_TIME seconds.
+#define MAX_STATE_WAITER   64
+#define MAX_STATE_WAIT     60000
+#define STATE_REPLY_TIME   5
+
+struct State_Waiter {
+	int                fd;
+	unsigned long long after;
+	unsigned long long deadline;
+};
+struct State_Reply {
+	int                fd;
+	int                length;
+	int                sent;
+	time_t             deadline;
+	char               data[200];
+};
+static struct State_Waiter state_waiter[MAX_STATE_WAITER];
+static int                 state_waiter_count;
+static unsigned long long  state_sequence;
+static int                 state_input = -1;
+static int                 state_output = -1;
+static pthread_mutex_t     state_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int                 state_wait_fd = -1;
+static struct State_Reply  state_reply[MAX_STATE_WAITER];
+
+//  The state page in shared memory, published with shm=1 for
+//  programs on the same Pi to read for themselves (see
+//  piface_state.h). state_mutex keeps writers apart; readers take
+//  no lock at all.
+static struct State_Page * state_page;
+static pthread_mutex_t     state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//  The UDP publisher, started with udp=address:port. Each change of
+//  state goes out as one datagram, with a keyframe every keyframe
+//  seconds so that a collector that starts late, or has lost
+//  datagrams, soon knows where it stands.
+static int             udp_fd = -1;
+static pthread_mutex_t udp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t        udp_sequence;
+static int             udp_input = -1;
+static int             udp_output = -1;
+static time_t          udp_sent;
+
+//  Statistics for maintenance: for each pin, inputs then outputs, how
+//  long it has been on in all, how many times it has changed, and its
+//  duty cycle over the last minute, hour and day. A pin is on when
+//  its bit is 1, as shown on the page, and an input is taken to have
+//  held its state from one sample to the next. The figures are
+//  brought up to date each time the state is published, at the same
+//  cost however long the window: each window is a ring of STATS_SLOTS
+//  slots, holding the on time of each pin in each slot, with a running
+//  total from which the oldest slot is taken as the window moves on.
+//  The totals are written to stats_file every stats_save seconds, and
+//  read back at start up; the windows start afresh.
+#define STATS_PINS     16
+#define STATS_WINDOWS  3
+#define STATS_SLOTS    60
+#define STATS_VERSION  1
+
+struct Stats_Pin {
+	unsigned long long on_time;
+	unsigned long long edges;
+	unsigned long long changed;
+};
+struct Stats_Window {
+	unsigned long long slot_start;
+	int                slot;
+	int                filled;
+	unsigned long long total[STATS_PINS];
+	unsigned long long on[STATS_SLOTS][STATS_PINS];
+};
+static const unsigned long long stats_window_length[STATS_WINDOWS] = {
+	60 * 1000000000ULL, 3600 * 1000000000ULL, 86400 * 1000000000ULL };
+static struct {
+	struct Stats_Pin    pin[STATS_PINS];
+	struct Stats_Window window[STATS_WINDOWS];
+	unsigned long long  started;
+	unsigned long long  time;
+	int                 state;
+	pthread_mutex_t     mutex;
+} stats = { {}, {}, 0, 0, -1, PTHREAD_MUTEX_INITIALIZER };
+
+//  Buffers for requests and responses, in a few sizes, kept on free
+//  lists once used rather than handed back to malloc, so that the
+//  threads need not carry them on their stacks. Each has a header in
+//  front saying which size it is; anything bigger than the largest
+//  size comes straight from malloc and goes straight back.
+#define BUFFER_CLASSES 4
+
+struct Buffer {
+	struct Buffer * next;
+	int             size_class;
+	int             size;
+};
+
+static const int      buffer_class_size[BUFFER_CLASSES] = { 512, 2048, 8192, 65536 };
+static const int      buffer_class_count[BUFFER_CLASSES] = { 32, 16, 16, 4 };
+static struct Buffer * buffer_free[BUFFER_CLASSES];
+static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//  Admission control. Each web browser's address has a token bucket
+//  for new connections and another for PUTs, so that a runaway script
+//  is turned away with a 429 before it costs more than an accept, and
+//  the outputs have a bucket of their own that every write to the
+//  SPI bus, from a browser or a control program, must draw on. A rate
+//  of 0 turns the limit off. The table of addresses is small, so the
+//  one seen longest ago makes way for a new one. The PUTs of a
+//  gateway, given by gateway_peer, carry the commands of all its
+//  viewers, each limited by the gateway itself, so they are not
+//  limited by address here.
+#define MAX_RATE_CLIENT  256
+#define RATE_PROBE       8
+#define MAX_RATE_EXEMPT  8
+
+#define RATE_CONNECT     0
+#define RATE_PUT         1
+#define RATE_WRITE       2
+
+struct Rate_Bucket {
+	double             tokens;
+	unsigned long long time;
+};
+
+struct Rate_Client {
+	in_addr_t          address;
+	unsigned long long seen;
+	struct Rate_Bucket bucket[2];
+};
+
+static struct Rate_Client rate_client[MAX_RATE_CLIENT];
+static in_addr_t          rate_exempt[MAX_RATE_EXEMPT];
+static int                rate_exempt_count;
+static struct Rate_Bucket rate_write;
+static unsigned long long rate_rejected[3];
+static pthread_mutex_t    rate_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const char * rate_name[] = { "connect", "put", "write" };
+
+//  The io_uring backend, selected with uring=1. All socket I/O for
+//  web browser requests runs on one ring per listener: a multishot
+//  accept on the listening socket, receives into a group of buffers
+//  that the kernel hands out as data arrives, and each response
+//  written with a send linked to the close of its socket. The event
+//  thread queues each stream's frames on the ring it came from, so a
+//  round of events costs one system call per ring however many
+//  browsers are listening.
+//  The listener's acceptor thread owns the completion queue.
+//  Submission queue entries may be filled in by any thread holding
+//  the ring's mutex.
+#define URING_ENTRIES      256
+#define URING_BUFFER_GROUP 1
+
+#define URING_ACCEPT       1
+#define URING_RECV         2
+#define URING_WRITE        3
+#define URING_CLOSE        4
+#define URING_EVENT        5
+#define URING_IGNORE       6
+#define URING_OP_MASK      7
+
+struct Uring_Connection {
+	int    fd;
+	char * request;
+	int    request_length;
+	char * response;
+	int    response_length;
+	int    response_sent;
+	bool   keep_open;
+	struct Uring * ring;
+	struct Uring_Connection * next_free;
+};
+struct Uring {
+	int                  fd;
+	unsigned           * sq_head;
+	unsigned           * sq_tail;
+	unsigned           * sq_mask;
+	unsigned           * sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned           * cq_head;
+	unsigned           * cq_tail;
+	unsigned           * cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned             sq_entries;
+	unsigned             sq_pending_tail;
+	pthread_mutex_t      mutex;
+	int                  listen_fd;
+	bool                 multishot;
+	char               * buffers;
+	int                  buffer_count;
+	struct Uring_Connection * connections;
+	struct Uring_Connection * free_connections;
+};
+
+//  Each listening socket shares the port with the others through
+//  SO_REUSEPORT, so the kernel spreads new connections across them
+//  instead of waking every acceptor for each one. A listener's
+//  acceptor thread, and the workers fed from its queue, are pinned
+//  to one core, so a connection is accepted, read and answered
+//  without moving between caches.
+struct Listener {
+	int    fd;
+	int    cpu;
+	pthread_t               thread;
+	struct Connection_Queue queue;
+	struct Uring            ring;
+};
+static struct Listener * listeners;
+static int               listener_count;
+static bool              uring_enabled;
+
+//  Set while the main thread handles a request on the ring, so that
+//  the response is gathered up for a linked send instead of being
+//  written straight to the socket.
+static __thread struct Uring_Connection * uring_capture;
+
+//  HTTP/2 without TLS (h2c), for clients that ask for it, either with
+//  the connection preface straight away (prior knowledge) or with an
+//  HTTP/1.1 request carrying "Upgrade: h2c". Such a connection is
+//  handed over to the HTTP/2 thread, which owns it from then on and
+//  never blocks on it. Each stream's request is put back together as
+//  HTTP/1.1 text and handed to the HTTP/2 workers, which serve it as
+//  any other and post the response they gathered up back to the
+//  HTTP/2 thread to be sent as frames, so routes and files need
+//  nothing of their own, and a slow request holds up no other. A GET of events.qif becomes a stream that stays open,
+//  sent the shared event frames as the event thread publishes them,
+//  so one connection can carry the events and the commands at once.
+//  Responses are sent no faster than the client's flow control
+//  windows allow; an event stream that has no room for an event
+//  skips it, and is sent the latest state once it has room.
+#define MAX_H2_CONNECTION   16
+#define MAX_H2_STREAM       16
+#define MAX_H2_JOB          ( MAX_H2_CONNECTION * MAX_H2_STREAM )
+#define H2_WORKERS          2
+#define H2_FRAME_SIZE       16384
+#define H2_WINDOW           65535
+#define H2_TABLE_SIZE       4096
+#define H2_TABLE_FIELDS     128
+#define H2_INPUT_SIZE       32768
+#define H2_OUTPUT_LIMIT     65536
+#define H2_PREFACE_LENGTH   24
+
+#define H2_PRIOR_KNOWLEDGE  1
+#define H2_UPGRADE          2
+
+//  Frame types, flags and error codes, from RFC 9113
+#define H2_DATA             0
+#define H2_HEADERS          1
+#define H2_PRIORITY         2
+#define H2_RST_STREAM       3
+#define H2_SETTINGS         4
+#define H2_PUSH_PROMISE     5
+#define H2_PING             6
+#define H2_GOAWAY           7
+#define H2_WINDOW_UPDATE    8
+#define H2_CONTINUATION     9
+
+#define H2_END_STREAM       0x1
+#define H2_ACK              0x1
+#define H2_END_HEADERS      0x4
+#define H2_PADDED           0x8
+#define H2_PRIORITY_FLAG    0x20
+
+#define H2_PROTOCOL_ERROR     0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR   0x6
+#define H2_REFUSED_STREAM     0x7
+#define H2_COMPRESSION_ERROR  0x9
+#define H2_ENHANCE_YOUR_CALM  0xb
+
+//  A header field in the HPACK dynamic table, name and value in one
+//  allocation. The table is a ring, newest last.
+struct H2_Field {
+	char * name;
+	int    name_length;
+	char * value;
+	int    value_length;
+};
+struct H2_Table {
+	struct H2_Field field[H2_TABLE_FIELDS];
+	int    first;
+	int    count;
+	int    size;
+	int    max_size;
+};
+
+struct H2_Stream {
+	unsigned id;
+	int      window;
+
+	//  Whether the client has sent all of the request, and whether
+	//  it has been dispatched
+	bool     end_stream;
+	bool     dispatched;
+
+	//  For an event stream, the round of events, or of gateway
+	//  events, and the change to the outputs it was last sent
+	bool     events;
+	bool     gateway;
+	unsigned long long event_round;
+	unsigned long long output_sequence;
+
+	//  The request as HTTP/1.1 text, and the body of the response
+	//  still to be sent
+	char   * request;
+	int      request_length;
+	char   * response;
+	int      response_length;
+	int      response_sent;
+};
+
+struct H2_Connection {
+	int      fd;
+	bool     preface;
+	bool     closing;
+	bool     stalled;
+	time_t   stalled_since;
+
+	//  What the client allows to be sent: on the connection as a
+	//  whole, on each new stream, and in one frame
+	int      window;
+	int      peer_window;
+	int      peer_frame;
+
+	//  The last stream opened, and the header block being gathered
+	//  up from HEADERS and CONTINUATION frames
+	unsigned last_stream;
+	unsigned continuation;
+	bool     block_end_stream;
+	char   * block;
+	int      block_length;
+
+	//  Told apart from the connections that had the slot before, so
+	//  that a response finished after the connection closed is let go
+	unsigned generation;
+
+	//  Bytes received but not yet made into frames, and frames
+	//  waiting to be sent
+	char   * input;
+	int      input_length;
+	char   * output;
+	int      output_length;
+	struct H2_Table  table;
+	struct H2_Stream stream[MAX_H2_STREAM];
+
+	//  For a connection the gateway has made to an upstream server,
+	//  the upstream; the frames that arrive are its responses
+	struct Upstream * upstream;
+};
+
+//  Connections handed over to the HTTP/2 thread, and not yet taken up
+struct H2_Adopted {
+	int    fd;
+	char * data;
+	int    length;
+	bool   upgrade;
+};
+
+//  A stream's request handed to the HTTP/2 workers, and the response
+//  they gather up for it. The HTTP/2 thread fills in a free job and
+//  queues it; a worker takes it, serves it, and marks it done, for
+//  the HTTP/2 thread to send the response on the stream, if it is
+//  still open, and free the job. All under h2_job_mutex.
+#define H2_JOB_FREE         0
+#define H2_JOB_QUEUED       1
+#define H2_JOB_DONE         2
+struct H2_Job {
+	int      state;
+	int      fd;
+	int      connection;
+	unsigned generation;
+	unsigned id;
+	char   * request;
+	int      request_length;
+	char   * capture;
+	int      capture_length;
+};
+
+static struct H2_Connection h2_connection[MAX_H2_CONNECTION];
+static struct H2_Adopted    h2_adopted[MAX_H2_CONNECTION];
+static int                  h2_adopted_count;
+static int                  h2_connection_count;
+static unsigned             h2_generation;
+static struct H2_Job        h2_job[MAX_H2_JOB];
+static int                  h2_job_queue[MAX_H2_JOB];
+static int                  h2_job_head;
+static int                  h2_job_count;
+static pthread_mutex_t      h2_job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       h2_job_ready = PTHREAD_COND_INITIALIZER;
+static int                  h2_wake_fd = -1;
+static pthread_mutex_t      h2_mutex = PTHREAD_MUTEX_INITIALIZER;
+static short                h2_huffman_tree[256][2];
+static const char h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+//  Set while an HTTP/2 worker serves a stream's request, so that the
+//  response is gathered up to be sent as frames.
+static __thread struct H2_Job * h2_capture;
+
+//  The HPACK Huffman code, and the static table, from RFC 7541
+static const unsigned h2_huffman_code[257] = {
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+	0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+	0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+	0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+	0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+	0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+	0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+	0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+	0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+	0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+	0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+	0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+	0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+	0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+	0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+	0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+	0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+	0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+	0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+	0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+	0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+	0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+	0x3fffffff,
+};
+static const unsigned char h2_huffman_length[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+static const char * h2_static_table[][2] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+//  Gateway mode, started with upstream=A:P,A:P,... The gateway makes
+//  one HTTP/2 connection to each upstream server, the upstreams being
+//  numbered as boards from 0 in the order given. It carries the
+//  upstream's events.qif stream and the output commands forwarded to
+//  it, so an upstream sees one connection however many browsers
+//  follow the gateway. The gateway thread reads them all and merges
+//  the changes into rounds of events for gateway.qif, each written
+//  once and shared like the events of the board itself: a round
+//  carries the boards that changed since the last, and a stream that
+//  has missed a round, or has just opened, is sent every board. Every
+//  board is sent once a second regardless. A connection that fails,
+//  or is silent for UPSTREAM_SILENCE seconds, is made again, after a
+//  wait that doubles with each failure. A PUT of gateway.qif is
+//  parked, like a waiting state.qif, until the upstream answers.
+#define MAX_UPSTREAM          16
+#define MAX_UPSTREAM_COMMAND  8
+#define UPSTREAM_SILENCE      5
+#define UPSTREAM_RETRY        30
+#define UPSTREAM_TIMEOUT      3
+#define UPSTREAM_EVENT_SIZE   256
+
+struct Upstream_Command {
+	bool     used;
+
+	//  The stream it was sent on, 0 until it is sent
+	unsigned id;
+
+	//  The browser waiting for the answer, or -1 if there is none
+	int      fd;
+	int      bit;
+	int      value;
+	time_t   deadline;
+};
+struct Upstream {
+	struct sockaddr_in address;
+	char     name[32];
+	struct H2_Connection connection;
+	bool     connecting;
+	bool     connected;
+	unsigned next_stream;
+
+	//  When it was last heard from, when to try it again, how long
+	//  to wait after the next failure, and how many times it has
+	//  been lost
+	time_t   heard;
+	time_t   retry;
+	int      backoff;
+	unsigned long long lost;
+
+	//  The event stream as it arrives, up to the end of the event in
+	//  progress
+	char     event[UPSTREAM_EVENT_SIZE];
+	int      event_length;
+
+	//  The state last heard, -1 until it is known, and whether and in
+	//  which round of events it changed. Guarded by event_mutex.
+	int      input;
+	int      output;
+	bool     changed;
+	unsigned long long round;
+
+	//  Output commands waiting to be sent, or for their answers.
+	//  Guarded by gateway_mutex.
+	struct Upstream_Command command[MAX_UPSTREAM_COMMAND];
+};
+static struct Upstream      upstreams[MAX_UPSTREAM];
+static int                  upstream_count;
+static int                  gateway_wake_fd = -1;
+static pthread_mutex_t      gateway_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct Event_Frame * gateway_frames[2];
+static unsigned long long   gateway_round = 1;
+
+//  PiFace digital 2 variables. pif_input is written by read_inputs
+//  under input_cache.mutex, and pif_output by write_outputs under
+//  event_mutex; either may be read without its lock with an atomic
+//  load.
 int   pif_input;
 int   pif_hw_addr;
 int   pif_interrupts_enabled;
 int   pif_output;
 
+//  The last reading of the inputs, and when it was taken. Readers say
+//  how old a reading they will accept; one that needs a fresh reading
+//  while another thread is already taking one waits for that instead
+//  of starting its own, so however many readers there are, there is
+//  at most one SPI transfer for the inputs at a time.
+static struct {
+	unsigned long long time;
+	bool               valid;
+	bool               reading;
+	pthread_mutex_t    mutex;
+	pthread_cond_t     done;
+} input_cache = { 0, false, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
 /*
-This procedure accepts incoming connection requests from
-web browsers. It runs in a separate thread.
-*/
-void *accept_connection ( void *ptr ) {
-	struct Thread_Args * args;
-	args = ( struct Thread_Args * ) ptr;
-	char  from_browser[5000];
-	int   i;
-	int   j;
-	int   n;
-	int   enable = 1;
-	int   service_socket_fd;
-	service_socket_fd = (*args).fd;
-	int   request_type;
+Appends the buffers to one from the pool, moving it to a bigger one
+when it fills up. A null buffer is taken from the pool.
 
-	try {
+Returns false if memory runs out.
+*/
+bool buffer_append_iov ( char ** buffer, int * buffer_length, struct iovec * iov, int count ) {
+	char * bigger;
+	int length = 0;
+	int i;
 
-		//  Configure the socket
-		i = setsockopt ( service_socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int) );
-		if ( i < 0 ) {
-			thread_error ("ERROR setsockopt SO_REUSERADDR");
+	for ( i = 0; i < count; i++ ) {
+		length += iov[i].iov_len;
+	}
+	length += *buffer_length;
+	if ( !*buffer || length > buffer_size ( *buffer ) ) {
+		bigger = buffer_get ( length );
+		if ( !bigger ) {
+			return false;
 		}
-		if ( verbose ) {
-			printf ("accept_connection: attempting to read request from browser.\n");
+		if ( *buffer ) {
+			memcpy ( bigger, *buffer, *buffer_length );
+			buffer_put ( *buffer );
 		}
+		*buffer = bigger;
+	}
+	for ( i = 0; i < count; i++ ) {
+		memcpy ( *buffer + *buffer_length, iov[i].iov_base, iov[i].iov_len );
+		*buffer_length += iov[i].iov_len;
+	}
+	return true;
+}
 
-		//  Get the request from the web browser
-		n = read (service_socket_fd, from_browser, sizeof(from_browser)-2);
-		if (n < 0) {
-			thread_error("ERROR reading from socket.\n");
-		}
-		if ( verbose ) {
-			printf ("Read %d from browser at -a\n", n);
-		}
-		from_browser[n] = 0;
-		i = test_in_string (from_browser, "Content-Length:");
+/*
+Takes a buffer of at least size bytes from the pool, or from malloc
+if the pool has none of that size to spare.
 
-		//  Wait for more if necessary
-		if (i>0) {
-			if ( verbose ) {
-				printf ("Expected more from the browser at -b\n");
-			}
-			//  Here for more from the browser
-			sleep (1);
-			j = recv (service_socket_fd, &from_browser[n], sizeof(from_browser) - 2 - n, MSG_DONTWAIT);
-			if (j<0) j=0;
-			from_browser[n+j] = 0;
-		}
-		if ( verbose ) {
-			printf ("%d, %d\n%s\n", n, j, from_browser);
-		}
-		if (n>10) {
+Returns 0 if memory runs out.
+*/
+char *buffer_get ( int size ) {
+	struct Buffer * buffer;
+	int size_class;
 
-			//  Process the request
-			request_type = get_request_type ( from_browser );
-			if ( request_type == REQUEST_GET ) {
-				process_get_request( from_browser, service_socket_fd );
-			} else
-			if ( request_type == REQUEST_PUT ) {
-				int fd = service_socket_fd;
-				process_put_request ( from_browser, fd );
-			};
+	for ( size_class = 0; size_class < BUFFER_CLASSES; size_class++ ) {
+		if ( size <= buffer_class_size[size_class] ) {
+			break;
+		}
+	}
+	if ( size_class < BUFFER_CLASSES ) {
+		pthread_mutex_lock ( &buffer_mutex );
+		buffer = buffer_free[size_class];
+		if ( buffer ) {
+			buffer_free[size_class] = buffer->next;
 		}
-		if ( verbose ) {
-			printf ("accept_connection: about to close socket.\n");
+		pthread_mutex_unlock ( &buffer_mutex );
+		if ( buffer ) {
+			return ( char * ) ( buffer + 1 );
 		}
+		size = buffer_class_size[size_class];
+	} else {
+		size_class = -1;
+	}
+	buffer = ( struct Buffer * ) malloc ( sizeof ( *buffer ) + size );
+	if ( !buffer ) {
+		return 0;
+	}
+	buffer->size_class = size_class;
+	buffer->size = size;
+	return ( char * ) ( buffer + 1 );
+}
 
-		//  Close the socket
-		close( service_socket_fd );
-		if ( verbose ) {
-			printf ("accept_connection: socket closed.\n");
+/*
+Fills the pool with the buffers the server is expected to need, so
+that serving requests does not have to wait on malloc.
+*/
+void buffer_preallocate ( ) {
+	struct Buffer * buffer;
+	int size_class;
+	int i;
+	for ( size_class = 0; size_class < BUFFER_CLASSES; size_class++ ) {
+		for ( i = 0; i < buffer_class_count[size_class]; i++ ) {
+			buffer = ( struct Buffer * ) malloc ( sizeof ( *buffer ) + buffer_class_size[size_class] );
+			if ( !buffer ) {
+				return;
+			}
+			buffer->size_class = size_class;
+			buffer->size = buffer_class_size[size_class];
+			buffer_put ( ( char * ) ( buffer + 1 ) );
 		}
+	}
+}
 
-	//  Deal with exceptions
-	} catch ( exception &e ) {
-		printf ("accept_connection exception: %s\n", e.what());
-		cleanup_server_connections( service_socket_fd );
-	} catch ( ... ) {
-		printf ("accept_connection unknown exception.\n");
-		unregister_event_stream ( service_socket_fd );
-		throw;
+/*
+Hands a buffer back to the pool, or back to malloc if it was too big
+for the pool. A null buffer is ignored.
+*/
+void buffer_put ( char * data ) {
+	struct Buffer * buffer;
+	if ( !data ) {
+		return;
 	}
-	return 0;
+	buffer = ( ( struct Buffer * ) data ) - 1;
+	if ( buffer->size_class < 0 ) {
+		free ( buffer );
+		return;
+	}
+	pthread_mutex_lock ( &buffer_mutex );
+	buffer->next = buffer_free[buffer->size_class];
+	buffer_free[buffer->size_class] = buffer;
+	pthread_mutex_unlock ( &buffer_mutex );
+}
+
+/*
+Returns how many bytes a buffer from the pool can hold.
+*/
+int buffer_size ( char * data ) {
+	return ( ( ( struct Buffer * ) data ) - 1 )->size;
 }
 
 /*
 This procedure attempts to close the indicated file descriptor
 
-It also removes the indicated fiel descriptor from the list of
-server-side event receivers.
+If the file descriptor is a registered event stream, the event
+stream is closed instead, so that the descriptor is not closed twice.
 */
 void cleanup_server_connections( int fd ) {
 	if ( fd > 0 ) {
-		close ( fd );
-		unregister_event_stream ( fd );
+		if ( !unregister_event_stream ( fd ) ) {
+			close ( fd );
+		}
 	}
 	try_catch_count++;
 }
 
-
 /*
-Prints the indicated error message
+Closes an event stream and frees its slot. The caller must hold
+event_mutex.
+
+A frame the kernel is still sending is let go of when the send
+completes, rather than here.
 */
-void error(const char *msg)
-{
-    perror(msg);
+void close_event_stream ( struct Event_Stream * stream ) {
+	if ( stream->gzip ) {
+		deflateEnd ( &stream->deflate );
+	}
+	if ( !stream->sending ) {
+		event_frame_put ( stream->frame );
+		stream->frame = 0;
+	}
+	stream->busy = false;
+	stream->frame_sent = 0;
+	stream->stalled = false;
+	stream->generation++;
+	close ( stream->fd );
+	log_message ( LOG_DEBUG, "Closed event stream %d\n", stream->fd );
+	stream->fd = -1;
 }
 
 /*
-Copy the page on disk into the output buffer
+Opens the Unix domain socket that control programs connect to.
+
+Returns -1 if the socket cannot be opened.
 */
-int expand_page (char * disk, char * expanded, int max_length) {
-	char * ptr_in;
-	char * ptr_in_;
-	char * ptr_out;
-	ptr_in = disk;
-	ptr_out = expanded;
-	for (;;) {
-		*ptr_out = *ptr_in;
-		if (*ptr_out==0) {
-			break;
-		}
-		ptr_in++;
-		ptr_out++;
+int control_open ( ) {
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket ( AF_UNIX, SOCK_SEQPACKET, 0 );
+	if ( fd < 0 ) {
+		error ( "ERROR opening control socket" );
+		return -1;
 	}
-	return ptr_out - expanded;
+	memset ( &addr, 0, sizeof ( addr ) );
+	addr.sun_family = AF_UNIX;
+	strncpy ( addr.sun_path, PIFACE_CONTROL_PATH, sizeof ( addr.sun_path ) - 1 );
+	unlink ( addr.sun_path );
+	if ( bind ( fd, ( struct sockaddr * ) &addr, sizeof ( addr ) ) < 0 ||
+			listen ( fd, opt_backlog ) < 0 ) {
+		error ( "ERROR on binding control socket" );
+		close ( fd );
+		return -1;
+	}
+	return fd;
 }
 
 /*
-Copies the indicated file from disk to the indicated buffer
+Sends the state of the inputs and outputs to every subscriber, if
+it has changed since last time, and to any subscriber that missed
+an earlier event.
 */
-int get_page (char * browser_request, char * page_name, int name_max_length, char * disk_page, int disk_max_length) {
+void control_publish ( int input, int output ) {
+	struct Control_Frame frame;
+	struct Control_Client * client;
+	bool changed;
+	int i;
 
-	char * page_parameters;
-	int page_file;
-	int page_file_length;
-#pragma GCC diagnostic ignored "-Wuninitialized"
-//  page_parameters gets warned as being uninitialized
-	get_page_name ( browser_request, page_name, name_max_length, page_parameters, disk_page );
-#pragma GCC diagnostic warning "-Wuninitialized"
-	//  Try to open the required page
-	if ( verbose ) {
-		printf("get_page: Requested +%s+\n", page_name);
-	}
-	page_file = open (page_name, O_RDONLY);
-	if (page_file<1) {
-		return send_error( disk_page );
-	}
-	page_file_length = read (page_file, disk_page, disk_max_length - 2);
-	*(disk_page+page_file_length) = 0;
-	close(page_file);
-	if ( verbose ) {
-		printf("get_page: Page length %d\n", page_file_length);
+	memset ( &frame, 0, sizeof ( frame ) );
+	frame.type = CONTROL_EVENT;
+	frame.input = input;
+	frame.output = output;
+	pthread_mutex_lock ( &control_mutex );
+	changed = input != control_input || output != control_output;
+	control_input = input;
+	control_output = output;
+	for ( i = 0; i < MAX_CONTROL_CLIENT; i++ ) {
+		client = &control_client[i];
+		if ( client->fd < 0 || !client->subscribed || !( changed || client->behind ) ) {
+			continue;
+		}
+		client->behind = send ( client->fd, &frame, sizeof ( frame ), MSG_DONTWAIT | MSG_NOSIGNAL ) < 0 &&
+			( errno == EAGAIN || errno == EWOULDBLOCK );
 	}
-	return page_file_length;
+	pthread_mutex_unlock ( &control_mutex );
 }
 
 /*
-Extracts the name of the page requested by the web browser.
-Supplies "index.html" if no page name is requested.
+Reads one request from a control program and sends the reply. Runs
+in the control thread.
 
-Returns 0 on success, -1 oterhwise.
+Returns false if the control program has gone away, or has not made
+room for the reply in time.
 */
-int get_page_name ( char * browser_request, char * page_name, int max_length, char * page_parameters, char * disk_page ) {
-	char * ptr;
-	char * page_name_end;
-	int file_length = 0;
+bool control_request ( struct Control_Client * client ) {
+	struct Control_Frame frame;
+	struct pollfd poll_fd;
+	struct timespec now;
+	long long deadline;
+	long long left;
+	int n;
 
-	//  Decode the required page
-	ptr = browser_request;
-	while (*ptr!='/') {
-		if (*ptr==0) {
-			return send_error( disk_page );
-		}
-		ptr++;
+	n = recv ( client->fd, &frame, sizeof ( frame ), 0 );
+	if ( n <= 0 ) {
+		return false;
 	}
-	ptr++;
-	page_name_end = ptr;
-	page_parameters = 0;
-	while (*page_name_end!=' ' && *page_name_end!='?') {
-		if (*page_name_end==0) {
-			return send_error( disk_page );
+	frame.status = CONTROL_OK;
+	if ( n != sizeof ( frame ) ) {
+		frame.status = CONTROL_BAD_REQUEST;
+	} else if ( frame.type == CONTROL_WRITE ) {
+		if ( rate_allow_write ( 1 ) ) {
+			write_outputs ( frame.mask, frame.value );
+		} else {
+			frame.status = CONTROL_BUSY;
 		}
-		page_name_end++;
-	}
-	if (*page_name_end=='?') {
-		page_parameters = page_name_end + 1;
+	} else if ( frame.type == CONTROL_SUBSCRIBE || frame.type == CONTROL_UNSUBSCRIBE ) {
+		pthread_mutex_lock ( &control_mutex );
+		client->subscribed = frame.type == CONTROL_SUBSCRIBE;
+		client->behind = false;
+		pthread_mutex_unlock ( &control_mutex );
+	} else if ( frame.type != CONTROL_READ ) {
+		frame.status = CONTROL_BAD_REQUEST;
 	}
-	*page_name_end = 0;
-	strcpy (page_name, ptr);
-	if (page_name_end==ptr) {
-		strcpy (page_name, "index.html");
+
+	//  Every reply carries the state as it is now, give or take
+	//  input_age milliseconds, rather than as of the last sample
+	frame.input = read_inputs ( opt_input_age );
+	frame.output = __atomic_load_n ( &pif_output, __ATOMIC_RELAXED );
+	publish_state ( );
+
+	//  A subscriber's socket may be full of events, so wait a while
+	//  for room, but not so long that the other programs stall
+	poll_fd.fd = client->fd;
+	poll_fd.events = POLLOUT;
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + CONTROL_REPLY_TIME;
+	while ( send ( client->fd, &frame, sizeof ( frame ), MSG_DONTWAIT | MSG_NOSIGNAL ) < 0 ) {
+		if ( errno == EINTR ) {
+			continue;
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		left = deadline - ( now.tv_sec * 1000LL + now.tv_nsec / 1000000 );
+		if ( ( errno != EAGAIN && errno != EWOULDBLOCK ) || left <= 0 ||
+				poll ( &poll_fd, 1, ( int ) left ) <= 0 ) {
+			log_message ( LOG_WARN, "Control program did not take its reply, dropped.\n" );
+			return false;
+		}
 	}
-	return 0;
+	return true;
 }
 
 /*
-Returns the type of request made by the web browser.
-
-Expected HTTP types are GET and PUT.
+The control thread. Accepts connections from control programs on
+the Unix domain socket and services their requests as they arrive.
 */
+void *control_server ( void * arg ) {
+	struct pollfd poll_fd[MAX_CONTROL_CLIENT + 1];
+	struct Control_Client * client[MAX_CONTROL_CLIENT + 1];
+	int listen_fd = ( int ) ( long ) arg;
+	int count;
+	int fd;
+	int i;
 
-int get_request_type ( char * p) {
-	if ( test_lead_string ( p, "GET " ) ) {
-		return REQUEST_GET;
-	}
-	if ( test_lead_string ( p, "PUT " ) ) {
-		return REQUEST_PUT;
+	log_message ( LOG_INFO, "Enter control server, %s.\n", PIFACE_CONTROL_PATH );
+	for (;;) {
+		poll_fd[0].fd = listen_fd;
+		poll_fd[0].events = POLLIN;
+		count = 1;
+		for ( i = 0; i < MAX_CONTROL_CLIENT; i++ ) {
+			if ( control_client[i].fd >= 0 ) {
+				poll_fd[count].fd = control_client[i].fd;
+				poll_fd[count].events = POLLIN;
+				client[count] = &control_client[i];
+				count++;
+			}
+		}
+		if ( poll ( poll_fd, count, -1 ) <= 0 ) {
+			continue;
+		}
+
+		//  Serve the requests that have arrived
+		for ( i = 1; i < count; i++ ) {
+			if ( poll_fd[i].revents && !control_request ( client[i] ) ) {
+				pthread_mutex_lock ( &control_mutex );
+				close ( client[i]->fd );
+				client[i]->fd = -1;
+				pthread_mutex_unlock ( &control_mutex );
+				log_message ( LOG_DEBUG, "Control program went away.\n" );
+			}
+		}
+
+		//  Take on a new control program, if there is room for it
+		if ( poll_fd[0].revents ) {
+			fd = accept ( listen_fd, NULL, NULL );
+			if ( fd < 0 ) {
+				continue;
+			}
+			pthread_mutex_lock ( &control_mutex );
+			for ( i = 0; i < MAX_CONTROL_CLIENT && control_client[i].fd >= 0; i++ ) {
+			}
+			if ( i < MAX_CONTROL_CLIENT ) {
+				control_client[i].fd = fd;
+				control_client[i].subscribed = false;
+				control_client[i].behind = false;
+			} else {
+				close ( fd );
+			}
+			pthread_mutex_unlock ( &control_mutex );
+			log_message ( LOG_DEBUG, "Control program connected.\n" );
+		}
+	}
+	return 0;
+}
+
+/*
+Takes the next accepted connection from the queue, waiting for one
+if the queue is empty.
+*/
+int connection_queue_pop ( struct Connection_Queue * queue ) {
+	int fd;
+	pthread_mutex_lock ( &queue->mutex );
+	while ( queue->count == 0 ) {
+		pthread_cond_wait ( &queue->not_empty, &queue->mutex );
+	}
+	fd = queue->fd[queue->head];
+	queue->head = ( queue->head + 1 ) % queue->size;
+	queue->count--;
+	pthread_mutex_unlock ( &queue->mutex );
+	return fd;
+}
+
+/*
+Adds an accepted connection to the queue for the worker threads.
+Never waits.
+
+Returns false if the queue is full.
+*/
+bool connection_queue_push ( struct Connection_Queue * queue, int fd ) {
+	pthread_mutex_lock ( &queue->mutex );
+	if ( queue->count == queue->size ) {
+		pthread_mutex_unlock ( &queue->mutex );
+		return false;
+	}
+	queue->fd[( queue->head + queue->count ) % queue->size] = fd;
+	queue->count++;
+	pthread_cond_signal ( &queue->not_empty );
+	pthread_mutex_unlock ( &queue->mutex );
+	return true;
+}
+
+/*
+Waits until the given time for the next sample, meanwhile writing
+the rest of any event that a web browser could not take in one go.
+Runs in the event thread.
+*/
+void drain_event_streams ( const struct timespec * until ) {
+	struct pollfd poll_fd[MAX_EVENT_STREAM];
+	int    slot[MAX_EVENT_STREAM];
+	int    generation[MAX_EVENT_STREAM];
+	struct Event_Stream * stream;
+	struct timespec now;
+	int    count;
+	int    timeout;
+	int    i;
+
+	for (;;) {
+
+		//  Note the streams with an event part written
+		count = 0;
+		pthread_mutex_lock ( &event_mutex );
+		for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+			stream = &event_stream[i];
+			if ( stream->fd >= 0 && !stream->busy && stream->frame && stream->frame_sent < stream->frame->length ) {
+				poll_fd[count].fd = stream->fd;
+				poll_fd[count].events = POLLOUT;
+				slot[count] = i;
+				generation[count] = stream->generation;
+				count++;
+			}
+		}
+		pthread_mutex_unlock ( &event_mutex );
+
+		//  Nothing to do but wait
+		if ( count == 0 ) {
+			while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, until, 0 ) == EINTR ) {
+			}
+			return;
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		timeout = ( until->tv_sec - now.tv_sec ) * 1000 + ( until->tv_nsec - now.tv_nsec ) / 1000000;
+		if ( timeout <= 0 ) {
+			return;
+		}
+		if ( poll ( poll_fd, count, timeout ) <= 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			return;
+		}
+
+		//  Carry on writing to those that can take more. The slot
+		//  may have been closed and reused while polling.
+		pthread_mutex_lock ( &event_mutex );
+		for ( i = 0; i < count; i++ ) {
+			stream = &event_stream[slot[i]];
+			if ( poll_fd[i].revents == 0 || stream->fd != poll_fd[i].fd || stream->generation != generation[i] ) {
+				continue;
+			}
+			if ( !flush_event_stream ( stream ) ) {
+				close_event_stream ( stream );
+			}
+		}
+		pthread_mutex_unlock ( &event_mutex );
+	}
+}
+
+/*
+Prints the indicated error message
+*/
+void error(const char *msg)
+{
+    log_message ( LOG_ERROR, "%s: %s\n", msg, strerror ( errno ) );
+}
+
+/*
+Returns the current event frame, with the outputs or without them,
+having written it out afresh if the state has changed since it was
+last written. The caller must hold event_mutex, and gets a reference
+to the frame which it must put when done with it.
+
+Returns 0 if memory runs out.
+*/
+struct Event_Frame *event_frame_get ( bool outputs ) {
+	struct Event_Frame * frame = event_frames[outputs];
+	int input = __atomic_load_n ( &pif_input, __ATOMIC_RELAXED );
+	int length;
+
+	if ( !frame || frame->input != input || ( outputs && frame->output_sequence != output_sequence ) ) {
+		event_frame_put ( frame );
+		frame = event_frames[outputs] = ( struct Event_Frame * ) buffer_get ( sizeof ( *frame ) );
+		if ( !frame ) {
+			return 0;
+		}
+		frame->references = 1;
+		frame->input = input;
+		frame->output_sequence = output_sequence;
+
+		//  The input as a binary number, followed by the outputs if
+		//  the browser has yet to see them
+		length = sprintf ( frame->data, "event: piface\ndata: " );
+		write_binary ( input, &frame->data[length], 8 );
+		length += 8;
+		if ( outputs ) {
+			memcpy ( &frame->data[length], output, 8 );
+			length += 8;
+		}
+		frame->data[length++] = '\n';
+		frame->data[length++] = '\n';
+		frame->data[length] = 0;
+		frame->length = length;
+		log_message ( LOG_DEBUG, "%s", frame->data );
+	}
+	frame->references++;
+	return frame;
+}
+
+/*
+Lets go of a reference to an event frame, handing the frame back to
+the buffer pool once nothing refers to it. The caller must hold
+event_mutex. A null frame is ignored.
+*/
+void event_frame_put ( struct Event_Frame * frame ) {
+	if ( frame && --frame->references == 0 ) {
+		buffer_put ( ( char * ) frame );
+	}
+}
+
+/*
+Compiles the page on disk into the output buffer: the text is copied
+as it is, except for the placeholders, which are left out and noted
+in slots instead. A placeholder that is not known, or one too many,
+is left as it is.
+
+Returns the length of the text copied.
+*/
+int expand_page ( char * disk, char * expanded, int max_length, struct Template_Slot * slots, int * slot_count ) {
+	char * ptr_in = disk;
+	char * ptr_out = expanded;
+	char * name;
+	int    kind;
+
+	*slot_count = 0;
+	while ( *ptr_in && ptr_out - expanded < max_length ) {
+		if ( ptr_in[0] == '{' && ptr_in[1] == '{' && *slot_count < MAX_TEMPLATE_SLOTS ) {
+			name = ptr_in + 2;
+			kind = -1;
+			if ( name[0] == 'd' && name[1] == 'i' ) {
+				kind = SLOT_INPUT;
+				name += 2;
+			} else if ( name[0] == 't' ) {
+				kind = SLOT_OUTPUT;
+				name += 1;
+			}
+			if ( kind >= 0 && name[0] >= '0' && name[0] <= '7' && name[1] == '}' && name[2] == '}' ) {
+				slots[*slot_count].offset = ptr_out - expanded;
+				slots[*slot_count].kind = kind;
+				slots[*slot_count].bit = name[0] - '0';
+				( *slot_count )++;
+				ptr_in = name + 3;
+				continue;
+			}
+		}
+		*ptr_out++ = *ptr_in++;
+	}
+	*ptr_out = 0;
+	return ptr_out - expanded;
+}
+
+/*
+Returns the cached copy of the named file, reading it from disk
+the first time it is asked for.
+
+Returns 0 if the file cannot be served.
+*/
+struct Asset *find_asset ( char * name ) {
+	struct Asset * asset = 0;
+	int i;
+
+	//  Refuse anything that tries to escape the document root
+	if ( test_in_string ( name, ".." ) >= 0 || *name == '/' ) {
+		return 0;
+	}
+	pthread_mutex_lock ( &asset_mutex );
+	for ( i = 0; i < asset_count; i++ ) {
+		if ( test_string ( assets[i].name, name ) ) {
+			asset = &assets[i];
+			break;
+		}
+	}
+	if ( !asset && asset_count < MAX_ASSETS ) {
+		if ( load_asset ( &assets[asset_count], name ) ) {
+			asset = &assets[asset_count];
+			asset_count++;
+		}
+	}
+	pthread_mutex_unlock ( &asset_mutex );
+	return asset;
+}
+
+/*
+Writes as much of an event stream's current event as the socket
+will take without blocking. The caller must hold event_mutex.
+
+Returns false if the web browser can no longer be written to.
+*/
+bool flush_event_stream ( struct Event_Stream * stream ) {
+	struct iovec iov;
+	int n;
+
+	//  On the ring, the first event goes out with the header
+	if ( !stream->frame ) {
+		return true;
+	}
+	if ( uring_capture ) {
+		iov.iov_base = stream->frame->data;
+		iov.iov_len = stream->frame->length;
+		stream->frame_sent = stream->frame->length;
+		return write_iov ( stream->fd, &iov, 1 ) >= 0;
+	}
+	while ( stream->frame_sent < stream->frame->length ) {
+		n = send ( stream->fd, stream->frame->data + stream->frame_sent,
+			stream->frame->length - stream->frame_sent, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		stream->frame_sent += n;
+	}
+	stream->stalled = false;
+	return true;
+}
+
+/*
+Answers a browser waiting on a command forwarded to an upstream, with
+the status the upstream gave, or 0 if it gave none, and frees the
+command's slot. The caller must hold gateway_mutex.
+*/
+void gateway_answer ( struct Upstream_Command * command, int status ) {
+	const char * header = header_bad_gateway;
+	int length = sizeof ( header_bad_gateway ) - 1;
+
+	if ( status == 200 ) {
+		header = header_put_ack;
+		length = sizeof ( header_put_ack ) - 1;
+	} else if ( status == 429 ) {
+		header = header_too_many;
+		length = sizeof ( header_too_many ) - 1;
+	} else if ( status == 504 ) {
+		header = header_gateway_timeout;
+		length = sizeof ( header_gateway_timeout ) - 1;
+	}
+	if ( command->fd >= 0 ) {
+		send ( command->fd, header, length, MSG_DONTWAIT | MSG_NOSIGNAL );
+		close ( command->fd );
+	}
+	log_message ( LOG_DEBUG, "Gateway command for stream %u answered %d.\n", command->id, status );
+	command->used = false;
+	command->id = 0;
+}
+
+/*
+Sends an upstream the commands waiting for it, each on a stream of its
+own, and answers those it has taken too long over. Commands for an
+upstream that is not connected are answered straight away.
+*/
+void gateway_commands ( struct Upstream * upstream, time_t now ) {
+	struct Upstream_Command * command;
+	char path[40];
+	int i;
+
+	pthread_mutex_lock ( &gateway_mutex );
+	for ( i = 0; i < MAX_UPSTREAM_COMMAND; i++ ) {
+		command = &upstream->command[i];
+		if ( !command->used ) {
+			continue;
+		}
+		if ( !command->id ) {
+			if ( !upstream->connected || upstream->connection.closing ) {
+				gateway_answer ( command, 0 );
+				continue;
+			}
+			sprintf ( path, "/set_bit.qif?t%d=%d", command->bit, command->value );
+			command->id = upstream->next_stream;
+			upstream->next_stream += 2;
+			if ( !gateway_request ( upstream, command->id, true, path ) ) {
+				gateway_answer ( command, 0 );
+			}
+		} else if ( now >= command->deadline ) {
+			gateway_answer ( command, 504 );
+		}
+	}
+	pthread_mutex_unlock ( &gateway_mutex );
+}
+
+/*
+Starts connecting to an upstream, without waiting for the connection
+to be made.
+*/
+void gateway_connect ( struct Upstream * upstream, time_t now ) {
+	int fd;
+
+	fd = socket ( AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+	if ( fd < 0 ) {
+		error ( "ERROR opening upstream socket" );
+		upstream->retry = now + upstream->backoff;
+		return;
+	}
+	set_tcp_option ( fd, TCP_NODELAY, 1 );
+	if ( connect ( fd, ( struct sockaddr * ) &upstream->address, sizeof ( upstream->address ) ) < 0 &&
+			errno != EINPROGRESS ) {
+		close ( fd );
+		upstream->connection.fd = -1;
+		gateway_drop ( upstream, now );
+		return;
+	}
+	upstream->connection.fd = fd;
+	upstream->connecting = true;
+	upstream->heard = now;
+	log_message ( LOG_DEBUG, "Connecting to upstream %s.\n", upstream->name );
+}
+
+/*
+Takes the text of an upstream's event stream as it arrives, and acts
+on each event as it is completed by a blank line.
+*/
+void gateway_data ( struct Upstream * upstream, unsigned char * data, int length ) {
+	char * end;
+	int used;
+
+	if ( upstream->event_length + length >= UPSTREAM_EVENT_SIZE ) {
+		upstream->event_length = 0;
+		if ( length >= UPSTREAM_EVENT_SIZE ) {
+			return;
+		}
+	}
+	memcpy ( upstream->event + upstream->event_length, data, length );
+	upstream->event_length += length;
+	upstream->event[upstream->event_length] = 0;
+	while ( ( end = strstr ( upstream->event, "\n\n" ) ) ) {
+		*end = 0;
+		gateway_event ( upstream, upstream->event );
+		used = end + 2 - upstream->event;
+		upstream->event_length -= used;
+		memmove ( upstream->event, end + 2, upstream->event_length + 1 );
+	}
+}
+
+/*
+Closes the connection to an upstream, or gives up connecting to it,
+and says when to try again. The board is shown as unknown until the
+upstream is heard from again, and commands sent to it that are still
+waiting for an answer are failed.
+*/
+void gateway_drop ( struct Upstream * upstream, time_t now ) {
+	int i;
+
+	if ( upstream->connection.fd >= 0 ) {
+		h2_close ( &upstream->connection );
+	}
+	upstream->connection.upstream = upstream;
+	if ( upstream->connected ) {
+		upstream->lost++;
+	}
+	upstream->connecting = false;
+	upstream->connected = false;
+	upstream->event_length = 0;
+	upstream->retry = now + upstream->backoff;
+	log_message ( LOG_WARN, "Upstream %s not connected, trying again in %d seconds.\n",
+		upstream->name, upstream->backoff );
+	upstream->backoff = upstream->backoff * 2 > UPSTREAM_RETRY ? UPSTREAM_RETRY : upstream->backoff * 2;
+
+	pthread_mutex_lock ( &event_mutex );
+	if ( upstream->input >= 0 ) {
+		upstream->input = -1;
+		upstream->output = -1;
+		upstream->changed = true;
+	}
+	pthread_mutex_unlock ( &event_mutex );
+
+	pthread_mutex_lock ( &gateway_mutex );
+	for ( i = 0; i < MAX_UPSTREAM_COMMAND; i++ ) {
+		if ( upstream->command[i].used && upstream->command[i].id ) {
+			gateway_answer ( &upstream->command[i], 0 );
+		}
+	}
+	pthread_mutex_unlock ( &gateway_mutex );
+}
+
+/*
+Acts on one event from an upstream: the inputs as binary digits, bit
+0 first, followed by the outputs when they have changed.
+*/
+void gateway_event ( struct Upstream * upstream, char * event ) {
+	char * data = strstr ( event, "data: " );
+	int input = 0;
+	int output = 0;
+	int length = 0;
+
+	if ( !data ) {
+		return;
+	}
+	data += 6;
+	for ( length = 0; length < 16 && ( data[length] == '0' || data[length] == '1' ); length++ ) {
+		if ( data[length] == '1' ) {
+			if ( length < 8 ) {
+				input |= 1 << length;
+			} else {
+				output |= 1 << ( length - 8 );
+			}
+		}
+	}
+	if ( length != 8 && length != 16 ) {
+		return;
+	}
+	upstream->backoff = 1;
+	pthread_mutex_lock ( &event_mutex );
+	if ( length == 16 && output != upstream->output ) {
+		upstream->output = output;
+		upstream->changed = true;
+	}
+	if ( input != upstream->input && upstream->output >= 0 ) {
+		upstream->input = input;
+		upstream->changed = true;
+	}
+	pthread_mutex_unlock ( &event_mutex );
+}
+
+/*
+Acts on one frame from an upstream: the response to the GET of
+events.qif on stream 1, and the events that follow it, and the
+responses to the commands on the streams after. The upstream never
+splits a header block, nor pushes, so neither is taken.
+
+Returns false on an error that ends the connection.
+*/
+bool gateway_frame ( struct H2_Connection * connection, int type, int flags, unsigned id, unsigned char * payload,
+		int length ) {
+	struct Upstream * upstream = connection->upstream;
+	struct timespec now;
+	char lines[1000];
+	int status;
+	int padding = 0;
+	int offset = 0;
+	int n;
+	int i;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	upstream->heard = now.tv_sec;
+	if ( ( flags & H2_PADDED ) && ( type == H2_DATA || type == H2_HEADERS ) ) {
+		if ( length < 1 ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		padding = payload[0];
+		offset = 1;
+	}
+	switch ( type ) {
+	case H2_DATA:
+		if ( offset + padding > length ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+
+		//  The data is taken as it comes, so the room is given back
+		//  straight away
+		if ( length > 0 && ( !h2_put_window ( connection, 0, length ) ||
+				( id == 1 && !h2_put_window ( connection, 1, length ) ) ) ) {
+			return false;
+		}
+		if ( id == 1 ) {
+			gateway_data ( upstream, payload + offset, length - offset - padding );
+		}
+		break;
+
+	case H2_HEADERS:
+		if ( flags & H2_PRIORITY_FLAG ) {
+			offset += 5;
+		}
+		if ( !( flags & H2_END_HEADERS ) || offset + padding > length ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		n = h2_decode ( connection, payload + offset, length - offset - padding, lines, sizeof ( lines ) - 1 );
+		if ( n < 0 ) {
+			return h2_goaway ( connection, H2_COMPRESSION_ERROR );
+		}
+		lines[n] = 0;
+		status = test_lead_string ( lines, ":status: " ) ? atoi ( lines + 9 ) : 0;
+		if ( id == 1 ) {
+			if ( status != 200 ) {
+				log_message ( LOG_WARN, "Upstream %s refused events.qif with %d.\n", upstream->name, status );
+				return h2_goaway ( connection, 0 );
+			}
+			break;
+		}
+		pthread_mutex_lock ( &gateway_mutex );
+		for ( i = 0; i < MAX_UPSTREAM_COMMAND; i++ ) {
+			if ( upstream->command[i].used && upstream->command[i].id == id ) {
+				gateway_answer ( &upstream->command[i], status );
+			}
+		}
+		pthread_mutex_unlock ( &gateway_mutex );
+		break;
+
+	case H2_RST_STREAM:
+		if ( id == 1 ) {
+			return false;
+		}
+		pthread_mutex_lock ( &gateway_mutex );
+		for ( i = 0; i < MAX_UPSTREAM_COMMAND; i++ ) {
+			if ( upstream->command[i].used && upstream->command[i].id == id ) {
+				gateway_answer ( &upstream->command[i], 0 );
+			}
+		}
+		pthread_mutex_unlock ( &gateway_mutex );
+		break;
+
+	case H2_SETTINGS:
+		if ( flags & H2_ACK ) {
+			break;
+		}
+		if ( !h2_settings ( connection, payload, length ) ) {
+			return false;
+		}
+		return h2_put_frame ( connection, H2_SETTINGS, H2_ACK, 0, 0, 0 );
+
+	case H2_PING:
+		if ( length != 8 ) {
+			return h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+		}
+		if ( !( flags & H2_ACK ) ) {
+			return h2_put_frame ( connection, H2_PING, H2_ACK, 0, payload, length );
+		}
+		break;
+
+	case H2_GOAWAY:
+		log_message ( LOG_DEBUG, "Upstream %s going away.\n", upstream->name );
+		return false;
+
+	case H2_PUSH_PROMISE:
+	case H2_CONTINUATION:
+		return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+	}
+	return true;
+}
+
+/*
+Returns the current gateway event, with every board or only those
+that changed in the latest round, having written it out afresh if
+there has been a round since it was last written. Each board is
+"board:IIOO", the inputs and outputs in hex, or "board:-" while its
+upstream is not connected. The caller must hold event_mutex, and
+gets a reference to the frame which it must put when done with it.
+
+Returns 0 if memory runs out.
+*/
+struct Event_Frame *gateway_frame_get ( bool all ) {
+	struct Event_Frame * frame = gateway_frames[all];
+	struct Upstream * upstream;
+	int length;
+	int i;
+
+	if ( !frame || frame->output_sequence != gateway_round ) {
+		event_frame_put ( frame );
+		frame = gateway_frames[all] = ( struct Event_Frame * ) buffer_get ( sizeof ( *frame ) );
+		if ( !frame ) {
+			return 0;
+		}
+		frame->references = 1;
+		frame->output_sequence = gateway_round;
+		length = sprintf ( frame->data, "event: boards\ndata:" );
+		for ( i = 0; i < upstream_count; i++ ) {
+			upstream = &upstreams[i];
+			if ( !all && upstream->round != gateway_round ) {
+				continue;
+			}
+			if ( upstream->input < 0 ) {
+				length += sprintf ( &frame->data[length], " %d:-", i );
+			} else {
+				length += sprintf ( &frame->data[length], " %d:%02x%02x", i, upstream->input, upstream->output );
+			}
+		}
+		frame->data[length++] = '\n';
+		frame->data[length++] = '\n';
+		frame->data[length] = 0;
+		frame->length = length;
+	}
+	frame->references++;
+	return frame;
+}
+
+/*
+Reads the upstream servers from the upstream option, a list of
+address:port separated by commas.
+
+Returns the number of upstreams, or -1 if the list is not understood.
+*/
+int gateway_open ( ) {
+	struct Upstream * upstream;
+	const char * ptr = opt_upstream;
+	char host[32];
+	int length;
+
+	while ( *ptr ) {
+		for ( length = 0; ptr[length] && ptr[length] != ','; length++ ) {
+		}
+		if ( upstream_count == MAX_UPSTREAM || length >= (int) sizeof ( upstream->name ) ) {
+			log_message ( LOG_ERROR, "ERROR, upstream=%s is too long\n", opt_upstream );
+			return -1;
+		}
+		upstream = &upstreams[upstream_count];
+		memcpy ( upstream->name, ptr, length );
+		upstream->name[length] = 0;
+		length = locate_char ( ':', upstream->name );
+		if ( length <= 0 ) {
+			log_message ( LOG_ERROR, "ERROR, upstream %s is not address:port\n", upstream->name );
+			return -1;
+		}
+		memcpy ( host, upstream->name, length );
+		host[length] = 0;
+		upstream->address.sin_family = AF_INET;
+		upstream->address.sin_port = htons ( atoi ( upstream->name + length + 1 ) );
+		if ( !inet_aton ( host, &upstream->address.sin_addr ) || upstream->address.sin_port == 0 ) {
+			log_message ( LOG_ERROR, "ERROR, upstream %s is not address:port\n", upstream->name );
+			return -1;
+		}
+		upstream->connection.fd = -1;
+		upstream->connection.upstream = upstream;
+		upstream->backoff = 1;
+		upstream->input = -1;
+		upstream->output = -1;
+		upstream_count++;
+		ptr += strlen ( upstream->name );
+		if ( *ptr == ',' ) {
+			ptr++;
+		}
+	}
+	return upstream_count;
+}
+
+/*
+Sends a round of gateway events, if any board has changed since the
+last or every board is to be sent regardless, to every gateway.qif
+stream that can take it. The caller must hold event_mutex.
+
+Returns true if there was a round.
+*/
+bool gateway_publish ( bool all ) {
+	bool changed = all;
+	int i;
+
+	for ( i = 0; i < upstream_count; i++ ) {
+		changed = changed || upstreams[i].changed;
+	}
+	if ( !changed ) {
+		return false;
+	}
+	gateway_round++;
+	for ( i = 0; i < upstream_count; i++ ) {
+		if ( all || upstreams[i].changed ) {
+			upstreams[i].round = gateway_round;
+			upstreams[i].changed = false;
+		}
+	}
+	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+		if ( event_stream[i].fd >= 0 && event_stream[i].gateway && !send_event ( &event_stream[i] ) ) {
+			close_event_stream ( &event_stream[i] );
+		}
+	}
+	return true;
+}
+
+/*
+Queues a request to an upstream, on the given stream, with no body.
+The method comes from the HPACK static table, or for PUT its name
+does, and the path and authority are sent as literals, never indexed.
+
+Returns false if memory runs out.
+*/
+bool gateway_request ( struct Upstream * upstream, unsigned id, bool put, const char * path ) {
+	unsigned char block[200];
+	int length = 0;
+	int n;
+
+	if ( put ) {
+		block[length++] = 0x02;
+		block[length++] = 3;
+		memcpy ( block + length, "PUT", 3 );
+		length += 3;
+	} else {
+		block[length++] = 0x82;
+	}
+	block[length++] = 0x86;
+	n = strlen ( path );
+	block[length++] = 0x04;
+	length += h2_put_integer ( block + length, n, 7, 0 );
+	memcpy ( block + length, path, n );
+	length += n;
+	n = strlen ( upstream->name );
+	block[length++] = 0x01;
+	length += h2_put_integer ( block + length, n, 7, 0 );
+	memcpy ( block + length, upstream->name, n );
+	length += n;
+	return h2_put_frame ( &upstream->connection, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, id, block, length );
+}
+
+/*
+The gateway thread. Keeps a connection to every upstream, making them
+again as they fail, reads the events and answers that arrive on them,
+sends on the commands from browsers, and sends the gateway.qif streams
+each round of changes.
+*/
+void *gateway_server ( void * unused ) {
+	struct pollfd poll_fd[MAX_UPSTREAM + 1];
+	struct Upstream * polled[MAX_UPSTREAM + 1];
+	struct Upstream * upstream;
+	struct timespec now;
+	unsigned long long wakes;
+	time_t sent = 0;
+	int error_code;
+	socklen_t size;
+	int count;
+	int i;
+
+	log_message ( LOG_INFO, "Enter gateway, %d upstream servers.\n", upstream_count );
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	for ( i = 0; i < upstream_count; i++ ) {
+		gateway_connect ( &upstreams[i], now.tv_sec );
+	}
+	for (;;) {
+		poll_fd[0].fd = gateway_wake_fd;
+		poll_fd[0].events = POLLIN;
+		count = 1;
+		for ( i = 0; i < upstream_count; i++ ) {
+			upstream = &upstreams[i];
+			if ( upstream->connection.fd >= 0 ) {
+				poll_fd[count].fd = upstream->connection.fd;
+				poll_fd[count].events = upstream->connecting ? POLLOUT :
+					POLLIN | ( upstream->connection.output_length ? POLLOUT : 0 );
+				polled[count] = upstream;
+				count++;
+			}
+		}
+		if ( poll ( poll_fd, count, 1000 ) < 0 ) {
+			continue;
+		}
+		if ( ( poll_fd[0].revents & POLLIN ) && read ( gateway_wake_fd, &wakes, sizeof ( wakes ) ) < 0 ) {
+			wakes = 0;
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+
+		//  Finish off the connections being made, and read from the
+		//  others
+		for ( i = 1; i < count; i++ ) {
+			upstream = polled[i];
+			if ( !poll_fd[i].revents ) {
+				continue;
+			}
+			if ( upstream->connecting ) {
+				error_code = 0;
+				size = sizeof ( error_code );
+				getsockopt ( upstream->connection.fd, SOL_SOCKET, SO_ERROR, &error_code, &size );
+				if ( error_code ) {
+					gateway_drop ( upstream, now.tv_sec );
+				} else {
+					gateway_start ( upstream );
+				}
+			} else if ( ( poll_fd[i].revents & ( POLLIN | POLLHUP | POLLERR ) ) && !h2_read ( &upstream->connection ) ) {
+				upstream->connection.closing = true;
+			}
+		}
+
+		//  Connect to those due another try, give up on those that
+		//  have gone quiet, and send the commands waiting
+		for ( i = 0; i < upstream_count; i++ ) {
+			upstream = &upstreams[i];
+			if ( upstream->connection.fd < 0 ) {
+				if ( now.tv_sec >= upstream->retry ) {
+					gateway_connect ( upstream, now.tv_sec );
+				}
+			} else if ( now.tv_sec - upstream->heard > UPSTREAM_SILENCE ) {
+				log_message ( LOG_WARN, "Upstream %s silent for %d seconds.\n", upstream->name, UPSTREAM_SILENCE );
+				gateway_drop ( upstream, now.tv_sec );
+			}
+			gateway_commands ( upstream, now.tv_sec );
+			if ( upstream->connection.fd >= 0 && !upstream->connecting && ( !h2_flush ( &upstream->connection ) ||
+					( upstream->connection.closing && upstream->connection.output_length == 0 ) ) ) {
+				gateway_drop ( upstream, now.tv_sec );
+			}
+		}
+
+		//  Pass the changes on, and every board once a second
+		pthread_mutex_lock ( &event_mutex );
+		if ( gateway_publish ( now.tv_sec != sent ) ) {
+			sent = now.tv_sec;
+		}
+		pthread_mutex_unlock ( &event_mutex );
+		if ( h2_connection_count > 0 ) {
+			h2_wake ( );
+		}
+	}
+	return 0;
+}
+
+/*
+Starts HTTP/2 on a connection to an upstream once it has been made:
+the connection preface, settings that turn off server push, and the
+GET of events.qif on stream 1.
+*/
+void gateway_start ( struct Upstream * upstream ) {
+	static const unsigned char settings[] = { 0, 2, 0, 0, 0, 0 };
+	struct H2_Connection * connection = &upstream->connection;
+	struct iovec iov;
+	struct timespec now;
+
+	upstream->connecting = false;
+	connection->preface = true;
+	connection->window = H2_WINDOW;
+	connection->peer_window = H2_WINDOW;
+	connection->table.max_size = H2_TABLE_SIZE;
+	connection->input = buffer_get ( H2_INPUT_SIZE );
+	iov.iov_base = ( void * ) h2_preface;
+	iov.iov_len = H2_PREFACE_LENGTH;
+	upstream->next_stream = 3;
+	upstream->connected = connection->input &&
+		buffer_append_iov ( &connection->output, &connection->output_length, &iov, 1 ) &&
+		h2_put_frame ( connection, H2_SETTINGS, 0, 0, settings, sizeof ( settings ) ) &&
+		gateway_request ( upstream, 1, false, "/events.qif" );
+	if ( !upstream->connected ) {
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		gateway_drop ( upstream, now.tv_sec );
+		return;
+	}
+	log_message ( LOG_INFO, "Connected to upstream %s.\n", upstream->name );
+}
+
+/*
+Returns the content codings, as ENCODING_* bits, that the browser
+lists in its Accept-Encoding header. Codings given a q value of
+zero are treated as refused.
+*/
+int get_accept_encoding ( char * request ) {
+	char * ptr;
+	char * token;
+	int    length;
+	int    encodings = 0;
+
+	ptr = get_header ( request, "Accept-Encoding" );
+	if ( !ptr ) {
+		return 0;
+	}
+	for (;;) {
+		while ( *ptr == ' ' || *ptr == ',' ) {
+			ptr++;
+		}
+		if ( *ptr == 0 || *ptr == '\r' || *ptr == '\n' ) {
+			break;
+		}
+		token = ptr;
+		while ( *ptr != 0 && *ptr != ',' && *ptr != ';' && *ptr != ' ' && *ptr != '\r' && *ptr != '\n' ) {
+			ptr++;
+		}
+		length = ptr - token;
+
+		//  Look for an explicit refusal, such as "gzip;q=0"
+		bool refused = false;
+		while ( *ptr != 0 && *ptr != ',' && *ptr != '\r' && *ptr != '\n' ) {
+			if ( test_lead_string ( ptr, "q=" ) ) {
+				refused = read_double ( ptr + 2 ) == 0.0;
+			}
+			ptr++;
+		}
+		if ( refused ) {
+			continue;
+		}
+		if ( length == 4 && test_lead_string ( token, "gzip" ) ) {
+			encodings |= ENCODING_GZIP;
+		} else if ( length == 2 && test_lead_string ( token, "br" ) ) {
+			encodings |= ENCODING_BROTLI;
+		}
+	}
+	return encodings;
+}
+
+/*
+Returns the value of the named request header, with any leading
+white space skipped, or 0 if the request does not carry it. Header
+names are matched without regard to case.
+*/
+char *get_header ( char * request, const char * name ) {
+	char * ptr = request;
+	int    length = strlen ( name );
+	for (;;) {
+		ptr = strchr ( ptr, '\n' );
+		if ( !ptr ) {
+			return 0;
+		}
+		ptr++;
+		if ( strncasecmp ( ptr, name, length ) == 0 && ptr[length] == ':' ) {
+			ptr += length + 1;
+			while ( *ptr == ' ' || *ptr == '\t' ) {
+				ptr++;
+			}
+			return ptr;
+		}
+	}
+}
+
+/*
+Extracts the name of the page requested by the web browser.
+Supplies "index.html" if no page name is requested.
+
+Returns 0 on success, -1 oterhwise.
+*/
+int get_page_name ( char * browser_request, char * page_name, int max_length, char * page_parameters, char * disk_page ) {
+	char * ptr;
+	char * page_name_end;
+	int file_length = 0;
+
+	//  Decode the required page
+	ptr = browser_request;
+	while (*ptr!='/') {
+		if (*ptr==0) {
+			return send_error( disk_page );
+		}
+		ptr++;
+	}
+	ptr++;
+	page_name_end = ptr;
+	page_parameters = 0;
+	while (*page_name_end!=' ' && *page_name_end!='?') {
+		if (*page_name_end==0) {
+			return send_error( disk_page );
+		}
+		page_name_end++;
+	}
+	if (*page_name_end=='?') {
+		page_parameters = page_name_end + 1;
+	}
+	*page_name_end = 0;
+	strcpy (page_name, ptr);
+	if (page_name_end==ptr) {
+		strcpy (page_name, "index.html");
+	}
+	return 0;
+}
+
+/*
+Returns the IPv4 address of the web browser at the other end of a
+socket, in network byte order, or INADDR_NONE if it cannot be found.
+*/
+in_addr_t get_peer_address ( int fd ) {
+	struct sockaddr_in address;
+	socklen_t length = sizeof ( address );
+	if ( getpeername ( fd, ( struct sockaddr * ) &address, &length ) < 0 || address.sin_family != AF_INET ) {
+		return INADDR_NONE;
+	}
+	return address.sin_addr.s_addr;
+}
+
+/*
+Finds the query string in the request line of a request.
+
+Returns a pointer to just after the '?', or null if there is none.
+*/
+char *get_query ( char * request ) {
+	char * ptr;
+	for ( ptr = request; *ptr && *ptr != '\r' && *ptr != '\n'; ptr++ ) {
+		if ( *ptr == '?' ) {
+			return ptr + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+Reads the value of a parameter, "name=value", from a query string,
+where the value must be a number from 0 to max and nothing else:
+decimal digits, with no sign or leading zero, ended by '&', a space
+or the end of the line.
+
+Returns the value, -1 if the parameter is not there, or -2 if it is
+not such a number.
+*/
+int get_query_number ( char * query, const char * name, int max ) {
+	int length = strlen ( name );
+	char * ptr = query;
+	char * end;
+	long value;
+	while ( ptr && *ptr && *ptr != ' ' && *ptr != '\r' && *ptr != '\n' ) {
+		if ( strncmp ( ptr, name, length ) == 0 && ptr[length] == '=' ) {
+			ptr += length + 1;
+			if ( !isdigit ( *ptr ) || ( ptr[0] == '0' && isdigit ( ptr[1] ) ) ) {
+				return -2;
+			}
+			errno = 0;
+			value = strtol ( ptr, &end, 10 );
+			if ( errno || value > max ||
+					( *end && *end != '&' && *end != ' ' && *end != '\r' && *end != '\n' ) ) {
+				return -2;
+			}
+			return value;
+		}
+		while ( *ptr && *ptr != '&' && *ptr != ' ' ) {
+			ptr++;
+		}
+		if ( *ptr == '&' ) {
+			ptr++;
+		}
+	}
+	return -1;
+}
+
+/*
+Reads the value of a numeric parameter, "name=value", from a query
+string.
+
+Returns the value, or -1 if the parameter is not there.
+*/
+int get_query_value ( char * query, const char * name ) {
+	int length = strlen ( name );
+	char * ptr = query;
+	while ( ptr && *ptr && *ptr != ' ' && *ptr != '\r' && *ptr != '\n' ) {
+		if ( strncmp ( ptr, name, length ) == 0 && ptr[length] == '=' ) {
+			return atoi ( ptr + length + 1 );
+		}
+		while ( *ptr && *ptr != '&' && *ptr != ' ' ) {
+			ptr++;
+		}
+		if ( *ptr == '&' ) {
+			ptr++;
+		}
+	}
+	return -1;
+}
+
+/*
+Returns the length the request will have once it has all arrived:
+the header plus any body announced by Content-Length.
+
+Returns -1 if the end of the header has not yet been seen.
+*/
+int get_request_length ( char * request, int length ) {
+	char * content_length;
+	int header_length;
+
+	header_length = test_in_string ( request, "\r\n\r\n" );
+	if ( header_length < 0 ) {
+		return -1;
+	}
+	header_length += 4;
+	content_length = get_header ( request, "Content-Length" );
+	if ( content_length && content_length < request + header_length ) {
+		return header_length + read_decimal ( content_length );
+	}
+	return header_length;
+}
+
+/*
+Returns the type of request made by the web browser.
+
+Expected HTTP types are GET and PUT.
+*/
+
+int get_request_type ( char * p) {
+	if ( test_lead_string ( p, "GET " ) ) {
+		return REQUEST_GET;
+	}
+	if ( test_lead_string ( p, "PUT " ) ) {
+		return REQUEST_PUT;
+	}
+	return REQUEST_UNDEFINED;
+}
+
+/*
+Compresses the buffer into a newly allocated gzip member.
+
+Returns 0 if compression fails or does not make the buffer smaller.
+*/
+char *gzip_buffer ( char * in, int in_length, int * out_length ) {
+	z_stream stream;
+	char * out;
+	int    bound;
+
+	memset ( &stream, 0, sizeof ( stream ) );
+	if ( deflateInit2 ( &stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK ) {
+		return 0;
+	}
+	bound = deflateBound ( &stream, in_length );
+	out = ( char * ) malloc ( bound );
+	if ( !out ) {
+		deflateEnd ( &stream );
+		return 0;
+	}
+	stream.next_in = ( Bytef * ) in;
+	stream.avail_in = in_length;
+	stream.next_out = ( Bytef * ) out;
+	stream.avail_out = bound;
+	if ( deflate ( &stream, Z_FINISH ) != Z_STREAM_END || (int) stream.total_out >= in_length ) {
+		deflateEnd ( &stream );
+		free ( out );
+		return 0;
+	}
+	*out_length = stream.total_out;
+	deflateEnd ( &stream );
+	return out;
+}
+
+/*
+Takes over a connection whose first request asks for HTTP/2, for the
+HTTP/2 thread to serve from now on. The data is what has been read
+from the connection so far: the connection preface and whatever came
+after it, or the HTTP/1.1 request asking to upgrade. That is answered
+with 101 Switching Protocols here, before anything else can be sent
+on the connection, and then served as stream 1.
+
+The 101 is sent without blocking, as the HTTP/2 thread takes
+h2_mutex too. A new connection has room for it; should it not, the
+connection is shut down.
+
+Returns false if the HTTP/2 thread is not running or has no room for
+the connection, in which case the request is served as it would have
+been without HTTP/2.
+*/
+bool h2_adopt ( int fd, char * data, int length, bool upgrade ) {
+	struct H2_Adopted * adopted;
+	char * copy = 0;
+	int n;
+
+	pthread_mutex_lock ( &h2_mutex );
+	if ( h2_wake_fd < 0 || h2_connection_count + h2_adopted_count >= MAX_H2_CONNECTION ||
+			length >= H2_INPUT_SIZE || !( copy = buffer_get ( length + 1 ) ) ) {
+		pthread_mutex_unlock ( &h2_mutex );
+		return false;
+	}
+	memcpy ( copy, data, length );
+	copy[length] = 0;
+	if ( upgrade ) {
+		n = send ( fd, header_switching, sizeof ( header_switching ) - 1, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if ( n != sizeof ( header_switching ) - 1 ) {
+			pthread_mutex_unlock ( &h2_mutex );
+			buffer_put ( copy );
+			shutdown ( fd, SHUT_RDWR );
+			log_message ( LOG_DEBUG, "h2_adopt: 101 not sent to %d.\n", fd );
+			return false;
+		}
+	}
+	adopted = &h2_adopted[h2_adopted_count++];
+	adopted->fd = fd;
+	adopted->data = copy;
+	adopted->length = length;
+	adopted->upgrade = upgrade;
+	pthread_mutex_unlock ( &h2_mutex );
+	h2_wake ( );
+	log_message ( LOG_DEBUG, "HTTP/2 connection %d handed over%s.\n", fd, upgrade ? " by upgrade" : "" );
+	return true;
+}
+
+/*
+Closes an HTTP/2 connection, letting go of everything it holds.
+*/
+void h2_close ( struct H2_Connection * connection ) {
+	int i;
+	for ( i = 0; i < MAX_H2_STREAM; i++ ) {
+		h2_stream_close ( &connection->stream[i] );
+	}
+	h2_table_resize ( &connection->table, 0 );
+	buffer_put ( connection->block );
+	buffer_put ( connection->input );
+	buffer_put ( connection->output );
+	close ( connection->fd );
+	log_message ( LOG_DEBUG, "HTTP/2 connection %d closed.\n", connection->fd );
+	memset ( connection, 0, sizeof ( *connection ) );
+	connection->fd = -1;
+}
+
+/*
+Decodes an HPACK header block into lines of "name: value\r\n", the
+pseudo-header fields among them, keeping the connection's dynamic
+table in step with the client's.
+
+Returns the length of the lines, or -1 if the block cannot be decoded
+or does not fit, after which the table can no longer be trusted.
+*/
+int h2_decode ( struct H2_Connection * connection, unsigned char * block, int length, char * lines, int max ) {
+	unsigned char * ptr = block;
+	unsigned char * end = block + length;
+	const char * name;
+	const char * value;
+	int name_length;
+	int value_length;
+	int index;
+	int count = 0;
+	bool indexing;
+
+	while ( ptr < end ) {
+
+		//  A whole field from the tables
+		if ( *ptr & 0x80 ) {
+			if ( !h2_integer ( &ptr, end, 7, &index ) ||
+					!h2_table_field ( &connection->table, index, &name, &name_length, &value, &value_length ) ||
+					count + name_length + value_length + 4 > max ) {
+				return -1;
+			}
+			memcpy ( lines + count, name, name_length );
+			count += name_length;
+			lines[count++] = ':';
+			lines[count++] = ' ';
+			memcpy ( lines + count, value, value_length );
+			count += value_length;
+			lines[count++] = '\r';
+			lines[count++] = '\n';
+			continue;
+		}
+
+		//  A new size for the dynamic table, no bigger than the
+		//  settings allow
+		if ( ( *ptr & 0xe0 ) == 0x20 ) {
+			if ( !h2_integer ( &ptr, end, 5, &index ) || index > H2_TABLE_SIZE ) {
+				return -1;
+			}
+			connection->table.max_size = index;
+			h2_table_resize ( &connection->table, index );
+			continue;
+		}
+
+		//  A literal field, its name from the tables or given, which
+		//  may be added to the dynamic table. The name and value are
+		//  decoded straight into the lines.
+		indexing = ( *ptr & 0x40 ) != 0;
+		if ( !h2_integer ( &ptr, end, indexing ? 6 : 4, &index ) ) {
+			return -1;
+		}
+		if ( index ) {
+			if ( !h2_table_field ( &connection->table, index, &name, &name_length, &value, &value_length ) ||
+					count + name_length > max ) {
+				return -1;
+			}
+			memcpy ( lines + count, name, name_length );
+		} else {
+			name_length = h2_string ( &ptr, end, lines + count, max - count );
+		}
+		if ( name_length < 0 || count + name_length + 4 > max ) {
+			return -1;
+		}
+		value_length = h2_string ( &ptr, end, lines + count + name_length + 2, max - count - name_length - 4 );
+		if ( value_length < 0 ) {
+			return -1;
+		}
+		if ( indexing && !h2_table_add ( &connection->table, lines + count, name_length,
+				lines + count + name_length + 2, value_length ) ) {
+			return -1;
+		}
+		count += name_length;
+		lines[count++] = ':';
+		lines[count++] = ' ';
+		count += value_length;
+		lines[count++] = '\r';
+		lines[count++] = '\n';
+	}
+	return count;
+}
+
+/*
+Dispatches a stream's request once the whole of it has arrived. A GET
+of events.qif, or of gateway.qif in gateway mode, makes the stream an
+event stream; anything else is handed to the HTTP/2 workers, to be
+served just as the same request over HTTP/1.1 would be, and the
+response sent back on the stream once they are done. Should every job
+be taken, the stream is answered with a 503.
+*/
+void h2_dispatch ( struct H2_Connection * connection, struct H2_Stream * stream ) {
+	const struct Route * route;
+	struct H2_Job * job;
+	int i;
+
+	stream->dispatched = true;
+	route = route_find ( get_request_type ( stream->request ), stream->request );
+	if ( route && ( route->handler == route_events || ( route->handler == route_gateway && upstream_count ) ) ) {
+		stream->events = true;
+		stream->gateway = route->handler == route_gateway;
+		h2_headers ( connection, stream, header_event_stream, sizeof ( header_event_stream ) - 1, false );
+		return;
+	}
+
+	//  The job takes the request with it
+	pthread_mutex_lock ( &h2_job_mutex );
+	for ( i = 0; i < MAX_H2_JOB && h2_job[i].state != H2_JOB_FREE; i++ ) {
+	}
+	if ( i == MAX_H2_JOB ) {
+		pthread_mutex_unlock ( &h2_job_mutex );
+		h2_headers ( connection, stream, header_unavailable, sizeof ( header_unavailable ) - 1, true );
+		h2_stream_close ( stream );
+		return;
+	}
+	job = &h2_job[i];
+	job->state = H2_JOB_QUEUED;
+	job->fd = connection->fd;
+	job->connection = connection - h2_connection;
+	job->generation = connection->generation;
+	job->id = stream->id;
+	job->request = stream->request;
+	job->request_length = stream->request_length;
+	stream->request = 0;
+	h2_job_queue[( h2_job_head + h2_job_count ) % MAX_H2_JOB] = i;
+	h2_job_count++;
+	pthread_cond_signal ( &h2_job_ready );
+	pthread_mutex_unlock ( &h2_job_mutex );
+}
+
+/*
+Takes back the jobs the HTTP/2 workers have done, sending each
+response on its stream if the stream is still open, and letting it go
+otherwise. Runs in the HTTP/2 thread.
+*/
+void h2_finish ( ) {
+	struct H2_Connection * connection;
+	struct H2_Stream * stream;
+	struct H2_Job job;
+	int i;
+
+	for ( i = 0; i < MAX_H2_JOB; i++ ) {
+		pthread_mutex_lock ( &h2_job_mutex );
+		if ( h2_job[i].state != H2_JOB_DONE ) {
+			pthread_mutex_unlock ( &h2_job_mutex );
+			continue;
+		}
+		job = h2_job[i];
+		memset ( &h2_job[i], 0, sizeof ( h2_job[i] ) );
+		pthread_mutex_unlock ( &h2_job_mutex );
+		buffer_put ( job.request );
+
+		//  The connection may have closed, and the stream been reset,
+		//  while the request was served
+		connection = &h2_connection[job.connection];
+		stream = connection->fd >= 0 && connection->generation == job.generation && !connection->closing ?
+			h2_stream ( connection, job.id ) : 0;
+		if ( stream && stream->dispatched && !stream->events ) {
+			h2_respond ( connection, stream, job.capture, job.capture_length );
+		} else {
+			buffer_put ( job.capture );
+		}
+	}
+}
+
+
+
+/*
+Sends as much of the frames waiting as the socket will take without
+blocking. A client that takes none of them for sse_timeout seconds is
+given up on.
+
+Returns false if the connection has failed.
+*/
+bool h2_flush ( struct H2_Connection * connection ) {
+	struct timespec now;
+	bool sent = false;
+	int n;
+
+	while ( connection->output_length > 0 ) {
+		n = send ( connection->fd, connection->output, connection->output_length, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+				return false;
+			}
+			break;
+		}
+		connection->output_length -= n;
+		memmove ( connection->output, connection->output + n, connection->output_length );
+		sent = true;
+	}
+	if ( connection->output_length == 0 ) {
+		buffer_put ( connection->output );
+		connection->output = 0;
+		connection->stalled = false;
+		return true;
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	if ( !connection->stalled || sent ) {
+		connection->stalled = true;
+		connection->stalled_since = now.tv_sec;
+	}
+	return now.tv_sec - connection->stalled_since < opt_sse_timeout;
+}
+
+/*
+Acts on one frame from the client.
+
+Returns false on an error that ends the connection, having queued a
+GOAWAY saying why.
+*/
+bool h2_frame ( struct H2_Connection * connection, int type, int flags, unsigned id, unsigned char * payload, int length ) {
+	struct H2_Stream * stream;
+	struct iovec iov;
+	unsigned increment;
+	int padding = 0;
+	int offset = 0;
+	int i;
+
+	//  Nothing may come between the frames of a header block
+	if ( connection->continuation && ( type != H2_CONTINUATION || id != connection->continuation ) ) {
+		return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+	}
+	if ( ( flags & H2_PADDED ) && ( type == H2_DATA || type == H2_HEADERS ) ) {
+		if ( length < 1 ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		padding = payload[0];
+		offset = 1;
+	}
+	stream = h2_stream ( connection, id );
+	switch ( type ) {
+	case H2_DATA:
+		if ( id == 0 || offset + padding > length ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+
+		//  The data is taken as it comes, so the client may send
+		//  more straight away
+		if ( length > 0 && !h2_put_window ( connection, 0, length ) ) {
+			return false;
+		}
+		if ( !stream || stream->dispatched ) {
+			break;
+		}
+		length -= offset + padding;
+		if ( stream->request_length + length > MAX_REQUEST_SIZE - 2 ) {
+			h2_reset ( connection, id, H2_ENHANCE_YOUR_CALM );
+			break;
+		}
+		memcpy ( stream->request + stream->request_length, payload + offset, length );
+		stream->request_length += length;
+		stream->request[stream->request_length] = 0;
+		if ( flags & H2_END_STREAM ) {
+			stream->end_stream = true;
+			h2_dispatch ( connection, stream );
+		} else if ( length > 0 ) {
+			h2_put_window ( connection, id, length + offset + padding );
+		}
+		break;
+	case H2_HEADERS:
+		if ( id == 0 || !( id & 1 ) ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		if ( flags & H2_PRIORITY_FLAG ) {
+			offset += 5;
+		}
+		if ( offset + padding > length ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+
+		//  A new stream, if there is room for it
+		if ( !stream && id > connection->last_stream ) {
+			connection->last_stream = id;
+			for ( i = 0; i < MAX_H2_STREAM && connection->stream[i].id; i++ ) {
+			}
+			if ( i < MAX_H2_STREAM ) {
+				stream = &connection->stream[i];
+				stream->id = id;
+				stream->window = connection->peer_window;
+			}
+		}
+		connection->block_length = 0;
+		connection->block_end_stream = ( flags & H2_END_STREAM ) != 0;
+		payload += offset;
+		length -= offset + padding;
+
+		//  Go on to gather up the header block
+		[[fallthrough]];
+	case H2_CONTINUATION:
+		if ( type == H2_CONTINUATION && !connection->continuation ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		iov.iov_base = payload;
+		iov.iov_len = length;
+		if ( connection->block_length + length > H2_INPUT_SIZE ||
+				!buffer_append_iov ( &connection->block, &connection->block_length, &iov, 1 ) ) {
+			return h2_goaway ( connection, H2_ENHANCE_YOUR_CALM );
+		}
+		if ( !( flags & H2_END_HEADERS ) ) {
+			connection->continuation = id;
+			break;
+		}
+		connection->continuation = 0;
+		return h2_header_block ( connection, id );
+	case H2_PRIORITY:
+		break;
+	case H2_RST_STREAM:
+		if ( id == 0 ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		if ( length != 4 ) {
+			return h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+		}
+		h2_stream_close ( stream );
+		break;
+	case H2_SETTINGS:
+		if ( id != 0 ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		if ( flags & H2_ACK ) {
+			break;
+		}
+		return h2_settings ( connection, payload, length ) &&
+			h2_put_frame ( connection, H2_SETTINGS, H2_ACK, 0, 0, 0 );
+	case H2_PUSH_PROMISE:
+		return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+	case H2_PING:
+		if ( id != 0 ) {
+			return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+		}
+		if ( length != 8 ) {
+			return h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+		}
+		if ( !( flags & H2_ACK ) ) {
+			return h2_put_frame ( connection, H2_PING, H2_ACK, 0, payload, 8 );
+		}
+		break;
+	case H2_GOAWAY:
+		connection->closing = true;
+		break;
+	case H2_WINDOW_UPDATE:
+		if ( length != 4 ) {
+			return h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+		}
+		increment = ( ( payload[0] & 0x7f ) << 24 ) | ( payload[1] << 16 ) | ( payload[2] << 8 ) | payload[3];
+		if ( id == 0 ) {
+			if ( increment == 0 || connection->window + (long long) increment > 0x7fffffff ) {
+				return h2_goaway ( connection, H2_FLOW_CONTROL_ERROR );
+			}
+			connection->window += increment;
+		} else if ( stream ) {
+			if ( increment == 0 || stream->window + (long long) increment > 0x7fffffff ) {
+				h2_reset ( connection, id, H2_FLOW_CONTROL_ERROR );
+			} else {
+				stream->window += increment;
+			}
+		}
+		break;
+	}
+	return true;
+}
+
+/*
+Queues a GOAWAY frame, ending the connection with the given error,
+once what is already waiting has been sent.
+
+Returns false, for the caller to pass on.
+*/
+bool h2_goaway ( struct H2_Connection * connection, int error ) {
+	unsigned char payload[8];
+	payload[0] = connection->last_stream >> 24;
+	payload[1] = connection->last_stream >> 16;
+	payload[2] = connection->last_stream >> 8;
+	payload[3] = connection->last_stream;
+	payload[4] = 0;
+	payload[5] = 0;
+	payload[6] = 0;
+	payload[7] = error;
+	h2_put_frame ( connection, H2_GOAWAY, 0, 0, payload, sizeof ( payload ) );
+	connection->closing = true;
+	log_message ( LOG_DEBUG, "HTTP/2 connection %d going away, error %d.\n", connection->fd, error );
+	return false;
+}
+
+/*
+Decodes a complete header block, and sends the stream it opens on its
+way: dispatched at once if the request has no body, otherwise once
+the body has arrived. A stream there was no room for is refused, and
+fields that follow the request, such as trailers, are passed over,
+but every block is decoded, to keep the dynamic table in step.
+
+Returns false if the block cannot be decoded.
+*/
+bool h2_header_block ( struct H2_Connection * connection, unsigned id ) {
+	struct H2_Stream * stream = h2_stream ( connection, id );
+	char * lines = buffer_get ( 2 * MAX_REQUEST_SIZE );
+	int length;
+	bool ok = true;
+
+	if ( !lines ) {
+		return h2_goaway ( connection, H2_ENHANCE_YOUR_CALM );
+	}
+	length = h2_decode ( connection, ( unsigned char * ) connection->block, connection->block_length,
+		lines, 2 * MAX_REQUEST_SIZE );
+	connection->block_length = 0;
+	if ( length < 0 ) {
+		ok = h2_goaway ( connection, H2_COMPRESSION_ERROR );
+	} else if ( !stream ) {
+		h2_reset ( connection, id, H2_REFUSED_STREAM );
+	} else if ( !stream->request ) {
+		stream->end_stream = connection->block_end_stream;
+		if ( !h2_request ( stream, lines, length ) ) {
+			h2_reset ( connection, id, H2_PROTOCOL_ERROR );
+		} else if ( stream->end_stream ) {
+			h2_dispatch ( connection, stream );
+		}
+	} else if ( connection->block_end_stream && !stream->dispatched ) {
+		stream->end_stream = true;
+		h2_dispatch ( connection, stream );
+	}
+	buffer_put ( lines );
+	return ok;
+}
+
+/*
+Sends the header of an HTTP/1.1 response, status line and all, as a
+HEADERS frame on the stream. The fields are sent as literals, never
+added to the client's dynamic table, named from the static table
+where it has them. Those that only mean anything to HTTP/1.1 are
+left out.
+
+Returns false if memory runs out.
+*/
+bool h2_headers ( struct H2_Connection * connection, struct H2_Stream * stream, const char * response, int length,
+		bool end_stream ) {
+	unsigned char block[1024];
+	const char * end = response + length;
+	const char * line;
+	const char * next;
+	const char * colon;
+	const char * value;
+	char name[64];
+	int name_length;
+	int value_length;
+	int count = 0;
+	int status;
+	int index;
+	int i;
+
+	//  The common statuses are whole fields in the static table
+	status = atoi ( response + 9 );
+	for ( index = 8; index <= 14 && atoi ( h2_static_table[index - 1][1] ) != status; index++ ) {
+	}
+	if ( index <= 14 ) {
+		block[count++] = 0x80 | index;
+	} else {
+		block[count++] = 0x08;
+		block[count++] = 3;
+		count += sprintf ( ( char * ) block + count, "%03d", status % 1000 );
+	}
+	line = ( const char * ) memchr ( response, '\n', length );
+	for ( line = line ? line + 1 : end; line < end; line = next + 1 ) {
+		next = ( const char * ) memchr ( line, '\n', end - line );
+		if ( !next ) {
+			break;
+		}
+		colon = ( const char * ) memchr ( line, ':', next - line );
+		if ( !colon || colon - line >= (int) sizeof ( name ) ) {
+			continue;
+		}
+		name_length = colon - line;
+		for ( i = 0; i < name_length; i++ ) {
+			name[i] = tolower ( line[i] );
+		}
+		for ( value = colon + 1; *value == ' '; value++ ) {
+		}
+		value_length = next - value;
+		if ( value_length > 0 && value[value_length - 1] == '\r' ) {
+			value_length--;
+		}
+		if ( ( name_length == 10 && !memcmp ( name, "connection", 10 ) ) ||
+				( name_length == 10 && !memcmp ( name, "keep-alive", 10 ) ) ||
+				( name_length == 17 && !memcmp ( name, "transfer-encoding", 17 ) ) ||
+				( name_length == 7 && !memcmp ( name, "upgrade", 7 ) ) ) {
+			continue;
+		}
+		if ( count + name_length + value_length + 12 > (int) sizeof ( block ) ) {
+			return false;
+		}
+		index = h2_static_find ( name, name_length );
+		if ( index ) {
+			count += h2_put_integer ( block + count, index, 4, 0x00 );
+		} else {
+			block[count++] = 0x00;
+			count += h2_put_integer ( block + count, name_length, 7, 0x00 );
+			memcpy ( block + count, name, name_length );
+			count += name_length;
+		}
+		count += h2_put_integer ( block + count, value_length, 7, 0x00 );
+		memcpy ( block + count, value, value_length );
+		count += value_length;
+	}
+	return h2_put_frame ( connection, H2_HEADERS, H2_END_HEADERS | ( end_stream ? H2_END_STREAM : 0 ),
+		stream->id, block, count );
+}
+
+/*
+Decodes a Huffman coded string, walking the tree a bit at a time.
+Headers are short, and decoded once a request.
+
+Returns the length decoded, or -1 if the string is malformed or does
+not fit.
+*/
+int h2_huffman ( unsigned char * in, int length, char * out, int max ) {
+	bool ones = true;
+	int count = 0;
+	int depth = 0;
+	int node = 0;
+	int next;
+	int bit;
+	int i;
+
+	for ( i = 0; i < length * 8; i++ ) {
+		bit = ( in[i >> 3] >> ( 7 - ( i & 7 ) ) ) & 1;
+		next = h2_huffman_tree[node][bit];
+		if ( next < 0 ) {
+			if ( next == -257 || count >= max ) {
+				return -1;
+			}
+			out[count++] = -next - 1;
+			node = 0;
+			depth = 0;
+			ones = true;
+		} else if ( next == 0 ) {
+			return -1;
+		} else {
+			node = next;
+			depth++;
+			ones = ones && bit;
+		}
+	}
+
+	//  What is left over must be padding: the start of the code for
+	//  the end of the string, all ones, shorter than a byte
+	if ( depth > 7 || !ones ) {
+		return -1;
+	}
+	return count;
+}
+
+/*
+Builds the tree the Huffman code is decoded with. Node 0 is the
+root; each branch leads to another node or, as a negative number, to
+one more than a symbol.
+*/
+void h2_huffman_build ( ) {
+	int nodes = 1;
+	int node;
+	int bit;
+	int i;
+	int j;
+
+	for ( i = 0; i < 257; i++ ) {
+		node = 0;
+		for ( j = h2_huffman_length[i] - 1; j > 0; j-- ) {
+			bit = ( h2_huffman_code[i] >> j ) & 1;
+			if ( !h2_huffman_tree[node][bit] ) {
+				h2_huffman_tree[node][bit] = nodes++;
+			}
+			node = h2_huffman_tree[node][bit];
+		}
+		h2_huffman_tree[node][h2_huffman_code[i] & 1] = - ( i + 1 );
+	}
+}
+
+/*
+Makes frames of what has been received, once the client's preface
+has been seen, and acts on each, as a server or, on a connection to
+an upstream, as the gateway. A frame that has not all arrived is
+kept for next time.
+
+Returns false if the connection is to be closed.
+*/
+bool h2_input ( struct H2_Connection * connection ) {
+	unsigned char * input = ( unsigned char * ) connection->input;
+	unsigned id;
+	int used = 0;
+	int length;
+	bool ok = true;
+
+	if ( !connection->preface ) {
+		if ( connection->input_length < H2_PREFACE_LENGTH ) {
+			return memcmp ( input, h2_preface, connection->input_length ) == 0;
+		}
+		if ( memcmp ( input, h2_preface, H2_PREFACE_LENGTH ) ) {
+			return false;
+		}
+		connection->preface = true;
+		used = H2_PREFACE_LENGTH;
+	}
+	while ( ok && connection->input_length - used >= 9 ) {
+		length = ( input[used] << 16 ) | ( input[used + 1] << 8 ) | input[used + 2];
+		if ( length > H2_FRAME_SIZE ) {
+			ok = h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+			break;
+		}
+		if ( connection->input_length - used < 9 + length ) {
+			break;
+		}
+		id = ( ( input[used + 5] & 0x7f ) << 24 ) | ( input[used + 6] << 16 ) | ( input[used + 7] << 8 ) | input[used + 8];
+		ok = ( connection->upstream ? gateway_frame : h2_frame ) ( connection, input[used + 3], input[used + 4], id,
+			input + used + 9, length );
+		used += 9 + length;
+	}
+	connection->input_length -= used;
+	memmove ( connection->input, connection->input + used, connection->input_length );
+	return ok;
+}
+
+/*
+Decodes an HPACK integer, which fills the bits of the first byte
+below the prefix and, if it does not fit there, carries on seven
+bits to a byte.
+
+Returns false if the integer runs off the end, or is too big.
+*/
+bool h2_integer ( unsigned char ** ptr, unsigned char * end, int prefix, int * value ) {
+	unsigned char * p = *ptr;
+	int max = ( 1 << prefix ) - 1;
+	int shift = 0;
+
+	if ( p >= end ) {
+		return false;
+	}
+	*value = *p++ & max;
+	if ( *value == max ) {
+		do {
+			if ( p >= end || shift > 21 ) {
+				return false;
+			}
+			*value += ( *p & 0x7f ) << shift;
+			shift += 7;
+		} while ( *p++ & 0x80 );
+	}
+	*ptr = p;
+	return true;
+}
+
+/*
+Queues a frame to be sent.
+
+Returns false if memory runs out.
+*/
+bool h2_put_frame ( struct H2_Connection * connection, int type, int flags, unsigned id, const void * payload,
+		int length ) {
+	unsigned char header[9];
+	struct iovec iov[2];
+
+	header[0] = length >> 16;
+	header[1] = length >> 8;
+	header[2] = length;
+	header[3] = type;
+	header[4] = flags;
+	header[5] = id >> 24;
+	header[6] = id >> 16;
+	header[7] = id >> 8;
+	header[8] = id;
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof ( header );
+	iov[1].iov_base = ( void * ) payload;
+	iov[1].iov_len = length;
+	return buffer_append_iov ( &connection->output, &connection->output_length, iov, length ? 2 : 1 );
+}
+
+/*
+Encodes an HPACK integer after the flags in the first byte, which
+leave prefix bits for it.
+
+Returns the number of bytes written.
+*/
+int h2_put_integer ( unsigned char * out, unsigned value, int prefix, int flags ) {
+	unsigned max = ( 1 << prefix ) - 1;
+	int count = 0;
+
+	if ( value < max ) {
+		out[0] = flags | value;
+		return 1;
+	}
+	out[count++] = flags | max;
+	value -= max;
+	while ( value >= 128 ) {
+		out[count++] = ( value & 0x7f ) | 0x80;
+		value >>= 7;
+	}
+	out[count++] = value;
+	return count;
+}
+
+/*
+Queues a WINDOW_UPDATE, giving the client room to send the given
+number of bytes more, on the stream or, for stream 0, the connection.
+
+Returns false if memory runs out.
+*/
+bool h2_put_window ( struct H2_Connection * connection, unsigned id, int increment ) {
+	unsigned char payload[4];
+	payload[0] = increment >> 24;
+	payload[1] = increment >> 16;
+	payload[2] = increment >> 8;
+	payload[3] = increment;
+	return h2_put_frame ( connection, H2_WINDOW_UPDATE, 0, id, payload, sizeof ( payload ) );
+}
+
+/*
+Reads what the client has sent, and acts on it.
+
+Returns false if the client has gone, or broken the protocol.
+*/
+bool h2_read ( struct H2_Connection * connection ) {
+	int n;
+	n = recv ( connection->fd, connection->input + connection->input_length,
+		H2_INPUT_SIZE - connection->input_length, MSG_DONTWAIT );
+	if ( n < 0 ) {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+	if ( n == 0 ) {
+		return false;
+	}
+	connection->input_length += n;
+	return h2_input ( connection );
+}
+
+/*
+Puts a stream's request back together as HTTP/1.1 text, from the
+lines of its decoded header block: the request line from the method
+and path, a Host header from the authority, then the other fields.
+
+Returns false if the request has no method or path, or is too big.
+*/
+bool h2_request ( struct H2_Stream * stream, char * lines, int length ) {
+	char * end = lines + length;
+	char * line;
+	char * next;
+	char * method = 0;
+	char * path = 0;
+	char * authority = 0;
+	int method_length = 0;
+	int path_length = 0;
+	int authority_length = 0;
+	int count;
+
+	for ( line = lines; line < end; line = next ) {
+		next = ( char * ) memchr ( line, '\n', end - line ) + 1;
+		if ( test_lead_string ( line, ":method: " ) ) {
+			method = line + 9;
+			method_length = next - method - 2;
+		} else if ( test_lead_string ( line, ":path: " ) ) {
+			path = line + 7;
+			path_length = next - path - 2;
+		} else if ( test_lead_string ( line, ":authority: " ) ) {
+			authority = line + 12;
+			authority_length = next - authority - 2;
+		}
+	}
+	if ( !method || !path || method_length + path_length + authority_length + length + 40 > MAX_REQUEST_SIZE - 2 ) {
+		return false;
+	}
+	stream->request = buffer_get ( MAX_REQUEST_SIZE );
+	if ( !stream->request ) {
+		return false;
+	}
+	count = sprintf ( stream->request, "%.*s %.*s HTTP/1.1\r\n", method_length, method, path_length, path );
+	if ( authority ) {
+		count += sprintf ( stream->request + count, "Host: %.*s\r\n", authority_length, authority );
+	}
+	for ( line = lines; line < end; line = next ) {
+		next = ( char * ) memchr ( line, '\n', end - line ) + 1;
+		if ( *line != ':' ) {
+			memcpy ( stream->request + count, line, next - line );
+			count += next - line;
+		}
+	}
+	memcpy ( stream->request + count, header_line_end, 3 );
+	stream->request_length = count + 2;
+	return true;
+}
+
+/*
+Resets a stream with the given error, letting go of it if it is open.
+*/
+void h2_reset ( struct H2_Connection * connection, unsigned id, int error ) {
+	unsigned char payload[4] = { 0, 0, 0, ( unsigned char ) error };
+	h2_put_frame ( connection, H2_RST_STREAM, 0, id, payload, sizeof ( payload ) );
+	h2_stream_close ( h2_stream ( connection, id ) );
+}
+
+/*
+Sends the response to a stream's request, as served by an HTTP/2
+worker: the header as a HEADERS frame, the body, if any, as DATA
+frames as the windows allow. The stream takes the response, and lets
+go of it once sent.
+*/
+void h2_respond ( struct H2_Connection * connection, struct H2_Stream * stream, char * response, int length ) {
+	char * end;
+	int header_length;
+
+	end = response ? ( char * ) memmem ( response, length, header_end, 4 ) : 0;
+	if ( !end ) {
+		h2_headers ( connection, stream, header_bad_request, sizeof ( header_bad_request ) - 1, true );
+		buffer_put ( response );
+		h2_stream_close ( stream );
+		return;
+	}
+	header_length = end + 4 - response;
+	h2_headers ( connection, stream, response, header_length, header_length == length );
+	if ( header_length == length ) {
+		buffer_put ( response );
+		h2_stream_close ( stream );
+		return;
+	}
+	stream->response = response;
+	stream->response_length = length;
+	stream->response_sent = header_length;
+}
+
+/*
+Sends each event stream on the connection the latest event, or the
+latest gateway event, if it has not yet had it and the flow control
+windows have room for it. The
+caller must hold event_mutex.
+*/
+void h2_send_events ( struct H2_Connection * connection ) {
+	struct H2_Stream * stream;
+	struct Event_Frame * frame;
+	unsigned long long round;
+	int i;
+
+	for ( i = 0; i < MAX_H2_STREAM; i++ ) {
+		stream = &connection->stream[i];
+		round = stream->gateway ? gateway_round : event_round;
+		if ( !stream->events || stream->event_round == round || connection->output_length >= H2_OUTPUT_LIMIT ) {
+			continue;
+		}
+		if ( stream->gateway ) {
+			frame = gateway_frame_get ( stream->event_round + 1 != round );
+		} else {
+			frame = event_frame_get ( stream->output_sequence != output_sequence );
+		}
+		if ( !frame ) {
+			continue;
+		}
+		if ( frame->length <= connection->window && frame->length <= stream->window &&
+				h2_put_frame ( connection, H2_DATA, 0, stream->id, frame->data, frame->length ) ) {
+			connection->window -= frame->length;
+			stream->window -= frame->length;
+			stream->event_round = round;
+			stream->output_sequence = output_sequence;
+		}
+		event_frame_put ( frame );
+	}
+}
+
+/*
+Sends as much of each stream's response as the flow control windows,
+and the frames already waiting, allow. A stream is done with once the
+last of its response has gone.
+*/
+void h2_send_pending ( struct H2_Connection * connection ) {
+	struct H2_Stream * stream;
+	int remaining;
+	int length;
+	int i;
+
+	for ( i = 0; i < MAX_H2_STREAM; i++ ) {
+		stream = &connection->stream[i];
+		while ( stream->response && connection->window > 0 && stream->window > 0 &&
+				connection->output_length < H2_OUTPUT_LIMIT ) {
+			remaining = stream->response_length - stream->response_sent;
+			length = remaining < H2_FRAME_SIZE ? remaining : H2_FRAME_SIZE;
+			if ( length > connection->window ) {
+				length = connection->window;
+			}
+			if ( length > stream->window ) {
+				length = stream->window;
+			}
+			if ( !h2_put_frame ( connection, H2_DATA, length == remaining ? H2_END_STREAM : 0, stream->id,
+					stream->response + stream->response_sent, length ) ) {
+				return;
+			}
+			connection->window -= length;
+			stream->window -= length;
+			stream->response_sent += length;
+			if ( length == remaining ) {
+				h2_stream_close ( stream );
+			}
+		}
+	}
+}
+
+/*
+The HTTP/2 thread. Takes up the connections handed over to it, serves
+the streams on each as their frames arrive, and sends the event
+streams each round of events as the event thread publishes it.
+*/
+void *h2_server ( void * unused ) {
+	struct pollfd poll_fd[MAX_H2_CONNECTION + 1];
+	struct H2_Connection * polled[MAX_H2_CONNECTION + 1];
+	struct H2_Adopted adopted[MAX_H2_CONNECTION];
+	struct H2_Connection * connection;
+	unsigned long long wakes;
+	int adopted_count;
+	int count;
+	int i;
+
+	log_message ( LOG_INFO, "Enter HTTP/2 server.\n" );
+	for (;;) {
+		poll_fd[0].fd = h2_wake_fd;
+		poll_fd[0].events = POLLIN;
+		count = 1;
+		for ( i = 0; i < MAX_H2_CONNECTION; i++ ) {
+			if ( h2_connection[i].fd >= 0 ) {
+				poll_fd[count].fd = h2_connection[i].fd;
+				poll_fd[count].events = POLLIN | ( h2_connection[i].output_length ? POLLOUT : 0 );
+				polled[count] = &h2_connection[i];
+				count++;
+			}
+		}
+		if ( poll ( poll_fd, count, 1000 ) < 0 ) {
+			continue;
+		}
+
+		//  Serve what the clients have sent
+		for ( i = 1; i < count; i++ ) {
+			if ( ( poll_fd[i].revents & ( POLLIN | POLLHUP | POLLERR ) ) && !h2_read ( polled[i] ) ) {
+				polled[i]->closing = true;
+			}
+		}
+
+		//  Take back the responses the workers are done with, and take
+		//  up the connections handed over
+		if ( poll_fd[0].revents ) {
+			if ( read ( h2_wake_fd, &wakes, sizeof ( wakes ) ) < 0 ) {
+				wakes = 0;
+			}
+			h2_finish ( );
+			pthread_mutex_lock ( &h2_mutex );
+			adopted_count = h2_adopted_count;
+			memcpy ( adopted, h2_adopted, adopted_count * sizeof ( adopted[0] ) );
+			h2_adopted_count = 0;
+			h2_connection_count += adopted_count;
+			pthread_mutex_unlock ( &h2_mutex );
+			for ( i = 0; i < adopted_count; i++ ) {
+				h2_start ( &adopted[i] );
+			}
+		}
+
+		//  Send what there is room for, the events last, and close
+		//  the connections that are finished with
+		for ( i = 0; i < MAX_H2_CONNECTION; i++ ) {
+			if ( h2_connection[i].fd >= 0 && !h2_connection[i].closing ) {
+				h2_send_pending ( &h2_connection[i] );
+			}
+		}
+		pthread_mutex_lock ( &event_mutex );
+		for ( i = 0; i < MAX_H2_CONNECTION; i++ ) {
+			if ( h2_connection[i].fd >= 0 && !h2_connection[i].closing ) {
+				h2_send_events ( &h2_connection[i] );
+			}
+		}
+		pthread_mutex_unlock ( &event_mutex );
+		for ( i = 0; i < MAX_H2_CONNECTION; i++ ) {
+			connection = &h2_connection[i];
+			if ( connection->fd >= 0 && ( !h2_flush ( connection ) ||
+					( connection->closing && connection->output_length == 0 ) ) ) {
+				h2_close ( connection );
+				pthread_mutex_lock ( &h2_mutex );
+				h2_connection_count--;
+				pthread_mutex_unlock ( &h2_mutex );
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+Takes on the settings the client has sent. Only the flow control
+window for new streams matters here: the responses never use the
+dynamic table, frames are never sent bigger than the least every
+client must take, and nothing is pushed.
+
+Returns false, having queued a GOAWAY, if a setting is out of range.
+*/
+bool h2_settings ( struct H2_Connection * connection, unsigned char * payload, int length ) {
+	unsigned value;
+	int i;
+	int j;
+
+	if ( length % 6 ) {
+		return h2_goaway ( connection, H2_FRAME_SIZE_ERROR );
+	}
+	for ( i = 0; i < length; i += 6 ) {
+		value = ( payload[i + 2] << 24 ) | ( payload[i + 3] << 16 ) | ( payload[i + 4] << 8 ) | payload[i + 5];
+		switch ( ( payload[i] << 8 ) | payload[i + 1] ) {
+
+		//  SETTINGS_INITIAL_WINDOW_SIZE, which changes the windows of
+		//  the streams already open as well
+		case 4:
+			if ( value > 0x7fffffff ) {
+				return h2_goaway ( connection, H2_FLOW_CONTROL_ERROR );
+			}
+			for ( j = 0; j < MAX_H2_STREAM; j++ ) {
+				if ( connection->stream[j].id ) {
+					connection->stream[j].window += (int) value - connection->peer_window;
+				}
+			}
+			connection->peer_window = value;
+			break;
+
+		//  SETTINGS_MAX_FRAME_SIZE
+		case 5:
+			if ( value < H2_FRAME_SIZE || value > 0xffffff ) {
+				return h2_goaway ( connection, H2_PROTOCOL_ERROR );
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+Takes up a connection handed over to the HTTP/2 thread. The server's
+preface, a SETTINGS frame, goes first. Then what came with the
+connection is served: the start of its frames or, for an upgrade, the
+request it was upgraded by, as stream 1, with the settings from its
+HTTP2-Settings header.
+*/
+void h2_start ( struct H2_Adopted * adopted ) {
+	static const unsigned char settings[] = { 0, 3, 0, 0, 0, MAX_H2_STREAM };
+	struct H2_Connection * connection;
+	struct H2_Stream * stream;
+	unsigned char decoded[60];
+	unsigned bits = 0;
+	char * ptr;
+	int bit_count = 0;
+	int digit;
+	int n = 0;
+	int i;
+	bool ok;
+
+	//  h2_adopt made sure there is room
+	for ( i = 0; h2_connection[i].fd >= 0; i++ ) {
+	}
+	connection = &h2_connection[i];
+	connection->fd = adopted->fd;
+	connection->generation = ++h2_generation;
+	connection->window = H2_WINDOW;
+	connection->peer_window = H2_WINDOW;
+	connection->table.max_size = H2_TABLE_SIZE;
+	connection->input = buffer_get ( H2_INPUT_SIZE );
+	fcntl ( connection->fd, F_SETFL, fcntl ( connection->fd, F_GETFL ) | O_NONBLOCK );
+	set_tcp_option ( connection->fd, TCP_NODELAY, 1 );
+	ok = connection->input && h2_put_frame ( connection, H2_SETTINGS, 0, 0, settings, sizeof ( settings ) );
+	if ( ok && adopted->upgrade ) {
+
+		//  The settings are base64url encoded
+		ptr = get_header ( adopted->data, "HTTP2-Settings" );
+		for ( ; ptr && n < (int) sizeof ( decoded ); ptr++ ) {
+			if ( *ptr >= 'A' && *ptr <= 'Z' ) {
+				digit = *ptr - 'A';
+			} else if ( *ptr >= 'a' && *ptr <= 'z' ) {
+				digit = *ptr - 'a' + 26;
+			} else if ( *ptr >= '0' && *ptr <= '9' ) {
+				digit = *ptr - '0' + 52;
+			} else if ( *ptr == '-' || *ptr == '+' ) {
+				digit = 62;
+			} else if ( *ptr == '_' || *ptr == '/' ) {
+				digit = 63;
+			} else {
+				break;
+			}
+			bits = ( ( bits << 6 ) | digit ) & 0xffff;
+			bit_count += 6;
+			if ( bit_count >= 8 ) {
+				bit_count -= 8;
+				decoded[n++] = bits >> bit_count;
+			}
+		}
+		ok = h2_settings ( connection, decoded, n - n % 6 );
+		stream = &connection->stream[0];
+		stream->id = 1;
+		stream->window = connection->peer_window;
+		stream->end_stream = true;
+		stream->request = adopted->data;
+		stream->request_length = adopted->length;
+		adopted->data = 0;
+		connection->last_stream = 1;
+		if ( ok ) {
+			h2_dispatch ( connection, stream );
+		}
+	} else if ( ok ) {
+		memcpy ( connection->input, adopted->data, adopted->length );
+		connection->input_length = adopted->length;
+		ok = h2_input ( connection );
+	}
+	buffer_put ( adopted->data );
+	if ( !ok ) {
+		connection->closing = true;
+	}
+	log_message ( LOG_DEBUG, "HTTP/2 connection %d started.\n", connection->fd );
+}
+
+/*
+Returns the index in the static table of the first field with the
+name, or 0 if there is none.
+*/
+int h2_static_find ( const char * name, int length ) {
+	int i;
+	for ( i = 0; i < (int) ( sizeof ( h2_static_table ) / sizeof ( h2_static_table[0] ) ); i++ ) {
+		if ( !strncmp ( h2_static_table[i][0], name, length ) && h2_static_table[i][0][length] == 0 ) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+Returns the open stream with the given id, or 0 if there is none.
+*/
+struct H2_Stream *h2_stream ( struct H2_Connection * connection, unsigned id ) {
+	int i;
+	for ( i = 0; i < MAX_H2_STREAM && id; i++ ) {
+		if ( connection->stream[i].id == id ) {
+			return &connection->stream[i];
+		}
+	}
+	return 0;
+}
+
+/*
+Lets go of a stream, and everything it holds. A null stream is
+ignored.
+*/
+void h2_stream_close ( struct H2_Stream * stream ) {
+	if ( stream ) {
+		buffer_put ( stream->request );
+		buffer_put ( stream->response );
+		memset ( stream, 0, sizeof ( *stream ) );
+	}
+}
+
+/*
+Decodes an HPACK string, Huffman coded or not, into the buffer.
+
+Returns its length, or -1 if it is malformed or does not fit.
+*/
+int h2_string ( unsigned char ** ptr, unsigned char * end, char * out, int max ) {
+	bool huffman;
+	int length;
+	int decoded;
+
+	if ( *ptr >= end ) {
+		return -1;
+	}
+	huffman = ( **ptr & 0x80 ) != 0;
+	if ( !h2_integer ( ptr, end, 7, &length ) || length > end - *ptr ) {
+		return -1;
+	}
+	if ( huffman ) {
+		decoded = h2_huffman ( *ptr, length, out, max );
+	} else if ( length > max ) {
+		decoded = -1;
+	} else {
+		memcpy ( out, *ptr, length );
+		decoded = length;
+	}
+	*ptr += length;
+	return decoded;
+}
+
+/*
+Adds a field to the dynamic table as its newest, making room by
+dropping the oldest. A field bigger than the whole table empties it,
+and is not added.
+
+Returns false if memory runs out.
+*/
+bool h2_table_add ( struct H2_Table * table, const char * name, int name_length, const char * value, int value_length ) {
+	struct H2_Field * field;
+	int size = name_length + value_length + 32;
+	char * copy = 0;
+
+	//  The name may be one of the fields about to be dropped, so it
+	//  is copied first
+	if ( size <= table->max_size ) {
+		copy = ( char * ) malloc ( name_length + value_length );
+		if ( !copy ) {
+			return false;
+		}
+		memcpy ( copy, name, name_length );
+		memcpy ( copy + name_length, value, value_length );
+	}
+	h2_table_resize ( table, table->max_size - size );
+	if ( !copy ) {
+		return true;
+	}
+	field = &table->field[( table->first + table->count ) % H2_TABLE_FIELDS];
+	field->name = copy;
+	field->name_length = name_length;
+	field->value = copy + name_length;
+	field->value_length = value_length;
+	table->count++;
+	table->size += size;
+	return true;
+}
+
+/*
+Looks up a field by its HPACK index: the static table first, then the
+dynamic table, newest first.
+
+Returns false if there is no field with the index.
+*/
+bool h2_table_field ( struct H2_Table * table, int index, const char ** name, int * name_length,
+		const char ** value, int * value_length ) {
+	struct H2_Field * field;
+	int statics = sizeof ( h2_static_table ) / sizeof ( h2_static_table[0] );
+
+	if ( index <= 0 ) {
+		return false;
+	}
+	if ( index <= statics ) {
+		*name = h2_static_table[index - 1][0];
+		*name_length = strlen ( *name );
+		*value = h2_static_table[index - 1][1];
+		*value_length = strlen ( *value );
+		return true;
+	}
+	index -= statics;
+	if ( index > table->count ) {
+		return false;
+	}
+	field = &table->field[( table->first + table->count - index ) % H2_TABLE_FIELDS];
+	*name = field->name;
+	*name_length = field->name_length;
+	*value = field->value;
+	*value_length = field->value_length;
+	return true;
+}
+
+/*
+Drops the oldest fields from the dynamic table until it holds no more
+than size.
+*/
+void h2_table_resize ( struct H2_Table * table, int size ) {
+	struct H2_Field * field;
+	while ( table->count > 0 && table->size > size ) {
+		field = &table->field[table->first];
+		table->size -= field->name_length + field->value_length + 32;
+		free ( field->name );
+		table->first = ( table->first + 1 ) % H2_TABLE_FIELDS;
+		table->count--;
+	}
+}
+
+/*
+Wakes the HTTP/2 thread, to take up a connection handed over to it or
+to send a round of events.
+*/
+void h2_wake ( ) {
+	unsigned long long one = 1;
+	if ( h2_wake_fd >= 0 && write ( h2_wake_fd, &one, sizeof ( one ) ) < 0 ) {
+		log_message ( LOG_DEBUG, "h2_wake: %s\n", strerror ( errno ) );
+	}
+}
+
+/*
+Returns how a request asks for HTTP/2: H2_PRIOR_KNOWLEDGE if it is
+the start of the connection preface, H2_UPGRADE if it asks to upgrade
+to h2c with its settings, otherwise 0.
+*/
+int h2_wanted ( char * request, int length ) {
+	char * upgrade;
+	if ( length >= 18 && memcmp ( request, h2_preface, 18 ) == 0 ) {
+		return H2_PRIOR_KNOWLEDGE;
+	}
+	upgrade = get_header ( request, "Upgrade" );
+	if ( upgrade && test_lead_string ( upgrade, "h2c" ) && get_header ( request, "HTTP2-Settings" ) ) {
+		return H2_UPGRADE;
+	}
+	return 0;
+}
+
+/*
+An HTTP/2 worker thread. Serves the requests the HTTP/2 thread hands
+over, one at a time, for ever, gathering up each response and waking
+the HTTP/2 thread to send it.
+*/
+void *h2_worker ( void * unused ) {
+	struct H2_Job * job;
+	for (;;) {
+		pthread_mutex_lock ( &h2_job_mutex );
+		while ( h2_job_count == 0 ) {
+			pthread_cond_wait ( &h2_job_ready, &h2_job_mutex );
+		}
+		job = &h2_job[h2_job_queue[h2_job_head]];
+		h2_job_head = ( h2_job_head + 1 ) % MAX_H2_JOB;
+		h2_job_count--;
+		pthread_mutex_unlock ( &h2_job_mutex );
+
+		//  Only this worker touches the job until it is marked done
+		h2_capture = job;
+		try {
+			process_request ( job->request, job->request_length, job->fd );
+		} catch ( ... ) {
+			log_message ( LOG_ERROR, "h2_worker unknown exception.\n" );
+		}
+		h2_capture = 0;
+		pthread_mutex_lock ( &h2_job_mutex );
+		job->state = H2_JOB_DONE;
+		pthread_mutex_unlock ( &h2_job_mutex );
+		h2_wake ( );
+	}
+	return 0;
+}
+
+/*
+Initialise everything that needs it
+*/
+void initialise() {
+//	int mmap_fd;
+//	int length;
+	struct sigaction act;
+
+	try_catch_count = 0;
+
+	//  Start logging before anything else
+	if ( verbose ) {
+		opt_log_level = LOG_DEBUG;
+	}
+	log_start ( );
+
+	//  Configure the PiFace digital 2 things
+	pifacedigital_open( pif_hw_addr );
+	log_message ( LOG_DEBUG, "Opened PiFace Digfital 2 with hardware addess %d\n", pif_hw_addr );
+	pif_interrupts_enabled = !pifacedigital_enable_interrupts();
+	if ( pif_interrupts_enabled ) {
+		log_message ( LOG_DEBUG, "PiFace Digfital 2 interrups enabled.\n" );
+	} else {
+		log_message ( LOG_WARN, "PiFace Digfital 2 interrups NOT enabled.\n" );
+	}
+	pif_output = 0;
+
+	//  Set up the event streams
+	int i;
+	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+		event_stream[i].fd = -1;
+		event_stream[i].gzip = false;
+	}
+	//  Zero the outputs
+	for ( i = 0; i < 8 ; i++ ) {
+		output[i] = '0';
+	}
+
+	//  No control programs yet
+	for ( i = 0; i < MAX_CONTROL_CLIENT; i++ ) {
+		control_client[i].fd = -1;
+	}
+
+	//  Nor HTTP/2 connections
+	for ( i = 0; i < MAX_H2_CONNECTION; i++ ) {
+		h2_connection[i].fd = -1;
+	}
+
+	//  Carry on the statistics from before the last restart
+	stats_load ( );
+
+	//  Be graceful about web browser closing down
+	memset ( &act, 0, sizeof(act));
+	act.sa_handler = SIG_IGN;
+	act.sa_flags = SA_RESTART;
+	sigaction (SIGPIPE, &act, NULL);
+
+	//  SIGUSR1 asks for the trace to be written out
+	act.sa_handler = trace_signal_handler;
+	sigaction (SIGUSR1, &act, NULL);
+	tracing = opt_trace != 0;
+}
+
+/*
+Reads the named file into the asset, along with its precompressed
+variants. A "name.gz" or "name.br" sibling on disk is used as is;
+failing a .gz sibling, text files are gzipped here, once.
+
+Returns false if the file cannot be read.
+*/
+bool load_asset ( struct Asset * asset, char * name ) {
+	char   variant_name[310];
+	char * disk_page;
+	int    disk_page_length;
+	int    i;
+
+	disk_page = read_file ( name, &disk_page_length );
+	if ( !disk_page ) {
+		return false;
+	}
+	memset ( asset, 0, sizeof ( *asset ) );
+	strncpy ( asset->name, name, sizeof ( asset->name ) - 1 );
+	for ( i = 0; *content_types[i].extension; i++ ) {
+		if ( test_tail_string ( name, content_types[i].extension ) ) {
+			break;
+		}
+	}
+	asset->type = &content_types[i];
+
+	//  Text pages are compiled before they are served
+	if ( asset->type->text ) {
+		asset->body = ( char * ) malloc ( disk_page_length + 1 );
+		asset->slots = ( struct Template_Slot * ) malloc ( MAX_TEMPLATE_SLOTS * sizeof ( struct Template_Slot ) );
+		asset->body_length = expand_page ( disk_page, asset->body, disk_page_length, asset->slots, &asset->slot_count );
+		if ( asset->slot_count == 0 ) {
+			free ( asset->slots );
+			asset->slots = 0;
+		}
+		free ( disk_page );
+	} else {
+		asset->body = disk_page;
+		asset->body_length = disk_page_length;
+	}
+
+	//  Pick up or build the compressed variants. A page showing the
+	//  state is different every time, so is always sent as it is.
+	if ( asset->slot_count == 0 ) {
+		snprintf ( variant_name, sizeof ( variant_name ), "%s.gz", name );
+		asset->gzip = read_file ( variant_name, &asset->gzip_length );
+		if ( !asset->gzip && asset->type->text ) {
+			asset->gzip = gzip_buffer ( asset->body, asset->body_length, &asset->gzip_length );
+		}
+		snprintf ( variant_name, sizeof ( variant_name ), "%s.br", name );
+		asset->brotli = read_file ( variant_name, &asset->brotli_length );
+	}
+
+	//  Validators are hashes of the bytes actually sent
+	sprintf ( asset->etag, "\"%016llx\"", hash_buffer ( asset->body, asset->body_length ) );
+	if ( asset->gzip ) {
+		sprintf ( asset->gzip_etag, "\"%016llx\"", hash_buffer ( asset->gzip, asset->gzip_length ) );
+	}
+	if ( asset->brotli ) {
+		sprintf ( asset->brotli_etag, "\"%016llx\"", hash_buffer ( asset->brotli, asset->brotli_length ) );
+	}
+	if ( *asset->type->max_age > 0 ) {
+		sprintf ( asset->cache_control, "Cache-Control: max-age=%d\r\n", *asset->type->max_age );
+	} else {
+		strcpy ( asset->cache_control, "Cache-Control: no-cache\r\n" );
+	}
+	log_message ( LOG_DEBUG, "load_asset: %s %d bytes, gzip %d, br %d, %d slots\n", name,
+			asset->body_length, asset->gzip_length, asset->brotli_length, asset->slot_count );
+	return true;
+}
+
+/*
+Writes out everything logged so far, from every thread. Runs in the
+log thread, and at exit.
+*/
+void log_flush ( ) {
+	static char buffer[16384];
+	struct Log_Ring * ring;
+	unsigned head;
+	unsigned dropped;
+	int length = 0;
+	int n;
+
+	pthread_mutex_lock ( &log_mutex );
+	for ( ring = log_rings; ring; ring = ring->next ) {
+		head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+		while ( ring->tail != head ) {
+			n = strlen ( ring->record[ring->tail & ( ring->size - 1 )] );
+			if ( length + n > (int) sizeof ( buffer ) ) {
+				write ( STDOUT_FILENO, buffer, length );
+				length = 0;
+			}
+			memcpy ( buffer + length, ring->record[ring->tail & ( ring->size - 1 )], n );
+			length += n;
+			__atomic_store_n ( &ring->tail, ring->tail + 1, __ATOMIC_RELEASE );
+		}
+		dropped = __atomic_exchange_n ( &ring->dropped, 0, __ATOMIC_RELAXED );
+		if ( dropped ) {
+			log_dropped += dropped;
+			if ( length + 64 > (int) sizeof ( buffer ) ) {
+				write ( STDOUT_FILENO, buffer, length );
+				length = 0;
+			}
+			length += sprintf ( buffer + length, "%s %5d W %u messages dropped\n",
+				ring->clock, ring->thread, dropped );
+		}
+	}
+	if ( length > 0 ) {
+		write ( STDOUT_FILENO, buffer, length );
+	}
+	pthread_mutex_unlock ( &log_mutex );
+}
+
+/*
+Logs a message, if its level is wanted. The message is formatted
+straight into the calling thread's ring, stamped with the time, the
+thread and the level, and never waits: if the thread is over its
+rate, or the ring is full, the message is dropped.
+*/
+void log_message ( int level, const char * format, ... ) {
+	static const char level_letter[] = "EWID";
+	struct Log_Ring * ring;
+	struct timespec now;
+	struct tm tm;
+	va_list args;
+	char * record;
+	unsigned head;
+	int n;
+
+	if ( __builtin_expect ( level > opt_log_level, 1 ) ) {
+		return;
+	}
+	ring = log_ring ? log_ring : log_register ( );
+	if ( !ring ) {
+		return;
+	}
+
+	//  Keep to the rate
+	clock_gettime ( CLOCK_REALTIME, &now );
+	ring->tokens += ( now.tv_sec - ring->refilled.tv_sec ) * (double) opt_log_rate
+		+ ( now.tv_nsec - ring->refilled.tv_nsec ) * (double) opt_log_rate / 1e9;
+	ring->refilled = now;
+	if ( ring->tokens > opt_log_rate ) {
+		ring->tokens = opt_log_rate;
+	}
+	head = ring->head;
+	if ( ring->tokens < 1 || head - __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE ) >= ring->size ) {
+		__atomic_fetch_add ( &ring->dropped, 1, __ATOMIC_RELAXED );
+		return;
+	}
+	ring->tokens -= 1;
+
+	//  Format the message into the ring
+	if ( now.tv_sec != ring->second ) {
+		ring->second = now.tv_sec;
+		localtime_r ( &now.tv_sec, &tm );
+		strftime ( ring->clock, sizeof ( ring->clock ), "%H:%M:%S", &tm );
+	}
+	record = ring->record[head & ( ring->size - 1 )];
+	n = sprintf ( record, "%s.%06ld %5d %c ", ring->clock, now.tv_nsec / 1000, ring->thread, level_letter[level & 3] );
+	va_start ( args, format );
+	n += vsnprintf ( record + n, LOG_RECORD_SIZE - n, format, args );
+	va_end ( args );
+	if ( n > LOG_RECORD_SIZE - 2 ) {
+		n = LOG_RECORD_SIZE - 2;
+	}
+	if ( record[n - 1] != '\n' ) {
+		record[n++] = '\n';
+		record[n] = 0;
+	}
+	__atomic_store_n ( &ring->head, head + 1, __ATOMIC_RELEASE );
+}
+
+/*
+Sets up the calling thread's log ring, on its first message.
+
+Returns null if memory runs out.
+*/
+struct Log_Ring *log_register ( ) {
+	struct Log_Ring * ring;
+	unsigned size = ring_size ( opt_log_records );
+	ring = ( struct Log_Ring * ) calloc ( 1, sizeof ( *ring ) + size * LOG_RECORD_SIZE );
+	if ( !ring ) {
+		return 0;
+	}
+	ring->record = ( char ( * )[LOG_RECORD_SIZE] ) ( ring + 1 );
+	ring->size = size;
+	ring->thread = syscall ( SYS_gettid );
+	ring->tokens = opt_log_rate;
+	clock_gettime ( CLOCK_REALTIME, &ring->refilled );
+	pthread_mutex_lock ( &log_mutex );
+	ring->next = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock ( &log_mutex );
+	log_ring = ring;
+	return ring;
+}
+
+/*
+Starts the log thread, and sees that whatever is left is written
+out when the server exits.
+*/
+void log_start ( ) {
+	pthread_attr_t attributes;
+	pthread_t thread;
+	if ( opt_log_rate < 1 ) {
+		opt_log_rate = 1;
+	}
+	atexit ( log_flush );
+	pthread_attr_init ( &attributes );
+	pthread_attr_setdetachstate ( &attributes, PTHREAD_CREATE_DETACHED );
+	set_stack_size ( &attributes );
+	if ( pthread_create ( &thread, &attributes, log_thread, 0 ) != 0 ) {
+		perror ( "ERROR creating log thread" );
+	}
+	pthread_attr_destroy ( &attributes );
+}
+
+/*
+The log thread. Writes out what has been logged, twenty times a
+second.
+*/
+void *log_thread ( void * unused ) {
+	struct timespec interval = { 0, 50000000 };
+	for (;;) {
+		nanosleep ( &interval, 0 );
+		log_flush ( );
+	}
+	return 0;
+}
+
+/*
+Returns true if the If-None-Match header value lists the given
+entity tag, or is "*". The value is a list of quoted tags separated
+by commas, each compared whole; weak tags match their strong
+equivalents, as If-None-Match uses weak comparison. A "*" counts
+only as the whole value, and the list stops at anything malformed.
+*/
+bool match_etag ( char * if_none_match, const char * etag ) {
+	int length = strlen ( etag );
+	char * ptr = if_none_match;
+	char * end;
+	if ( !ptr ) {
+		return false;
+	}
+	while ( *ptr == ' ' || *ptr == '\t' ) {
+		ptr++;
+	}
+	if ( *ptr == '*' ) {
+		for ( ptr++; *ptr == ' ' || *ptr == '\t'; ptr++ ) {
+		}
+		return *ptr == 0 || *ptr == '\r' || *ptr == '\n';
+	}
+	for (;;) {
+		while ( *ptr == ' ' || *ptr == '\t' || *ptr == ',' ) {
+			ptr++;
+		}
+		if ( ptr[0] == 'W' && ptr[1] == '/' ) {
+			ptr += 2;
+		}
+		if ( *ptr != '"' ) {
+			return false;
+		}
+		for ( end = ptr + 1; *end && *end != '"' && *end != '\r' && *end != '\n'; end++ ) {
+		}
+		if ( *end != '"' ) {
+			return false;
+		}
+		end++;
+		if ( end - ptr == length && memcmp ( ptr, etag, length ) == 0 ) {
+			return true;
+		}
+		for ( ptr = end; *ptr == ' ' || *ptr == '\t'; ptr++ ) {
+		}
+		if ( *ptr != ',' ) {
+			return false;
+		}
+	}
+}
+
+/*
+This procedure advises the connected web browser to expect
+server-side events. It is response to the request for the
+pseudo file "events.qif", or for "gateway.qif" in gateway mode.
+
+The stream is registered with the event thread, and given the
+current state straight away. From then on the socket belongs to the
+event thread, or for a gateway stream the gateway thread, which is
+the one that sends it events.
+
+Returns false if there is no free event stream, in which case the
+browser is asked to try again later.
+*/
+bool open_event_stream ( int fd, bool gzip, bool gateway ) {
+	struct Event_Stream * stream = 0;
+	bool ok;
+	int i;
+
+	pthread_mutex_lock ( &event_mutex );
+	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+		if ( event_stream[i].fd < 0 && !event_stream[i].sending ) {
+			stream = &event_stream[i];
+			break;
+		}
+	}
+	if ( !stream ) {
+		pthread_mutex_unlock ( &event_mutex );
+		write_header ( fd, header_unavailable, sizeof ( header_unavailable ) - 1 );
+		return false;
+	}
+
+	//  Events are small and latency sensitive, so send each one
+	//  as soon as it is written rather than waiting on Nagle.
+	set_tcp_option ( fd, TCP_NODELAY, 1 );
+	if ( gzip ) {
+		ok = write_header ( fd, header_event_stream_gzip, sizeof ( header_event_stream_gzip ) - 1 );
+	} else {
+		ok = write_header ( fd, header_event_stream, sizeof ( header_event_stream ) - 1 );
+	}
+
+	//  From here on the socket must never block the event thread,
+	//  and the kernel should hold only a few seconds of events
+	if ( !uring_capture ) {
+		int size = EVENT_SEND_BUFFER;
+		setsockopt ( fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof ( size ) );
+		fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+	}
+
+	//  Register the stream
+	stream->fd = fd;
+	stream->output_sequence = 0;
+	stream->gateway = gateway;
+	stream->gateway_round = 0;
+	stream->gzip = gzip;
+	stream->ring = uring_capture ? uring_capture->ring : 0;
+	stream->busy = false;
+	event_frame_put ( stream->frame );
+	stream->frame = 0;
+	stream->frame_sent = 0;
+	stream->stalled = false;
+	if ( gzip ) {
+		memset ( &stream->deflate, 0, sizeof ( stream->deflate ) );
+
+		//  Events are short and much alike, so a 512 byte window
+		//  finds nearly all there is to find, in a few kilobytes
+		//  rather than the quarter of a megabyte of the defaults
+		deflateInit2 ( &stream->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 9 + 16, 1, Z_DEFAULT_STRATEGY );
+	}
+	log_message ( LOG_DEBUG, "Registered event stream %d\n", fd );
+	if ( !ok || !send_event ( stream ) ) {
+		close_event_stream ( stream );
+	}
+
+	//  On the ring, the header and first event are still to be
+	//  sent, so hold the event thread off until they have been
+	stream->busy = stream->fd >= 0 && uring_capture != 0;
+	pthread_mutex_unlock ( &event_mutex );
+	return true;
+}
+
+/*
+Opens a socket listening for connection requests from web browsers
+on the given port. With reuse_port, the socket shares the port with
+the other listeners.
+
+Returns -1 if the socket cannot be opened.
+*/
+int open_listen_socket ( int port, bool reuse_port ) {
+	struct sockaddr_in serv_addr;
+	int enable = 1;
+	int fd;
+
+	fd = socket ( AF_INET, SOCK_STREAM, 0 );
+	if ( fd < 0 ) {
+		error ( "ERROR opening socket" );
+		return -1;
+	}
+	if ( setsockopt ( fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof ( int ) ) < 0 ) {
+		error ( "ERROR setsockopt SO_REUSEADDR" );
+	}
+	if ( reuse_port && setsockopt ( fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof ( int ) ) < 0 ) {
+		error ( "ERROR setsockopt SO_REUSEPORT" );
+		close ( fd );
+		return -1;
+	}
+	bzero ( ( char * ) &serv_addr, sizeof ( serv_addr ) );
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons ( port );
+	if ( bind ( fd, ( struct sockaddr * ) &serv_addr, sizeof ( serv_addr ) ) < 0 ) {
+		error ( "ERROR on binding" );
+		close ( fd );
+		return -1;
+	}
+	if ( listen ( fd, opt_backlog ) < 0 ) {
+		error ( "ERROR on listen" );
+		close ( fd );
+		return -1;
+	}
+	return fd;
+}
+
+/*
+Changes the sampling of the inputs:
+
+    PUT /config.qif?sample=N&sample_min=N
+
+in microseconds, either or both. A value that is not a number, or
+is out of range, is refused with a 400. The reply is the sampling,
+as from a GET of config.qif.
+
+Returns false, as the socket is finished with.
+*/
+bool process_config_request ( char * from_browser, int fd ) {
+	char * query = get_query ( from_browser );
+	int sample = get_query_number ( query, "sample", MAX_SAMPLE_PERIOD );
+	int sample_min = get_query_number ( query, "sample_min", MAX_SAMPLE_PERIOD );
+
+	if ( sample == -2 || sample_min == -2 || ( sample >= 0 && sample < MIN_SAMPLE_PERIOD ) ||
+			( sample_min > 0 && sample_min < MIN_SAMPLE_PERIOD ) ) {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+	if ( sample >= 0 ) {
+		opt_sample = sample;
+	}
+	if ( sample_min >= 0 ) {
+		opt_sample_min = sample_min;
+	}
+	return route_config ( from_browser, fd );
+}
+
+/*
+Forwards a PUT from a web browser to the upstream for a board:
+
+    PUT /gateway.qif?board=N&tB=V
+
+sets output B of board N to V, as a PUT of set_bit.qif?tB=V would on
+the board's own server. The browser is parked until the upstream
+answers, and is given its answer: 200, or 429 if the upstream is
+limiting writes. It is told 502 if the upstream is not connected or
+fails, and 504 if it takes more than UPSTREAM_TIMEOUT seconds. Over
+HTTP/2 the stream cannot be parked, so the command is answered with
+202 once it is on its way, and the outcome is seen in the events.
+
+Returns true if the socket has been parked.
+*/
+bool process_gateway_request ( char * from_browser, int fd ) {
+	struct Upstream_Command * command = 0;
+	struct Upstream * upstream;
+	struct timespec now;
+	unsigned long long one = 1;
+	char * query = get_query ( from_browser );
+	char name[4];
+	int board = get_query_number ( query, "board", MAX_UPSTREAM - 1 );
+	int value = -1;
+	int bit;
+	int i;
+
+	if ( upstream_count == 0 ) {
+		serve_not_found ( fd );
+		return false;
+	}
+	for ( bit = 0; bit < 8 && value == -1; bit++ ) {
+		sprintf ( name, "t%d", bit );
+		value = get_query_number ( query, name, 1 );
+	}
+	bit--;
+	if ( board < 0 || board >= upstream_count || ( value != 0 && value != 1 ) ) {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+
+	//  Queue it for the gateway thread, if there is room
+	upstream = &upstreams[board];
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	pthread_mutex_lock ( &gateway_mutex );
+	for ( i = 0; i < MAX_UPSTREAM_COMMAND; i++ ) {
+		if ( !upstream->command[i].used ) {
+			command = &upstream->command[i];
+			break;
+		}
+	}
+	if ( command ) {
+		command->used = true;
+		command->id = 0;
+		command->fd = h2_capture ? -1 : fd;
+		command->bit = bit;
+		command->value = value;
+		command->deadline = now.tv_sec + UPSTREAM_TIMEOUT;
+	}
+	pthread_mutex_unlock ( &gateway_mutex );
+	if ( !command ) {
+		write_header ( fd, header_unavailable, sizeof ( header_unavailable ) - 1 );
+		return false;
+	}
+	if ( write ( gateway_wake_fd, &one, sizeof ( one ) ) < 0 ) {
+		log_message ( LOG_DEBUG, "process_gateway_request: %s\n", strerror ( errno ) );
+	}
+	if ( h2_capture ) {
+		write_header ( fd, header_accepted, sizeof ( header_accepted ) - 1 );
+		return false;
+	}
+	return true;
+}
+
+/*
+This procedure returns the file on disk requested by the web browser.
+
+Returns false, as the socket is finished with.
+*/
+bool process_get_request ( char * from_browser, int service_socket_fd ) {
+	char  page_name[300];
+	char  error_page[100];
+	char *page_parameters = 0;
+	char *if_none_match;
+	int   encodings;
+	struct Asset * asset;
+
+	//  Note what the browser can decode, and what it already has,
+	//  before the request is cut short by get_page_name
+	encodings = get_accept_encoding ( from_browser );
+	if_none_match = get_header ( from_browser, "If-None-Match" );
+	if ( get_page_name ( from_browser, page_name, sizeof ( page_name ), page_parameters, error_page ) < 0 ) {
+		serve_not_found ( service_socket_fd );
+		return false;
+	}
+	log_message ( LOG_DEBUG, "process_get_request: Requested +%s+\n", page_name );
+
+	asset = find_asset ( page_name );
+	if ( asset ) {
+		serve_asset ( service_socket_fd, asset, encodings, if_none_match );
+	} else {
+		serve_not_found ( service_socket_fd );
+	}
+	return false;
+}
+
+/*
+Changes the log level:
+
+    PUT /log.qif?level=N
+
+where N is from 0, errors only, to 3, everything. Any other value is
+refused with a 400. The reply is as from a GET of log.qif.
+
+Returns false, as the socket is finished with.
+*/
+bool process_log_request ( char * from_browser, int fd ) {
+	int level = get_query_number ( get_query ( from_browser ), "level", LOG_DEBUG );
+	if ( level == -2 ) {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+	if ( level >= 0 ) {
+		opt_log_level = level;
+	}
+	return route_log ( from_browser, fd );
+}
+
+/*
+This procedure services PUT requests from the web browser.
+
+It is used to provide the functionality needed when the user
+changes an output:
+
+    PUT /set_bit.qif?tB=V&tB=V...&seq=N
+
+sets each output B named to V, with one write to the PiFace Digital
+2, so that a page can send several changes at once. With seq, the
+page's own number for the request, the reply carries it back with
+the outputs as they now are, {"seq":N,"output":X}, for the page to
+confirm or undo what it has shown; without it the reply is empty.
+A value that is not exactly 0 or 1, or a seq that is not a number,
+is refused with a 400.
+
+Returns false, as the socket is finished with.
+*/
+bool process_put_request ( char * from_browser, int fd ) {
+	char * query = get_query ( from_browser );
+	char reply[40];
+	char name[4];
+	int seq = get_query_number ( query, "seq", INT_MAX );
+	int mask = 0;
+	int value = 0;
+	int output;
+	int bit;
+	int v;
+
+	log_message ( LOG_DEBUG, "Started process_put_request\n" );
+
+	//  Extract which bits are being modified, and their values
+	for ( bit = 0; bit < 8; bit++ ) {
+		sprintf ( name, "t%d", bit );
+		v = get_query_number ( query, name, 1 );
+		if ( v == -2 ) {
+			mask = 0;
+			break;
+		} else if ( v >= 0 ) {
+			mask |= 1 << bit;
+			value |= v << bit;
+		}
+	}
+	if ( mask == 0 || seq == -2 ) {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+
+	//  Leave the SPI bus to the sampler if the outputs are being
+	//  written too often
+	if ( !rate_allow_write ( 1 ) ) {
+		write_header ( fd, header_too_many, sizeof ( header_too_many ) - 1 );
+		return false;
+	}
+	output = write_outputs ( mask, value );
+
+	//  Send off the acknowledgement to the web browser
+	if ( seq >= 0 ) {
+		serve_json ( fd, reply, sprintf ( reply, "{\"seq\":%d,\"output\":%d}", seq, output ) );
+	} else {
+		write_header ( fd, header_put_ack, sizeof ( header_put_ack ) - 1 );
+	}
+	log_message ( LOG_DEBUG, "Exit process_page.\n" );
+	return false;
+}
+
+/*
+Dispatches a complete request from a web browser to the routine
+that services it: one from the table of routes if there is one for
+it, otherwise a file from disk. A request for HTTP/2 hands the
+connection over to the HTTP/2 thread.
+
+Returns true if the socket has been handed over, as an event stream
+or to the HTTP/2 thread.
+*/
+bool process_request ( char * from_browser, int length, int fd ) {
+	const struct Route * route;
+	int request_type;
+	int h2;
+	bool keep_open = false;
+	if ( length <= 10 ) {
+		return false;
+	}
+	unsigned long long trace = trace_start ( );
+	request_type = get_request_type ( from_browser );
+	if ( opt_h2 && !h2_capture && ( h2 = h2_wanted ( from_browser, length ) ) &&
+			h2_adopt ( fd, from_browser, length, h2 == H2_UPGRADE ) ) {
+		keep_open = true;
+	} else if ( request_type == REQUEST_PUT && opt_put_rate > 0 && !rate_allow ( get_peer_address ( fd ), RATE_PUT ) ) {
+		write_header ( fd, header_too_many, sizeof ( header_too_many ) - 1 );
+	} else if ( ( route = route_find ( request_type, from_browser ) ) ) {
+		keep_open = route->handler ( from_browser, fd );
+	} else if ( request_type == REQUEST_GET ) {
+		keep_open = process_get_request( from_browser, fd );
+	} else if ( request_type == REQUEST_PUT ) {
+		serve_not_found ( fd );
+	}
+	trace_end ( request_type == REQUEST_PUT ? "process_put" : "process_get", trace );
+	return keep_open;
+}
+
+/*
+Starts or cancels an output sequence.
+
+    PUT /sequence.qif?steps=mask:value:delay,...
+    PUT /sequence.qif?cancel
+
+Mask and value are in hex, the delay before the next step in
+milliseconds. The reply is the status of the sequence, as from a GET
+of sequence.qif; a list that does not make sense is refused with a
+400, a new sequence while one is running with a 409, and one with
+more steps than the write budget has left with a 429.
+
+Returns false, as the socket is finished with.
+*/
+bool process_sequence_request ( char * from_browser, int fd ) {
+	struct Sequence_Step steps[MAX_SEQUENCE_STEP];
+	char status[100];
+	char *ptr;
+	int count;
+
+	ptr = strchr ( from_browser, '?' );
+	if ( !ptr ) {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+	ptr++;
+	if ( test_lead_string ( ptr, "cancel" ) ) {
+		pthread_mutex_lock ( &sequence.mutex );
+		if ( sequence.state == SEQUENCE_RUNNING ) {
+			sequence.state = SEQUENCE_CANCELLED;
+			pthread_cond_signal ( &sequence.changed );
+		}
+		pthread_mutex_unlock ( &sequence.mutex );
+	} else {
+		count = test_lead_string ( ptr, "steps=" ) ? sequence_parse ( ptr + 6, steps ) : -1;
+		if ( count <= 0 ) {
+			write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+			return false;
+		}
+		pthread_mutex_lock ( &sequence.mutex );
+		if ( sequence.state == SEQUENCE_RUNNING ) {
+			pthread_mutex_unlock ( &sequence.mutex );
+			write_header ( fd, header_conflict, sizeof ( header_conflict ) - 1 );
+			return false;
+		}
+
+		//  Every step is a write, so the sequence pays for them all
+		//  from the write budget before it starts
+		if ( !rate_allow_write ( count ) ) {
+			pthread_mutex_unlock ( &sequence.mutex );
+			write_header ( fd, header_too_many, sizeof ( header_too_many ) - 1 );
+			return false;
+		}
+		memcpy ( sequence.step, steps, count * sizeof ( steps[0] ) );
+		sequence.count = count;
+		sequence.done = 0;
+		sequence.id++;
+		sequence.state = SEQUENCE_RUNNING;
+		pthread_cond_signal ( &sequence.changed );
+		pthread_mutex_unlock ( &sequence.mutex );
+	}
+	serve_json ( fd, status, sequence_status ( status ) );
+	return false;
+}
+
+/*
+Turns tracing on or off:
+
+    PUT /trace.qif?on
+    PUT /trace.qif?off
+
+The reply is the trace so far, as from a GET of trace.qif.
+
+Returns false, as the socket is finished with.
+*/
+bool process_trace_request ( char * from_browser, int fd ) {
+	char * query = get_query ( from_browser );
+	if ( query && test_lead_string ( query, "on" ) ) {
+		tracing = true;
+	} else if ( query && test_lead_string ( query, "off" ) ) {
+		tracing = false;
+	} else {
+		write_header ( fd, header_bad_request, sizeof ( header_bad_request ) - 1 );
+		return false;
+	}
+	return route_trace ( from_browser, fd );
+}
+
+/*
+Passes the latest state of the inputs and outputs on to the
+statistics, the requests waiting on state.qif, the control programs,
+the shared memory state page and the UDP publisher.
+
+The state is taken here, rather than by the caller, and passed on
+under publish_mutex: when writers overlap, the one that publishes
+last passes on the newest state, not an older one of its own.
+*/
+void publish_state ( void ) {
+	int input;
+	int output;
+
+	pthread_mutex_lock ( &publish_mutex );
+	pthread_mutex_lock ( &event_mutex );
+	input = __atomic_load_n ( &pif_input, __ATOMIC_RELAXED );
+	output = pif_output;
+	pthread_mutex_unlock ( &event_mutex );
+	stats_update ( input, output );
+	state_notify ( input, output );
+	control_publish ( input, output );
+	if ( state_page ) {
+		state_page_write ( input, output );
+	}
+	if ( udp_fd >= 0 ) {
+		udp_publish ( input, output );
+	}
+	pthread_mutex_unlock ( &publish_mutex );
+}
+
+/*
+Refills a token bucket for the time since it was last drawn on, up
+to burst tokens, and takes cost tokens from it if there are that
+many to take. A cost larger than the burst is let through from a
+full bucket, which is left owing the rest. The caller must hold
+rate_mutex.
+
+Returns true if the bucket had the tokens for the request.
+*/
+bool rate_admit ( struct Rate_Bucket * bucket, int rate, int burst, int cost, unsigned long long now ) {
+	if ( burst < 1 ) {
+		burst = 1;
+	}
+	if ( bucket->time == 0 ) {
+		bucket->tokens = burst;
+	} else {
+		bucket->tokens += ( now - bucket->time ) * 1e-9 * rate;
+		if ( bucket->tokens > burst ) {
+			bucket->tokens = burst;
+		}
+	}
+	bucket->time = now;
+	if ( bucket->tokens < ( cost < burst ? cost : burst ) ) {
+		return false;
+	}
+	bucket->tokens -= cost;
+	return true;
+}
+
+/*
+Decides whether the web browser at address may make a new connection
+or a PUT, depending on kind, against its own token bucket. An
+address not yet in the table takes the slot of the one seen longest
+ago among those it may hash to. A gateway's PUTs are always allowed.
+
+Returns false, and counts the rejection, if the browser has used up
+its allowance.
+*/
+bool rate_allow ( in_addr_t address, int kind ) {
+	struct Rate_Client * client;
+	struct Rate_Client * oldest;
+	struct timespec now;
+	unsigned long long time;
+	unsigned slot;
+	int rate = kind == RATE_CONNECT ? opt_connect_rate : opt_put_rate;
+	int burst = kind == RATE_CONNECT ? opt_connect_burst : opt_put_burst;
+	bool allowed;
+	int i;
+
+	for ( i = 0; i < rate_exempt_count && kind == RATE_PUT; i++ ) {
+		if ( rate_exempt[i] == address ) {
+			return true;
+		}
+	}
+
+	if ( rate <= 0 ) {
+		return true;
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	slot = ( address * 2654435761U ) >> 24;
+	pthread_mutex_lock ( &rate_mutex );
+	oldest = &rate_client[slot];
+	client = 0;
+	for ( i = 0; i < RATE_PROBE; i++ ) {
+		struct Rate_Client * probe = &rate_client[( slot + i ) % MAX_RATE_CLIENT];
+		if ( probe->seen && probe->address == address ) {
+			client = probe;
+			break;
+		}
+		if ( probe->seen < oldest->seen ) {
+			oldest = probe;
+		}
+	}
+	if ( !client ) {
+		client = oldest;
+		memset ( client, 0, sizeof ( *client ) );
+		client->address = address;
+	}
+	client->seen = time;
+	allowed = rate_admit ( &client->bucket[kind], rate, burst, 1, time );
+	if ( !allowed ) {
+		rate_rejected[kind]++;
+	}
+	pthread_mutex_unlock ( &rate_mutex );
+	return allowed;
+}
+
+/*
+Draws on the budget shared by every write to the outputs over the
+SPI bus, for count writes. A burst of a second's worth of writes is
+allowed.
+
+Returns false, and counts the rejection, if the budget is spent.
+*/
+bool rate_allow_write ( int count ) {
+	struct timespec now;
+	bool allowed;
+
+	if ( opt_write_rate <= 0 ) {
+		return true;
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	pthread_mutex_lock ( &rate_mutex );
+	allowed = rate_admit ( &rate_write, opt_write_rate, opt_write_rate, count,
+		now.tv_sec * 1000000000ULL + now.tv_nsec );
+	if ( !allowed ) {
+		rate_rejected[RATE_WRITE]++;
+	}
+	pthread_mutex_unlock ( &rate_mutex );
+	return allowed;
+}
+
+/*
+Notes the addresses of the gateways given by gateway_peer, whose PUTs
+are not limited by address. An address not understood is left out.
+*/
+void rate_open ( ) {
+	const char * ptr = opt_gateway_peer;
+	char host[32];
+	struct in_addr address;
+	int length;
+
+	while ( ptr && *ptr ) {
+		for ( length = 0; ptr[length] && ptr[length] != ','; length++ ) {
+		}
+		if ( length < (int) sizeof ( host ) && rate_exempt_count < MAX_RATE_EXEMPT ) {
+			memcpy ( host, ptr, length );
+			host[length] = 0;
+			if ( inet_aton ( host, &address ) ) {
+				rate_exempt[rate_exempt_count++] = address.s_addr;
+			} else {
+				log_message ( LOG_ERROR, "ERROR, gateway_peer %s is not an address\n", host );
+			}
+		} else {
+			log_message ( LOG_ERROR, "ERROR, gateway_peer=%s is too long\n", opt_gateway_peer );
+		}
+		ptr += length;
+		if ( *ptr == ',' ) {
+			ptr++;
+		}
+	}
+}
+
+/*
+Writes the limits, and the count of requests turned away by each,
+into buffer as JSON, for a GET of limits.qif.
+
+Returns the length of the JSON.
+*/
+int rate_status ( char * buffer ) {
+	int length;
+	int i;
+
+	length = sprintf ( buffer, "{\"connect_rate\":%d,\"connect_burst\":%d,\"put_rate\":%d,\"put_burst\":%d,"
+		"\"write_rate\":%d,\"rejected\":{", opt_connect_rate, opt_connect_burst, opt_put_rate, opt_put_burst,
+		opt_write_rate );
+	pthread_mutex_lock ( &rate_mutex );
+	for ( i = 0; i < 3; i++ ) {
+		length += sprintf ( buffer + length, "%s\"%s\":%llu", i ? "," : "", rate_name[i], rate_rejected[i] );
+	}
+	pthread_mutex_unlock ( &rate_mutex );
+	length += sprintf ( buffer + length, "}}" );
+	return length;
+}
+
+/*
+Reads the whole of the named file into a newly allocated buffer,
+which is null terminated for the benefit of text handling.
+
+Returns 0 if the file cannot be read.
+*/
+char *read_file ( char * name, int * length ) {
+	struct stat file_stat;
+	char * buffer;
+	int    file;
+	int    n;
+	int    total = 0;
+
+	file = open ( name, O_RDONLY );
+	if ( file < 0 ) {
+		return 0;
+	}
+	if ( fstat ( file, &file_stat ) < 0 || !S_ISREG ( file_stat.st_mode ) ) {
+		close ( file );
+		return 0;
+	}
+	buffer = ( char * ) malloc ( file_stat.st_size + 1 );
+	if ( !buffer ) {
+		close ( file );
+		return 0;
+	}
+	while ( total < file_stat.st_size ) {
+		n = read ( file, buffer + total, file_stat.st_size - total );
+		if ( n <= 0 ) {
+			break;
+		}
+		total += n;
+	}
+	close ( file );
+	buffer[total] = 0;
+	*length = total;
+	return buffer;
+}
+
+/*
+Returns the state of the digital inputs, as read no more than max_age
+milliseconds ago. If the last reading is older, a new one is taken,
+unless another thread is already taking one, in which case its result
+is shared. A max_age of 0 asks for a reading begun after the call.
+*/
+int read_inputs ( int max_age ) {
+	struct timespec now;
+	unsigned long long called;
+	int input;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	called = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	pthread_mutex_lock ( &input_cache.mutex );
+	for (;;) {
+		if ( input_cache.valid && called <= input_cache.time + max_age * 1000000ULL &&
+				( max_age > 0 || input_cache.time >= called ) ) {
+			input = pif_input;
+			pthread_mutex_unlock ( &input_cache.mutex );
+			return input;
+		}
+		if ( !input_cache.reading ) {
+			break;
+		}
+		pthread_cond_wait ( &input_cache.done, &input_cache.mutex );
+	}
+
+	//  Take the reading, without holding the lock
+	input_cache.reading = true;
+	pthread_mutex_unlock ( &input_cache.mutex );
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	unsigned long long trace = trace_start ( );
+	input = pifacedigital_read_reg ( INPUT, pif_hw_addr );
+	trace_end ( "read_reg", trace );
+	pthread_mutex_lock ( &input_cache.mutex );
+	__atomic_store_n ( &pif_input, input, __ATOMIC_RELAXED );
+	input_cache.time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	input_cache.valid = true;
+	input_cache.reading = false;
+	pthread_cond_broadcast ( &input_cache.done );
+	pthread_mutex_unlock ( &input_cache.mutex );
+	return input;
+}
+
+/*
+Turns a connection away, with a 503 because the worker threads are
+all busy and the connection queue is full, or a 429 because the web
+browser is connecting too often. The acceptor must never wait on a
+browser, so the response is sent without blocking, on a best effort
+basis.
+*/
+void reject_connection ( int fd, const char * header, int length ) {
+	int n;
+	n = send ( fd, header, length, MSG_DONTWAIT | MSG_NOSIGNAL );
+	log_message ( LOG_DEBUG, "reject_connection: sent %d bytes of %.12s.\n", n, header );
+	close ( fd );
+}
+
+/*
+Works out the size of a log or trace ring from the number of entries
+asked for: that number rounded up to a power of two, from 8 to 65536,
+so that an entry is found with a mask however far the count has run.
+*/
+unsigned ring_size ( int wanted ) {
+	unsigned size = 8;
+	while ( size < (unsigned) wanted && size < 65536 ) {
+		size <<= 1;
+	}
+	return size;
+}
+
+/*
+Send the current state of the digital inputs to one event stream.
+The caller must hold event_mutex.
+
+If the digital outputs have changed, append that to the event
+message.
+
+A new event is only built once the last one has been written in
+full, so it always carries the latest state. A web browser that has
+been unable to take any more for sse_timeout seconds is let go.
+
+Returns false if the web browser can no longer be written to.
+*/
+bool send_event ( struct Event_Stream * stream ) {
+	struct Event_Frame * frame;
+	struct Event_Frame * compressed;
+	struct timespec now;
+	bool outputs;
+	z_stream * deflate_stream = &stream->deflate;
+
+	//  Finish off the last event first
+	if ( !stream->busy && !flush_event_stream ( stream ) ) {
+		return false;
+	}
+	if ( stream->busy || ( stream->frame && stream->frame_sent < stream->frame->length ) ) {
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		if ( !stream->stalled ) {
+			stream->stalled = true;
+			stream->stalled_since = now.tv_sec;
+		}
+		if ( now.tv_sec - stream->stalled_since >= opt_sse_timeout ) {
+			log_message ( LOG_DEBUG, "Event stream %d stalled for %d seconds.\n", stream->fd, opt_sse_timeout );
+			return false;
+		}
+		return true;
+	}
+	stream->stalled = false;
+
+	//  Take the shared frame for the state, with the outputs if
+	//  they have changed since this browser was last sent them, or
+	//  for a gateway stream the boards that have changed, or every
+	//  board if it has missed a round
+	if ( stream->gateway ) {
+		frame = gateway_frame_get ( stream->gateway_round + 1 != gateway_round );
+		if ( !frame ) {
+			return true;
+		}
+		stream->gateway_round = gateway_round;
+	} else {
+		outputs = stream->output_sequence != output_sequence;
+		frame = event_frame_get ( outputs );
+		if ( !frame ) {
+			return true;
+		}
+		stream->output_sequence = output_sequence;
+	}
+
+	//  A compressed stream keeps one deflate context for its
+	//  lifetime, so each event only costs its difference from the
+	//  ones before it, and is flushed so that the browser sees it
+	//  straight away.
+	if ( stream->gzip ) {
+		compressed = ( struct Event_Frame * ) buffer_get ( sizeof ( *compressed ) );
+		if ( !compressed ) {
+			event_frame_put ( frame );
+			return true;
+		}
+		compressed->references = 1;
+		deflate_stream->next_in = ( Bytef * ) frame->data;
+		deflate_stream->avail_in = frame->length;
+		deflate_stream->next_out = ( Bytef * ) compressed->data;
+		deflate_stream->avail_out = sizeof ( compressed->data );
+		deflate ( deflate_stream, Z_SYNC_FLUSH );
+		compressed->length = sizeof ( compressed->data ) - deflate_stream->avail_out;
+		event_frame_put ( frame );
+		frame = compressed;
+	}
+	event_frame_put ( stream->frame );
+	stream->frame = frame;
+	stream->frame_sent = 0;
+
+	//  Send the event to the connected web browser
+	if ( stream->ring && !uring_capture ) {
+		return uring_queue_event ( stream );
+	}
+	return flush_event_stream ( stream );
+}
+
+/*
+The event thread. Samples the inputs against absolute CLOCK_MONOTONIC
+deadlines, so that the period does not drift, and passes the state on
+to the web browsers and everything else that follows it. Should a
+sample run past its deadline, the ones missed are skipped rather than
+made up, and the next keeps in step with the ones before.
+*/
+void *send_events ( void * unused ) {
+	struct timespec next_sample;
+	struct timespec now;
+	unsigned long long time;
+	unsigned long long next;
+	unsigned long long event_sent = 0;
+	unsigned long long event_output_sequence = 0;
+	unsigned long long h2_round = 0;
+	unsigned long long stats_saved;
+	int event_input = -1;
+	int last_input = -1;
+	int input;
+	int i;
+	log_message ( LOG_DEBUG, "Send events entered\n" );
+	clock_gettime ( CLOCK_MONOTONIC, &next_sample );
+	next = next_sample.tv_sec * 1000000000ULL + next_sample.tv_nsec;
+	stats_saved = next;
+	for ( ;; ) {
+
+		//  Get the current state of the digital inputs, sharing a
+		//  reading that is under way
+		input = read_inputs ( 0 );
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+		//  Send it to every connected web browser, if it has changed
+		//  or they have not heard anything for a while. Half a period
+		//  is allowed for, so that at one sample a second every
+		//  sample is sent.
+		unsigned long long trace = trace_start ( );
+		pthread_mutex_lock ( &event_mutex );
+		if ( input != event_input || output_sequence != event_output_sequence ||
+				time + sample_current * 500ULL >= event_sent + EVENT_HEARTBEAT ) {
+			event_input = input;
+			event_output_sequence = output_sequence;
+			event_sent = time;
+			event_round++;
+			for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+				if ( event_stream[i].fd >= 0 && !event_stream[i].gateway && !send_event ( &event_stream[i] ) ) {
+					close_event_stream ( &event_stream[i] );
+				}
+			}
+		}
+		pthread_mutex_unlock ( &event_mutex );
+		if ( h2_connection_count > 0 && event_round != h2_round ) {
+			h2_round = event_round;
+			h2_wake ( );
+		}
+		publish_state ( );
+		for ( i = 0; i < listener_count && uring_enabled; i++ ) {
+			uring_submit ( &listeners[i].ring, 0 );
+		}
+		trace_end ( "send_events", trace );
+		if ( trace_dump_wanted ) {
+			trace_dump_wanted = 0;
+			trace_write_file ( );
+		}
+		if ( opt_stats_save > 0 && time >= stats_saved + opt_stats_save * 1000000000ULL ) {
+			stats_saved = time;
+			stats_save ( );
+		}
+
+		//  Work out when to sample next
+		sample_current = sample_period ( sample_current, last_input >= 0 && input != last_input );
+		last_input = input;
+		next += sample_current * 1000ULL;
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		if ( next <= time ) {
+			next += ( ( time - next ) / ( sample_current * 1000ULL ) + 1 ) * sample_current * 1000ULL;
+		}
+		next_sample.tv_sec = next / 1000000000ULL;
+		next_sample.tv_nsec = next % 1000000000ULL;
+		drain_event_streams ( &next_sample );
+	}
+
+	//  This should never be reached
+	log_message ( LOG_DEBUG, "Send event exited\n" );
+	return 0;
+}
+
+/*
+Works out the period until the next sample of the inputs, in
+microseconds, from the last one and whether the inputs changed.
+Without a sample_min below sample, the period is simply sample.
+*/
+int sample_period ( int period, bool changed ) {
+	int longest = opt_sample;
+	int shortest = opt_sample_min;
+
+	if ( longest < MIN_SAMPLE_PERIOD || longest > MAX_SAMPLE_PERIOD ) {
+		longest = MAX_SAMPLE_PERIOD;
+	}
+	if ( shortest < MIN_SAMPLE_PERIOD || shortest >= longest ) {
+		return longest;
+	}
+	if ( changed ) {
+		return shortest;
+	}
+	if ( period < shortest ) {
+		period = shortest;
+	}
+	return period >= longest / 2 ? longest : period * 2;
+}
+
+/*
+Parses a list of steps, "mask:value:delay" separated by commas and
+ending at the end of the request line.
+
+Returns the number of steps, or -1 if the list is not valid.
+*/
+int sequence_parse ( char * list, struct Sequence_Step * steps ) {
+	char * ptr = list;
+	char * end;
+	long   field[3];
+	int    count = 0;
+	int    i;
+
+	for (;;) {
+		if ( count == MAX_SEQUENCE_STEP ) {
+			return -1;
+		}
+		for ( i = 0; i < 3; i++ ) {
+			field[i] = strtol ( ptr, &end, i < 2 ? 16 : 10 );
+			if ( end == ptr || ( i < 2 && *end != ':' ) ) {
+				return -1;
+			}
+			ptr = end + ( i < 2 );
+		}
+		if ( field[0] < 0 || field[0] > 0xff || field[1] < 0 || field[1] > 0xff ||
+				field[2] < 0 || field[2] > MAX_SEQUENCE_DELAY ) {
+			return -1;
+		}
+		steps[count].mask = field[0];
+		steps[count].value = field[1];
+		steps[count].delay = field[2];
+		count++;
+		if ( *ptr != ',' ) {
+			break;
+		}
+		ptr++;
+	}
+	if ( *ptr != ' ' && *ptr != '&' && *ptr != 0 ) {
+		return -1;
+	}
+	return count;
+}
+
+/*
+Writes the status of the output sequence as JSON.
+
+Returns its length.
+*/
+int sequence_status ( char * buffer ) {
+	int length;
+	pthread_mutex_lock ( &sequence.mutex );
+	length = sprintf ( buffer, "{\"id\":%d,\"state\":\"%s\",\"step\":%d,\"steps\":%d}",
+		sequence.id, sequence_state_name[sequence.state], sequence.done, sequence.count );
+	pthread_mutex_unlock ( &sequence.mutex );
+	return length;
+}
+
+/*
+The sequence thread. Waits for a sequence to be started, then
+carries out each step, with a single write to the PiFace Digital 2,
+at its deadline. Deadlines are measured from the start of the
+sequence, so delays do not add up errors from step to step.
+A cancel, or a new sequence, wakes it straight away.
+*/
+void *sequence_thread ( void * unused ) {
+	struct sched_param param;
+	struct Sequence_Step step;
+	struct timespec deadline;
+	int id;
+
+	//  Run ahead of the web server where allowed to
+	param.sched_priority = 10;
+	pthread_setschedparam ( pthread_self ( ), SCHED_FIFO, &param );
+
+	pthread_mutex_lock ( &sequence.mutex );
+	for (;;) {
+		while ( sequence.state != SEQUENCE_RUNNING ) {
+			pthread_cond_wait ( &sequence.changed, &sequence.mutex );
+		}
+		id = sequence.id;
+		clock_gettime ( CLOCK_MONOTONIC, &deadline );
+		while ( sequence.state == SEQUENCE_RUNNING && sequence.id == id && sequence.done < sequence.count ) {
+			step = sequence.step[sequence.done];
+			pthread_mutex_unlock ( &sequence.mutex );
+			write_outputs ( step.mask, step.value );
+			pthread_mutex_lock ( &sequence.mutex );
+			sequence.done++;
+			if ( sequence.done == sequence.count ) {
+				break;
+			}
+
+			//  Wait for the next deadline, unless woken for good reason
+			deadline.tv_sec += step.delay / 1000;
+			deadline.tv_nsec += ( step.delay % 1000 ) * 1000000;
+			if ( deadline.tv_nsec >= 1000000000 ) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while ( sequence.state == SEQUENCE_RUNNING && sequence.id == id &&
+					pthread_cond_timedwait ( &sequence.changed, &sequence.mutex, &deadline ) != ETIMEDOUT ) {
+			}
+		}
+		if ( sequence.state == SEQUENCE_RUNNING && sequence.id == id ) {
+			sequence.state = SEQUENCE_DONE;
+		}
+	}
+	return 0;
+}
+
+/*
+Times how long it takes to find each route, by its perfect hash and
+by testing the names one after another as process_get_request used
+to, and how long it takes to find there is no route for a file on
+disk. The second grows with the number of routes ahead of the one
+wanted; the first should not. Run with "./server 0 b".
+*/
+void route_benchmark ( ) {
+	char request[100];
+	struct timespec start;
+	struct timespec end;
+	const struct Route * volatile found;
+	const int rounds = 1000000;
+	double hashed;
+	double chained;
+	int method;
+	int i;
+	int j;
+	int k;
+
+	printf ( "%-4s %-16s %10s %10s\n", "rank", "route", "hash ns", "chain ns" );
+	for ( i = 0; i <= route_count; i++ ) {
+		method = i < route_count ? routes[i].method : REQUEST_GET;
+		sprintf ( request, "%s /%s HTTP/1.1\r\n", method == REQUEST_PUT ? "PUT" : "GET",
+			i < route_count ? routes[i].name : "index.html" );
+		clock_gettime ( CLOCK_MONOTONIC, &start );
+		for ( j = 0; j < rounds; j++ ) {
+			found = route_find ( method, request );
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &end );
+		hashed = ( ( end.tv_sec - start.tv_sec ) * 1e9 + end.tv_nsec - start.tv_nsec ) / rounds;
+
+		//  The name follows "GET /" or "PUT /"
+		clock_gettime ( CLOCK_MONOTONIC, &start );
+		for ( j = 0; j < rounds; j++ ) {
+			found = 0;
+			for ( k = 0; k < route_count; k++ ) {
+				if ( routes[k].method == method && test_lead_string ( request + 5, routes[k].name ) ) {
+					found = &routes[k];
+					break;
+				}
+			}
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &end );
+		chained = ( ( end.tv_sec - start.tv_sec ) * 1e9 + end.tv_nsec - start.tv_nsec ) / rounds;
+		printf ( "%-4d %-16s %10.1f %10.1f\n", i + 1, i < route_count ? routes[i].name : "(file)", hashed, chained );
+	}
+}
+
+/*
+Serves a GET of config.qif, the sampling of the inputs.
+*/
+bool route_config ( char * from_browser, int fd ) {
+	char status[100];
+	serve_json ( fd, status, sprintf ( status, "{\"sample\":%d,\"sample_min\":%d,\"period\":%d}",
+		opt_sample, opt_sample_min, sample_current ) );
+	return false;
+}
+
+/*
+Serves a GET of events.qif by handing the socket over as an event
+stream, compressed if the browser can take it and sse_gzip is set.
+*/
+bool route_events ( char * from_browser, int fd ) {
+	bool gzip = opt_sse_gzip && ( get_accept_encoding ( from_browser ) & ENCODING_GZIP );
+	log_message ( LOG_DEBUG, "Serving events\n" );
+	return open_event_stream ( fd, gzip, false );
+}
+
+/*
+Finds the route for a request, from the method and the name between
+the first "/" and the query or the end of the path.
+
+Returns 0 if there is no route for it.
+*/
+const struct Route *route_find ( int method, char * request ) {
+	const struct Route * route;
+	char * name;
+	int length = 0;
+	int slot;
+
+	name = strchr ( request, '/' );
+	if ( !name ) {
+		return 0;
+	}
+	name++;
+	while ( name[length] && name[length] != ' ' && name[length] != '?' ) {
+		length++;
+	}
+	slot = route_slots.route[route_hash ( route_seed_value, method, name, length ) % ROUTE_SLOTS];
+	if ( !slot ) {
+		return 0;
+	}
+	route = &routes[slot - 1];
+	if ( route->method != method || strncmp ( route->name, name, length ) || route->name[length] ) {
+		return 0;
+	}
+	return route;
+}
+
+/*
+Serves a GET of gateway.qif, in gateway mode, by handing the socket
+over as a stream of the boards' events, compressed if the browser
+can take it and sse_gzip is set.
+*/
+bool route_gateway ( char * from_browser, int fd ) {
+	bool gzip = opt_sse_gzip && ( get_accept_encoding ( from_browser ) & ENCODING_GZIP );
+	if ( upstream_count == 0 ) {
+		serve_not_found ( fd );
+		return false;
+	}
+	return open_event_stream ( fd, gzip, true );
+}
+
+/*
+Serves a GET of limits.qif: the admission limits and what they have
+turned away.
+*/
+bool route_limits ( char * from_browser, int fd ) {
+	char status[300];
+	serve_json ( fd, status, rate_status ( status ) );
+	return false;
+}
+
+/*
+Serves a GET of log.qif, the log level and the count of messages
+dropped.
+*/
+bool route_log ( char * from_browser, int fd ) {
+	char status[100];
+	serve_json ( fd, status, sprintf ( status, "{\"level\":%d,\"dropped\":%llu}", opt_log_level, log_dropped ) );
+	return false;
+}
+
+/*
+Serves a GET of sequence.qif: the status of the output sequence.
+*/
+bool route_sequence ( char * from_browser, int fd ) {
+	char status[100];
+	serve_json ( fd, status, sequence_status ( status ) );
+	return false;
+}
+
+/*
+Serves a GET of state.qif, which may park the socket until the state
+changes.
+*/
+bool route_state ( char * from_browser, int fd ) {
+	return serve_state ( fd, get_query ( from_browser ) );
+}
+
+/*
+Serves a GET of stats.qif: the on time, changes and duty cycles of
+each input and output.
+*/
+bool route_stats ( char * from_browser, int fd ) {
+	char status[2500];
+	serve_json ( fd, status, stats_json ( status ) );
+	return false;
+}
+
+/*
+Serves a GET of trace.qif with the trace so far.
+*/
+bool route_trace ( char * from_browser, int fd ) {
+	char * dump;
+	int length;
+	length = trace_dump ( &dump );
+	if ( length < 0 ) {
+		write_header ( fd, header_unavailable, sizeof ( header_unavailable ) - 1 );
+		return false;
+	}
+	serve_json ( fd, dump, length );
+	free ( dump );
+	return false;
+}
+
+/*
+Serves a GET of upstreams.qif, in gateway mode: for each board, its
+upstream, whether it is connected, how many times it has been lost,
+and the inputs and outputs last heard from it, or -1 if not known.
+*/
+bool route_upstreams ( char * from_browser, int fd ) {
+	struct Upstream * upstream;
+	char status[MAX_UPSTREAM * 120 + 10];
+	int length;
+	int i;
+
+	if ( upstream_count == 0 ) {
+		serve_not_found ( fd );
+		return false;
+	}
+	length = sprintf ( status, "[" );
+	pthread_mutex_lock ( &event_mutex );
+	for ( i = 0; i < upstream_count; i++ ) {
+		upstream = &upstreams[i];
+		length += sprintf ( status + length,
+			"%s{\"board\":%d,\"upstream\":\"%s\",\"connected\":%s,\"lost\":%llu,\"input\":%d,\"output\":%d}",
+			i ? "," : "", i, upstream->name, upstream->connected ? "true" : "false", upstream->lost,
+			upstream->input, upstream->output );
+	}
+	pthread_mutex_unlock ( &event_mutex );
+	length += sprintf ( status + length, "]" );
+	serve_json ( fd, status, length );
+	return false;
+}
+
+/*
+Send a 404 file not found error message to the connected web browser
+*/
+int send_error ( char * disk_page ) {
+	int i;
+	strcpy (disk_page, "<html><head></head><body>404: File not found</body></html>");
+	for ( i = 0; i < MAX_DISK_PAGE_SIZE; i++ ) {
+		if (disk_page[i]==0) {
+			break;
+		}
+	}
+	return -1;
+}
+
+/*
+Send a file from the asset cache to the connected web browser, in
+the most compact variant that the browser has said it can decode.
+
+If the browser already holds that variant, as shown by its
+If-None-Match header, only a 304 header is sent.
+*/
+void serve_asset ( int fd, struct Asset * asset, int encodings, char * if_none_match ) {
+	struct iovec iov[11];
+	char content_length[16];
+	char * body = asset->body;
+	int body_length = asset->body_length;
+	const char * etag = asset->etag;
+	const char * encoding_header = 0;
+	int encoding_header_length = 0;
+	bool not_modified;
+	int count = 0;
+
+	if ( asset->slot_count ) {
+		serve_template ( fd, asset, if_none_match );
+		return;
+	}
+	if ( asset->brotli && ( encodings & ENCODING_BROTLI ) ) {
+		body = asset->brotli;
+		body_length = asset->brotli_length;
+		etag = asset->brotli_etag;
+		encoding_header = header_brotli;
+		encoding_header_length = sizeof ( header_brotli ) - 1;
+	} else if ( asset->gzip && ( encodings & ENCODING_GZIP ) ) {
+		body = asset->gzip;
+		body_length = asset->gzip_length;
+		etag = asset->gzip_etag;
+		encoding_header = header_gzip;
+		encoding_header_length = sizeof ( header_gzip ) - 1;
+	}
+	not_modified = match_etag ( if_none_match, etag );
+
+	if ( not_modified ) {
+		iov[count].iov_base = (void *) header_not_modified;
+		iov[count].iov_len = sizeof ( header_not_modified ) - 1;
+		count++;
+	} else {
+		iov[count].iov_base = (void *) asset->type->header;
+		iov[count].iov_len = strlen ( asset->type->header );
+		count++;
+		if ( encoding_header ) {
+			iov[count].iov_base = (void *) encoding_header;
+			iov[count].iov_len = encoding_header_length;
+			count++;
+		}
+	}
+	if ( asset->gzip || asset->brotli ) {
+		iov[count].iov_base = (void *) header_vary;
+		iov[count].iov_len = sizeof ( header_vary ) - 1;
+		count++;
+	}
+	iov[count].iov_base = (void *) header_etag;
+	iov[count].iov_len = sizeof ( header_etag ) - 1;
+	count++;
+	iov[count].iov_base = (void *) etag;
+	iov[count].iov_len = strlen ( etag );
+	count++;
+	iov[count].iov_base = (void *) header_line_end;
+	iov[count].iov_len = sizeof ( header_line_end ) - 1;
+	count++;
+	iov[count].iov_base = asset->cache_control;
+	iov[count].iov_len = strlen ( asset->cache_control );
+	count++;
+	if ( not_modified ) {
+		iov[count].iov_base = (void *) header_line_end;
+		iov[count].iov_len = sizeof ( header_line_end ) - 1;
+		count++;
+	} else {
+		iov[count].iov_base = (void *) header_content_length;
+		iov[count].iov_len = sizeof ( header_content_length ) - 1;
+		count++;
+		iov[count].iov_base = content_length;
+		iov[count].iov_len = sprintf ( content_length, "%d", body_length );
+		count++;
+		iov[count].iov_base = (void *) header_end;
+		iov[count].iov_len = sizeof ( header_end ) - 1;
+		count++;
+		iov[count].iov_base = body;
+		iov[count].iov_len = body_length;
+		count++;
+	}
+
+	log_message ( LOG_DEBUG, "serve_asset: %s, %d bytes of content%s.\n", asset->name, body_length,
+			not_modified ? ", not modified" : "" );
+	if ( write_iov ( fd, iov, count ) < 0 ) {
+		log_message ( LOG_DEBUG, "serve_asset: %s\n", strerror ( errno ) );
+	}
+}
+
+/*
+Send a JSON reply to the connected web browser. The reply is state
+that changes, so it is never cached.
+*/
+void serve_json ( int fd, char * body, int length ) {
+	struct iovec iov[4];
+	char content_length[16];
+
+	iov[0].iov_base = (void *) header_ok_json;
+	iov[0].iov_len = sizeof ( header_ok_json ) - 1;
+	iov[1].iov_base = content_length;
+	iov[1].iov_len = sprintf ( content_length, "%d", length );
+	iov[2].iov_base = (void *) header_end;
+	iov[2].iov_len = sizeof ( header_end ) - 1;
+	iov[3].iov_base = body;
+	iov[3].iov_len = length;
+	write_iov ( fd, iov, 4 );
+}
+
+/*
+Send a 404 file not found response to the connected web browser
+*/
+void serve_not_found ( int fd ) {
+	struct iovec iov[4];
+	char content_length[16];
+
+	iov[0].iov_base = (void *) header_not_found;
+	iov[0].iov_len = sizeof ( header_not_found ) - 1;
+	iov[1].iov_base = content_length;
+	iov[1].iov_len = sprintf ( content_length, "%d", (int) sizeof ( page_not_found ) - 1 );
+	iov[2].iov_base = (void *) header_end;
+	iov[2].iov_len = sizeof ( header_end ) - 1;
+	iov[3].iov_base = (void *) page_not_found;
+	iov[3].iov_len = sizeof ( page_not_found ) - 1;
+	write_iov ( fd, iov, 4 );
+}
+
+/*
+Send the requested page to the connected wbe browser
+
+Pages go out as header fragments plus body in one writev(), so the
+header and the start of the body share full segments without the
+socket being corked. Events are already being sent on a TCP_NODELAY
+socket, so they are written as they are.
+
+Returns false if the socket could not be written to.
+*/
+bool serve_page (int fd, char * page, int page_length, bool event) {
+	struct iovec iov[4];
+	char content_length[16];
+	int count = 0;
+	int n;
+
+	//  If it is not an event, prefix the required HTTP header
+	if ( !event ) {
+		iov[count].iov_base = (void *) header_ok_html;
+		iov[count].iov_len = sizeof ( header_ok_html ) - 1;
+		count++;
+		iov[count].iov_base = content_length;
+		iov[count].iov_len = sprintf ( content_length, "%d", page_length );
+		count++;
+		iov[count].iov_base = (void *) header_end;
+		iov[count].iov_len = sizeof ( header_end ) - 1;
+		count++;
+	}
+	iov[count].iov_base = page;
+	iov[count].iov_len = page_length;
+	count++;
+
+	//  Send the requestd page to the connecetd web browser
+	log_message ( LOG_DEBUG, "About to write %d bytes of content.\n", page_length );
+	n = write_iov( fd, iov, count );
+	log_message ( LOG_DEBUG, "Wrote %d bytes of response.\n",n );
+
+	//  Deal with sock issues
+	if (n < 0) {
+		error("ERROR writing to socket");
+		return false;
+	}
+	log_message ( LOG_DEBUG, "Exit serve_page.\n" );
+	return true;
+}
+
+/*
+Serves state.qif: the inputs and outputs as JSON, with the number of
+the state. Given "wait=<ms>&after=<seq>", and the state is still
+number seq, the request is parked until the state changes or the
+time is up.
+
+Returns true if the request has been parked, so the socket must be
+left open.
+*/
+bool serve_state ( int fd, char * query ) {
+	struct timespec now;
+	char body[100];
+	int length;
+	int wait = get_query_value ( query, "wait" );
+	int after = get_query_value ( query, "after" );
+
+	//  Bring the state up to date
+	read_inputs ( opt_input_age );
+	publish_state ( );
+
+	//  An HTTP/2 stream cannot be parked, so is answered at once
+	pthread_mutex_lock ( &state_wait_mutex );
+	if ( wait > 0 && after >= 0 && !h2_capture && (unsigned long long) after == state_sequence &&
+			state_waiter_count < MAX_STATE_WAITER && state_wait_fd >= 0 ) {
+		if ( wait > MAX_STATE_WAIT ) {
+			wait = MAX_STATE_WAIT;
+		}
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		fcntl ( fd, F_SETFL, fcntl ( fd, F_GETFL ) | O_NONBLOCK );
+		state_waiter[state_waiter_count].fd = fd;
+		state_waiter[state_waiter_count].after = after;
+		state_waiter[state_waiter_count].deadline = now.tv_sec * 1000000000ULL + now.tv_nsec + wait * 1000000ULL;
+		state_waiter_count++;
+		pthread_mutex_unlock ( &state_wait_mutex );
+		state_wake ( );
+		log_message ( LOG_DEBUG, "state.qif: %d waiting for a change from %d\n", fd, after );
+		return true;
+	}
+	length = state_json ( body );
+	pthread_mutex_unlock ( &state_wait_mutex );
+	serve_json ( fd, body, length );
+	return false;
+}
+
+/*
+Send a page showing the state to the connected web browser. The text
+between the slots goes out as it is, from the compiled page, with the
+character for each slot between, so nothing is parsed or copied. The
+ETag is the page's own with the state added, so a browser that
+already has the page for the same state is told it has not changed.
+*/
+void serve_template ( int fd, struct Asset * asset, char * if_none_match ) {
+	struct iovec iov[2 * MAX_TEMPLATE_SLOTS + 10];
+	struct Template_Slot * slot;
+	char content_length[16];
+	char value[MAX_TEMPLATE_SLOTS];
+	char etag[32];
+	bool not_modified;
+	int input;
+	int output;
+	int offset = 0;
+	int count = 0;
+	int i;
+
+	input = read_inputs ( opt_input_age );
+	output = __atomic_load_n ( &pif_output, __ATOMIC_RELAXED );
+	sprintf ( etag, "\"%.16s-%02x%02x\"", asset->etag + 1, input & 0xff, output & 0xff );
+
+	not_modified = match_etag ( if_none_match, etag );
+	if ( not_modified ) {
+		iov[count].iov_base = (void *) header_not_modified;
+		iov[count].iov_len = sizeof ( header_not_modified ) - 1;
+		count++;
+	} else {
+		iov[count].iov_base = (void *) asset->type->header;
+		iov[count].iov_len = strlen ( asset->type->header );
+		count++;
+	}
+	iov[count].iov_base = (void *) header_etag;
+	iov[count].iov_len = sizeof ( header_etag ) - 1;
+	count++;
+	iov[count].iov_base = etag;
+	iov[count].iov_len = strlen ( etag );
+	count++;
+	iov[count].iov_base = (void *) header_line_end;
+	iov[count].iov_len = sizeof ( header_line_end ) - 1;
+	count++;
+	iov[count].iov_base = asset->cache_control;
+	iov[count].iov_len = strlen ( asset->cache_control );
+	count++;
+	if ( not_modified ) {
+		iov[count].iov_base = (void *) header_line_end;
+		iov[count].iov_len = sizeof ( header_line_end ) - 1;
+		count++;
+	} else {
+		iov[count].iov_base = (void *) header_content_length;
+		iov[count].iov_len = sizeof ( header_content_length ) - 1;
+		count++;
+		iov[count].iov_base = content_length;
+		iov[count].iov_len = sprintf ( content_length, "%d", asset->body_length + asset->slot_count );
+		count++;
+		iov[count].iov_base = (void *) header_end;
+		iov[count].iov_len = sizeof ( header_end ) - 1;
+		count++;
+
+		//  The text before each slot, then its value
+		for ( i = 0; i < asset->slot_count; i++ ) {
+			slot = &asset->slots[i];
+			value[i] = ( ( slot->kind == SLOT_INPUT ? input : output ) >> slot->bit ) & 1 ? '1' : '0';
+			iov[count].iov_base = asset->body + offset;
+			iov[count].iov_len = slot->offset - offset;
+			count++;
+			iov[count].iov_base = &value[i];
+			iov[count].iov_len = 1;
+			count++;
+			offset = slot->offset;
+		}
+		iov[count].iov_base = asset->body + offset;
+		iov[count].iov_len = asset->body_length - offset;
+		count++;
+	}
+
+	log_message ( LOG_DEBUG, "serve_template: %s, state %02x %02x.\n", asset->name, input, output );
+	if ( write_iov ( fd, iov, count ) < 0 ) {
+		log_message ( LOG_DEBUG, "serve_template: %s\n", strerror ( errno ) );
+	}
+}
+
+/*
+The procedure runs on a listener's acceptor thread. It listens to
+connection requests from web browsers.
+
+When a connection request is received, it is queued for the
+listener's worker threads, or turned away with a 503 if the queue
+is full.
+
+*/
+void *server ( void * arg ) {
+	struct Listener * listener = ( struct Listener * ) arg;
+	int listen_socket_fd = listener->fd;
+	int service_socket_fd = -1;
+	struct sockaddr_in cli_addr;
+	socklen_t clilen;
+	log_message ( LOG_INFO, "Enter server, cpu %d.\n", listener->cpu );
+	for (;;) {
+		try {
+			log_message ( LOG_DEBUG, "server: try catch count: %d\n", try_catch_count );
+			log_message ( LOG_DEBUG, "server: waiting for connection.\n" );
+
+			//  Accept the new connection request from a web browser
+			clilen = sizeof(cli_addr);
+			service_socket_fd = accept(listen_socket_fd,
+				(struct sockaddr *) &cli_addr,
+				&clilen);
+			unsigned long long trace = trace_start ( );
+			log_message ( LOG_DEBUG, "server: connection request received.\n" );
+			if (service_socket_fd < 0) {
+				error("ERROR on accept");
+				continue;
+			}
+
+			//  Hand the connection to a worker thread, unless the
+			//  browser is connecting too often
+			if ( !rate_allow ( cli_addr.sin_addr.s_addr, RATE_CONNECT ) ) {
+				reject_connection ( service_socket_fd, header_too_many, sizeof ( header_too_many ) - 1 );
+			} else if ( !connection_queue_push ( &listener->queue, service_socket_fd ) ) {
+				reject_connection ( service_socket_fd, header_unavailable, sizeof ( header_unavailable ) - 1 );
+			} else {
+				log_message ( LOG_DEBUG, "server: connection queued.\n" );
+			}
+			trace_end ( "accept", trace );
+
+		//  Deal with exceptions
+		} catch ( exception &e ) {
+			log_message ( LOG_ERROR, "Server exception: %s\n", e.what() );
+			cleanup_server_connections( service_socket_fd );
+		} catch ( ... ) {
+			log_message ( LOG_ERROR, "Server unknown exception.\n" );
+		}
+	}
+
+//  Should never reach here
+	log_message ( LOG_ERROR, "Exit server.\n" );
+	return 0;
+}
+
+/*
+This procedure services one connection from a web browser. It runs
+in a worker thread.
+
+Returns true if the socket has been handed over as an event stream,
+otherwise the socket is closed before returning.
+*/
+bool service_connection ( int service_socket_fd ) {
+	char *from_browser;
+	int   i;
+	int   j = 0;
+	int   n;
+	int   expected;
+	bool  keep_open = false;
+	struct pollfd poll_fd;
+	struct timespec start;
+	struct timespec now;
+	struct timeval timeout;
+
+	//  The request is read into a buffer from the pool rather than
+	//  onto the stack, so that workers can have small stacks
+	from_browser = buffer_get ( MAX_REQUEST_SIZE );
+	if ( !from_browser ) {
+		close ( service_socket_fd );
+		return false;
+	}
+	try {
+
+		//  Configure the socket, so that a browser which connects
+		//  but never sends a request cannot hold a worker for ever
+		timeout.tv_sec = 5;
+		timeout.tv_usec = 0;
+		i = setsockopt ( service_socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+		if ( i < 0 ) {
+			error ("ERROR setsockopt SO_RCVTIMEO");
+		}
+		log_message ( LOG_DEBUG, "service_connection: attempting to read request from browser.\n" );
+
+		//  Get the request from the web browser
+		unsigned long long trace = trace_start ( );
+		n = read (service_socket_fd, from_browser, MAX_REQUEST_SIZE-2);
+		if (n < 0) {
+			error("ERROR reading from socket.\n");
+			n = 0;
+		}
+		log_message ( LOG_DEBUG, "Read %d from browser at -a\n", n );
+		from_browser[n] = 0;
+		expected = get_request_length ( from_browser, n );
+		trace_end ( "read", trace );
+
+		//  Wait for more if necessary. The body is waited for for at
+		//  most a second, but no longer than it takes to arrive, so
+		//  that a worker is not tied up needlessly.
+		if ( expected > n ) {
+			log_message ( LOG_DEBUG, "Expected more from the browser at -b\n" );
+			if ( expected > MAX_REQUEST_SIZE - 2 ) {
+				expected = MAX_REQUEST_SIZE - 2;
+			}
+			trace = trace_start ( );
+			clock_gettime ( CLOCK_MONOTONIC, &start );
+			poll_fd.fd = service_socket_fd;
+			poll_fd.events = POLLIN;
+			while ( n + j < expected ) {
+				clock_gettime ( CLOCK_MONOTONIC, &now );
+				int remaining = 1000 - ( now.tv_sec - start.tv_sec ) * 1000
+					- ( now.tv_nsec - start.tv_nsec ) / 1000000;
+				if ( remaining <= 0 || poll ( &poll_fd, 1, remaining ) <= 0 ) {
+					break;
+				}
+				int k = recv (service_socket_fd, &from_browser[n+j], MAX_REQUEST_SIZE - 2 - n - j, MSG_DONTWAIT);
+				if ( k <= 0 ) {
+					break;
+				}
+				j += k;
+			}
+			from_browser[n+j] = 0;
+			trace_end ( "body_wait", trace );
+		}
+		log_message ( LOG_DEBUG, "%d, %d\n%s\n", n, j, from_browser );
+
+		//  Process the request
+		keep_open = process_request ( from_browser, n + j, service_socket_fd );
+
+		//  Close the socket, unless it is now an event stream
+		if ( !keep_open ) {
+			log_message ( LOG_DEBUG, "service_connection: about to close socket.\n" );
+			trace = trace_start ( );
+			close( service_socket_fd );
+			trace_end ( "close", trace );
+			log_message ( LOG_DEBUG, "service_connection: socket closed.\n" );
+		}
+
+	//  Deal with exceptions
+	} catch ( exception &e ) {
+		log_message ( LOG_ERROR, "service_connection exception: %s\n", e.what() );
+		cleanup_server_connections( service_socket_fd );
+	} catch ( ... ) {
+		log_message ( LOG_ERROR, "service_connection unknown exception.\n" );
+		cleanup_server_connections( service_socket_fd );
 	}
-	return REQUEST_UNDEFINED;
+	buffer_put ( from_browser );
+	return keep_open;
+}
+
+/*
+Sets a run time option from a "name=value" command line argument.
+
+Returns false if the option is not known.
+*/
+bool set_option ( char * argument ) {
+	unsigned int i;
+	int length = locate_char ( '=', argument );
+	for ( i = 0; i < sizeof ( options ) / sizeof ( options[0] ); i++ ) {
+		if ( (int) strlen ( options[i].name ) == length &&
+			test_lead_string ( argument, options[i].name ) ) {
+			*options[i].value = atoi ( argument + length + 1 );
+			return true;
+		}
+	}
+	for ( i = 0; i < sizeof ( text_options ) / sizeof ( text_options[0] ); i++ ) {
+		if ( (int) strlen ( text_options[i].name ) == length &&
+			test_lead_string ( argument, text_options[i].name ) ) {
+			*text_options[i].value = argument + length + 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+Gives threads created with the attributes a stack of stack kilobytes,
+or the least the system allows if that is more. Nothing the threads
+do needs much: buffers come from the pool, and pages from the cache
+of assets.
+*/
+void set_stack_size ( pthread_attr_t * attributes ) {
+	size_t size = (size_t) opt_stack * 1024;
+	if ( size < (size_t) PTHREAD_STACK_MIN ) {
+		size = PTHREAD_STACK_MIN;
+	}
+	if ( pthread_attr_setstacksize ( attributes, size ) != 0 ) {
+		log_message ( LOG_WARN, "Stack of %d kilobytes refused, using the default.\n", opt_stack );
+	}
+}
+
+/*
+Sets the indicated IPPROTO_TCP option on a socket. Failure is not
+fatal; the response is still sent, just less efficiently.
+*/
+void set_tcp_option ( int fd, int option, int value ) {
+
+	//  Over HTTP/2 the socket is the connection's, not the request's
+	if ( h2_capture && h2_capture->fd == fd ) {
+		return;
+	}
+	if ( setsockopt ( fd, IPPROTO_TCP, option, &value, sizeof ( value ) ) < 0 ) {
+		log_message ( LOG_DEBUG, "setsockopt IPPROTO_TCP: %s\n", strerror ( errno ) );
+	}
+}
+
+/*
+Handler for TCP connection issues. It does nothing.
+*/
+void sigpipe_handler ( int i ) {
+}
+
+/*
+Opens the listening sockets, one per core unless told otherwise,
+and starts the threads that serve them: for each, an acceptor and
+its share of the worker threads, all pinned to the listener's core,
+or with the io_uring backend an acceptor that services its own ring.
+The event thread, and the control thread if asked for, are started
+first, and are free to run on any core.
+*/
+void start_threads ( int port ) {
+	pthread_attr_t attributes;
+	pthread_condattr_t condition;
+	pthread_t thread;
+	cpu_set_t allowed;
+	cpu_set_t cpus;
+	int cpu_count;
+	int cpu;
+	int workers;
+	int fd;
+	int i;
+	int j;
+
+	if ( opt_workers < 1 ) {
+		opt_workers = 1;
+	}
+	if ( opt_queue < 1 ) {
+		opt_queue = 1;
+	}
+	rate_open ( );
+
+	//  The cores this process may run on
+	CPU_ZERO ( &allowed );
+	if ( sched_getaffinity ( 0, sizeof ( allowed ), &allowed ) < 0 ) {
+		CPU_SET ( 0, &allowed );
+	}
+	cpu_count = CPU_COUNT ( &allowed );
+	if ( opt_listeners < 1 ) {
+		opt_listeners = cpu_count;
+	}
+
+	//  Open the listening sockets. Should the kernel not support
+	//  SO_REUSEPORT, there is just the one.
+	listeners = ( struct Listener * ) calloc ( opt_listeners, sizeof ( struct Listener ) );
+	cpu = -1;
+	for ( i = 0; i < opt_listeners; i++ ) {
+		fd = open_listen_socket ( port, opt_listeners > 1 );
+		if ( fd < 0 ) {
+			break;
+		}
+		do {
+			cpu = ( cpu + 1 ) % CPU_SETSIZE;
+		} while ( !CPU_ISSET ( cpu, &allowed ) );
+		listeners[i].fd = fd;
+		listeners[i].cpu = cpu;
+		listener_count++;
+	}
+	if ( listener_count == 0 ) {
+		listeners[0].fd = open_listen_socket ( port, false );
+		if ( listeners[0].fd < 0 ) {
+			exit ( 1 );
+		}
+		listeners[0].cpu = cpu < 0 ? 0 : cpu;
+		listener_count = 1;
+		log_message ( LOG_WARN, "SO_REUSEPORT not available, using one listener.\n" );
+	}
+
+	//  Use io_uring if asked for and the kernel supports it
+	uring_enabled = opt_uring != 0;
+	for ( i = 0; i < listener_count && uring_enabled; i++ ) {
+		uring_enabled = uring_init ( &listeners[i].ring );
+	}
+	if ( uring_enabled ) {
+		log_message ( LOG_INFO, "Using io_uring, %d connections per ring.\n", opt_queue );
+	} else if ( opt_uring ) {
+		log_message ( LOG_WARN, "io_uring not available, using blocking sockets.\n" );
+	}
+
+	//  Every thread gets a small stack
+	buffer_preallocate ( );
+	pthread_attr_init ( &attributes );
+	pthread_attr_setdetachstate ( &attributes, PTHREAD_CREATE_DETACHED );
+	set_stack_size ( &attributes );
+	if ( pthread_create ( &thread, &attributes, send_events, 0 ) != 0 ) {
+		error ( "ERROR creating event thread" );
+	}
+
+	//  Output sequences run on a thread of their own, timed against
+	//  CLOCK_MONOTONIC
+	pthread_condattr_init ( &condition );
+	pthread_condattr_setclock ( &condition, CLOCK_MONOTONIC );
+	pthread_mutex_init ( &sequence.mutex, NULL );
+	pthread_cond_init ( &sequence.changed, &condition );
+	if ( pthread_create ( &thread, &attributes, sequence_thread, 0 ) != 0 ) {
+		error ( "ERROR creating sequence thread" );
+	}
+
+	pthread_condattr_destroy ( &condition );
+
+	//  As do state.qif requests waiting for a change
+	state_wait_fd = eventfd ( 0, EFD_NONBLOCK );
+	if ( state_wait_fd < 0 ) {
+		error ( "ERROR creating state wait eventfd" );
+	} else if ( pthread_create ( &thread, &attributes, state_wait_thread, 0 ) != 0 ) {
+		error ( "ERROR creating state wait thread" );
+		close ( state_wait_fd );
+		state_wait_fd = -1;
+	}
+
+	//  Programs on the same Pi may read the state from shared
+	//  memory, collectors elsewhere may be sent it over UDP, and
+	//  HTTP/2 connections, the gateway and control programs each
+	//  have a thread of their own
+	if ( opt_shm ) {
+		state_page_create ( );
+	}
+	if ( opt_udp ) {
+		udp_open ( );
+	}
+	if ( opt_h2 ) {
+		h2_huffman_build ( );
+		h2_wake_fd = eventfd ( 0, EFD_NONBLOCK );
+		if ( h2_wake_fd < 0 || pthread_create ( &thread, &attributes, h2_server, 0 ) != 0 ) {
+			error ( "ERROR creating HTTP/2 thread" );
+			h2_wake_fd = -1;
+		}
+		for ( i = 0; i < H2_WORKERS && h2_wake_fd >= 0; i++ ) {
+			if ( pthread_create ( &thread, &attributes, h2_worker, 0 ) != 0 ) {
+				error ( "ERROR creating HTTP/2 worker thread" );
+			}
+		}
+	}
+	if ( opt_upstream && gateway_open ( ) > 0 ) {
+		gateway_wake_fd = eventfd ( 0, EFD_NONBLOCK );
+		if ( gateway_wake_fd < 0 || pthread_create ( &thread, &attributes, gateway_server, 0 ) != 0 ) {
+			error ( "ERROR creating gateway thread" );
+			upstream_count = 0;
+		}
+	}
+	if ( opt_control ) {
+		fd = control_open ( );
+		if ( fd >= 0 && pthread_create ( &thread, &attributes, control_server, ( void * ) ( long ) fd ) != 0 ) {
+			error ( "ERROR creating control thread" );
+		}
+	}
+
+	//  The workers are shared out between the listeners, at least
+	//  one each
+	workers = ( opt_workers + listener_count - 1 ) / listener_count;
+	for ( i = 0; i < listener_count; i++ ) {
+		CPU_ZERO ( &cpus );
+		CPU_SET ( listeners[i].cpu, &cpus );
+		pthread_attr_setaffinity_np ( &attributes, sizeof ( cpus ), &cpus );
+		pthread_attr_setdetachstate ( &attributes, PTHREAD_CREATE_DETACHED );
+		if ( !uring_enabled ) {
+			listeners[i].queue.size = opt_queue;
+			listeners[i].queue.fd = ( int * ) malloc ( opt_queue * sizeof ( int ) );
+			pthread_mutex_init ( &listeners[i].queue.mutex, NULL );
+			pthread_cond_init ( &listeners[i].queue.not_empty, NULL );
+			for ( j = 0; j < workers; j++ ) {
+				if ( pthread_create ( &thread, &attributes, worker_thread, &listeners[i].queue ) != 0 ) {
+					error ( "ERROR creating worker thread" );
+				}
+			}
+		}
+		pthread_attr_setdetachstate ( &attributes, PTHREAD_CREATE_JOINABLE );
+		if ( pthread_create ( &listeners[i].thread, &attributes,
+				uring_enabled ? uring_server : server, &listeners[i] ) != 0 ) {
+			error ( "ERROR creating acceptor thread" );
+		}
+	}
+	pthread_attr_destroy ( &attributes );
+	if ( uring_enabled ) {
+		log_message ( LOG_DEBUG, "Started %d listeners.\n", listener_count );
+	} else {
+		log_message ( LOG_DEBUG, "Started %d listeners, each with %d worker threads and a queue of %d.\n",
+			listener_count, workers, opt_queue );
+	}
+}
+
+/*
+Creates the state page in shared memory, ready for readers.
+
+Returns false if it cannot be created.
+*/
+bool state_page_create ( ) {
+	struct State_Page * page;
+	int fd;
+
+	fd = shm_open ( PIFACE_STATE_NAME, O_RDWR | O_CREAT, 0644 );
+	if ( fd < 0 ) {
+		error ( "ERROR opening state page" );
+		return false;
+	}
+	if ( ftruncate ( fd, sizeof ( *page ) ) < 0 ) {
+		error ( "ERROR sizing state page" );
+		close ( fd );
+		return false;
+	}
+	page = ( struct State_Page * ) mmap ( 0, sizeof ( *page ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close ( fd );
+	if ( page == MAP_FAILED ) {
+		error ( "ERROR mapping state page" );
+		return false;
+	}
+	memset ( page, 0, sizeof ( *page ) );
+	page->magic = PIFACE_STATE_MAGIC;
+	page->version = PIFACE_STATE_VERSION;
+	page->state.input = pif_input;
+	page->state.output = pif_output;
+	state_page = page;
+	log_message ( LOG_INFO, "Publishing state page %s.\n", PIFACE_STATE_NAME );
+	return true;
+}
+
+/*
+Writes the state of the inputs and outputs to the state page,
+counting the changes on each input since the last write.
+*/
+void state_page_write ( int input, int output ) {
+	struct State_Snapshot * state = &state_page->state;
+	struct timespec now;
+	uint32_t lock;
+	int changed;
+	int i;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	pthread_mutex_lock ( &state_mutex );
+	lock = state_page->lock;
+	__atomic_store_n ( &state_page->lock, lock + 1, __ATOMIC_RELAXED );
+	__atomic_thread_fence ( __ATOMIC_RELEASE );
+	changed = ( state->input ^ input ) & 0xff;
+	for ( i = 0; i < 8; i++ ) {
+		if ( changed & ( 1 << i ) ) {
+			state->edges[i]++;
+		}
+	}
+	state->input = input;
+	state->output = output;
+	state->sequence++;
+	state->time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	__atomic_store_n ( &state_page->lock, lock + 2, __ATOMIC_RELEASE );
+	pthread_mutex_unlock ( &state_mutex );
+}
+
+/*
+Writes the state, as served by state.qif, as JSON. The caller must
+hold state_wait_mutex.
+
+Returns its length.
+*/
+int state_json ( char * buffer ) {
+	return sprintf ( buffer, "{\"seq\":%llu,\"input\":%d,\"output\":%d}",
+		state_sequence, state_input & 0xff, state_output & 0xff );
+}
+
+/*
+Notes the state of the inputs and outputs. If it has changed, it is
+given the next number, and the state wait thread is woken to send it
+to every parked state.qif request.
+*/
+void state_notify ( int input, int output ) {
+	bool wake = false;
+
+	pthread_mutex_lock ( &state_wait_mutex );
+	if ( input != state_input || output != state_output ) {
+		state_input = input;
+		state_output = output;
+		state_sequence++;
+		wake = state_waiter_count > 0;
+	}
+	pthread_mutex_unlock ( &state_wait_mutex );
+	if ( wake ) {
+		state_wake ( );
+	}
+}
+
+/*
+The state wait thread. Answers the parked state.qif requests that
+have seen the state change, or whose time is up with the state
+unchanged, then sends the replies, without blocking, as far as their
+sockets will take them. Sleeps until it is woken, a socket has room
+for more of a reply, or the earliest deadline.
+*/
+void *state_wait_thread ( void * unused ) {
+	struct pollfd fds[MAX_STATE_WAITER + 1];
+	struct State_Reply * reply;
+	struct timespec now;
+	unsigned long long earliest;
+	unsigned long long time;
+	unsigned long long count;
+	char body[100];
+	int replies = 0;
+	int timeout;
+	int n;
+	int i;
+
+	for (;;) {
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+		//  Take out those to be answered, and note when the next of
+		//  the others is due
+		earliest = 0;
+		pthread_mutex_lock ( &state_wait_mutex );
+		for ( i = 0; i < state_waiter_count; ) {
+			if ( replies < MAX_STATE_WAITER &&
+					( state_waiter[i].after != state_sequence || state_waiter[i].deadline <= time ) ) {
+				reply = &state_reply[replies++];
+				n = state_json ( body );
+				reply->fd = state_waiter[i].fd;
+				reply->length = sprintf ( reply->data, "%s%d%s%s", header_ok_json, n, header_end, body );
+				reply->sent = 0;
+				reply->deadline = now.tv_sec + STATE_REPLY_TIME;
+				state_waiter[i] = state_waiter[--state_waiter_count];
+			} else {
+				if ( earliest == 0 || state_waiter[i].deadline < earliest ) {
+					earliest = state_waiter[i].deadline;
+				}
+				i++;
+			}
+		}
+		pthread_mutex_unlock ( &state_wait_mutex );
+
+		//  Send what the sockets will take, and close those finished
+		//  with
+		for ( i = 0; i < replies; ) {
+			reply = &state_reply[i];
+			n = send ( reply->fd, reply->data + reply->sent, reply->length - reply->sent,
+				MSG_DONTWAIT | MSG_NOSIGNAL );
+			if ( n > 0 ) {
+				reply->sent += n;
+			}
+			if ( reply->sent == reply->length || ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) ||
+					now.tv_sec >= reply->deadline ) {
+				close ( reply->fd );
+				*reply = state_reply[--replies];
+			} else {
+				i++;
+			}
+		}
+
+		//  Sleep until there is more to do
+		fds[0].fd = state_wait_fd;
+		fds[0].events = POLLIN;
+		for ( i = 0; i < replies; i++ ) {
+			fds[i + 1].fd = state_reply[i].fd;
+			fds[i + 1].events = POLLOUT;
+		}
+		timeout = replies > 0 ? 1000 : -1;
+		if ( earliest > 0 && ( timeout < 0 || earliest - time < timeout * 1000000ULL ) ) {
+			timeout = ( earliest - time + 999999 ) / 1000000;
+		}
+		if ( poll ( fds, replies + 1, timeout ) > 0 && ( fds[0].revents & POLLIN ) ) {
+			if ( read ( state_wait_fd, &count, sizeof ( count ) ) < 0 ) {
+				log_message ( LOG_DEBUG, "state_wait_thread: %s\n", strerror ( errno ) );
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+Wakes the state wait thread, to answer a parked state.qif request
+or to take up a new one.
+*/
+void state_wake ( ) {
+	unsigned long long one = 1;
+	if ( state_wait_fd >= 0 && write ( state_wait_fd, &one, sizeof ( one ) ) < 0 ) {
+		log_message ( LOG_DEBUG, "state_wake: %s\n", strerror ( errno ) );
+	}
+}
+
+/*
+Credits the pins that are on with the time since the statistics were
+last brought up to date, to now. The caller must hold stats.mutex.
+*/
+void stats_account ( unsigned long long now ) {
+	int bits;
+	int i;
+
+	for ( i = 0; i < STATS_WINDOWS; i++ ) {
+		stats_window_add ( &stats.window[i], stats_window_length[i], stats.state, stats.time, now );
+	}
+	for ( bits = stats.state; bits; bits &= bits - 1 ) {
+		stats.pin[__builtin_ctz ( bits )].on_time += now - stats.time;
+	}
+	stats.time = now;
+}
+
+/*
+Writes the statistics, as served by stats.qif, as JSON: for each
+input and output the seconds it has been on in all, its changes, the
+seconds since its last change, and its duty cycle over the last
+minute, hour and day, or as much of them as the server has been
+running.
+
+Returns its length.
+*/
+int stats_json ( char * buffer ) {
+	struct Stats_Window * window;
+	struct timespec now;
+	unsigned long long span;
+	int length;
+	int pin;
+	int i;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	pthread_mutex_lock ( &stats.mutex );
+	if ( stats.state >= 0 ) {
+		stats_account ( now.tv_sec * 1000000000ULL + now.tv_nsec );
+	}
+	length = sprintf ( buffer, "{\"seconds\":%.3f,\"input\":[", ( stats.time - stats.started ) * 1e-9 );
+	for ( pin = 0; pin < STATS_PINS; pin++ ) {
+		if ( pin == 8 ) {
+			length += sprintf ( buffer + length, "],\"output\":[" );
+		} else if ( pin > 0 ) {
+			buffer[length++] = ',';
+		}
+		length += sprintf ( buffer + length, "{\"on\":%.3f,\"edges\":%llu,\"since\":%.3f,\"duty\":[",
+			stats.pin[pin].on_time * 1e-9, stats.pin[pin].edges, ( stats.time - stats.pin[pin].changed ) * 1e-9 );
+		for ( i = 0; i < STATS_WINDOWS; i++ ) {
+			window = &stats.window[i];
+			span = ( window->filled - 1 ) * ( stats_window_length[i] / STATS_SLOTS ) + stats.time - window->slot_start;
+			length += sprintf ( buffer + length, i ? ",%.4f" : "%.4f",
+				span ? ( double ) window->total[pin] / span : 0.0 );
+		}
+		length += sprintf ( buffer + length, "]}" );
+	}
+	length += sprintf ( buffer + length, "]}" );
+	pthread_mutex_unlock ( &stats.mutex );
+	return length;
+}
+
+/*
+Reads back the totals written by stats_save before the last restart,
+if there are any.
+*/
+void stats_load ( ) {
+	unsigned long long on_time;
+	unsigned long long edges;
+	FILE * file;
+	int version;
+	int pin;
+
+	if ( !opt_stats_file || !*opt_stats_file ) {
+		return;
+	}
+	file = fopen ( opt_stats_file, "r" );
+	if ( !file ) {
+		return;
+	}
+	if ( fscanf ( file, "piface_digital_2 stats %d", &version ) != 1 || version != STATS_VERSION ) {
+		log_message ( LOG_WARN, "Statistics in %s not understood.\n", opt_stats_file );
+		fclose ( file );
+		return;
+	}
+	pthread_mutex_lock ( &stats.mutex );
+	for ( pin = 0; pin < STATS_PINS; pin++ ) {
+		if ( fscanf ( file, "%*s %llu %llu", &on_time, &edges ) != 2 ) {
+			break;
+		}
+		stats.pin[pin].on_time = on_time;
+		stats.pin[pin].edges = edges;
+	}
+	pthread_mutex_unlock ( &stats.mutex );
+	fclose ( file );
+	log_message ( LOG_INFO, "Statistics read from %s.\n", opt_stats_file );
+}
+
+/*
+Writes the totals to stats_file, one line for each pin with its on
+time in nanoseconds and its changes, by way of a temporary file so
+that a restart part way through leaves the last copy whole. Runs in
+the event thread.
+*/
+void stats_save ( ) {
+	struct Stats_Pin pin[STATS_PINS];
+	char name[300];
+	FILE * file;
+	int i;
+
+	if ( !opt_stats_file || !*opt_stats_file ) {
+		return;
+	}
+	pthread_mutex_lock ( &stats.mutex );
+	if ( stats.state >= 0 ) {
+		struct timespec now;
+		clock_gettime ( CLOCK_MONOTONIC, &now );
+		stats_account ( now.tv_sec * 1000000000ULL + now.tv_nsec );
+	}
+	memcpy ( pin, stats.pin, sizeof ( pin ) );
+	pthread_mutex_unlock ( &stats.mutex );
+
+	snprintf ( name, sizeof ( name ), "%s.new", opt_stats_file );
+	file = fopen ( name, "w" );
+	if ( !file ) {
+		error ( "ERROR writing statistics" );
+		return;
+	}
+	fprintf ( file, "piface_digital_2 stats %d\n", STATS_VERSION );
+	for ( i = 0; i < STATS_PINS; i++ ) {
+		fprintf ( file, "%s%d %llu %llu\n", i < 8 ? "input" : "output", i % 8, pin[i].on_time, pin[i].edges );
+	}
+	if ( fclose ( file ) != 0 || rename ( name, opt_stats_file ) < 0 ) {
+		error ( "ERROR writing statistics" );
+	}
+}
+
+/*
+Brings the statistics up to date with the state of the inputs and
+outputs, counting a change on each pin that differs from the last.
+*/
+void stats_update ( int input, int output ) {
+	struct timespec now;
+	unsigned long long time;
+	int state = ( input & 0xff ) | ( output & 0xff ) << 8;
+	int changed;
+	int pin;
+	int i;
+
+	pthread_mutex_lock ( &stats.mutex );
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if ( stats.state < 0 ) {
+		stats.started = time;
+		stats.time = time;
+		for ( i = 0; i < STATS_WINDOWS; i++ ) {
+			stats.window[i].slot_start = time;
+			stats.window[i].filled = 1;
+		}
+		for ( pin = 0; pin < STATS_PINS; pin++ ) {
+			stats.pin[pin].changed = time;
+		}
+		changed = 0;
+	} else {
+		stats_account ( time );
+		changed = stats.state ^ state;
+	}
+	for ( ; changed; changed &= changed - 1 ) {
+		pin = __builtin_ctz ( changed );
+		stats.pin[pin].edges++;
+		stats.pin[pin].changed = time;
+	}
+	stats.state = state;
+	pthread_mutex_unlock ( &stats.mutex );
+}
+
+/*
+Credits the pins that are on in state with the time from from to to,
+in one window of the given length, moving the window on a slot each
+time one fills. The state is published at least once a second, so
+that is seldom more than one slot. The caller must hold stats.mutex.
+*/
+void stats_window_add ( struct Stats_Window * window, unsigned long long length, int state,
+		unsigned long long from, unsigned long long to ) {
+	unsigned long long slot_length = length / STATS_SLOTS;
+	unsigned long long end;
+	int bits;
+	int pin;
+
+	for (;;) {
+		end = window->slot_start + slot_length;
+		if ( to < end ) {
+			end = to;
+		}
+		for ( bits = state; bits; bits &= bits - 1 ) {
+			pin = __builtin_ctz ( bits );
+			window->on[window->slot][pin] += end - from;
+			window->total[pin] += end - from;
+		}
+		if ( end == to ) {
+			return;
+		}
+
+		//  Move on a slot, taking the oldest out of the totals
+		from = end;
+		window->slot_start = end;
+		window->slot = ( window->slot + 1 ) % STATS_SLOTS;
+		if ( window->filled < STATS_SLOTS ) {
+			window->filled++;
+		}
+		for ( pin = 0; pin < STATS_PINS; pin++ ) {
+			window->total[pin] -= window->on[window->slot][pin];
+			window->on[window->slot][pin] = 0;
+		}
+	}
+}
+
+/*
+Writes the latest spans of every thread as Chrome trace_event JSON,
+in a buffer which the caller must free. Times are in microseconds,
+from CLOCK_MONOTONIC. The buffer is sized for the spans there are,
+up to TRACE_DUMP_SPANS, not for full rings.
+
+Returns the length of the JSON, or -1 if memory runs out.
+*/
+int trace_dump ( char ** buffer ) {
+	struct Trace_Ring * ring;
+	struct Trace_Span * span;
+	unsigned per_ring;
+	unsigned spans = 0;
+	unsigned head;
+	unsigned i;
+	int count = 0;
+	int length;
+
+	pthread_mutex_lock ( &trace_mutex );
+	for ( ring = trace_rings; ring; ring = ring->next ) {
+		count++;
+	}
+	per_ring = count ? TRACE_DUMP_SPANS / count : 0;
+	for ( ring = trace_rings; ring; ring = ring->next ) {
+		head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+		head = head < ring->size ? head : ring->size;
+		spans += head < per_ring ? head : per_ring;
+	}
+	*buffer = ( char * ) malloc ( 64 + spans * TRACE_SPAN_JSON );
+	if ( !*buffer ) {
+		pthread_mutex_unlock ( &trace_mutex );
+		return -1;
+	}
+	length = sprintf ( *buffer, "{\"traceEvents\":[" );
+	count = 0;
+
+	//  Rings go on filling meanwhile, so no more spans are taken than
+	//  were allowed for
+	for ( ring = trace_rings; ring && spans > 0; ring = ring->next ) {
+		head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+		i = per_ring < ring->size ? per_ring : ring->size;
+		i = head > i ? head - i : 0;
+		for ( ; i < head && spans > 0; i++, spans-- ) {
+			span = &ring->span[i & ( ring->size - 1 )];
+			length += sprintf ( *buffer + length,
+				"%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+				count++ ? "," : "", span->name, ring->thread,
+				span->start / 1000, span->start % 1000, span->duration / 1000, span->duration % 1000 );
+		}
+	}
+	pthread_mutex_unlock ( &trace_mutex );
+	length += sprintf ( *buffer + length, "\n]}\n" );
+	return length;
+}
+
+/*
+Ends a span begun with trace_start, recording it if tracing was on
+when it began.
+*/
+inline void trace_end ( const char * name, unsigned long long start ) {
+	if ( __builtin_expect ( start != 0, 0 ) ) {
+		trace_record ( name, start );
+	}
+}
+
+/*
+Records a span in the calling thread's ring, setting the ring up on
+the thread's first span.
+*/
+void trace_record ( const char * name, unsigned long long start ) {
+	struct Trace_Ring * ring = trace_ring;
+	struct Trace_Span * span;
+	struct timespec now;
+	unsigned size;
+
+	if ( !ring ) {
+		size = ring_size ( opt_trace_spans );
+		ring = ( struct Trace_Ring * ) calloc ( 1, sizeof ( *ring ) + size * sizeof ( struct Trace_Span ) );
+		if ( !ring ) {
+			return;
+		}
+		ring->span = ( struct Trace_Span * ) ( ring + 1 );
+		ring->size = size;
+		ring->thread = syscall ( SYS_gettid );
+		pthread_mutex_lock ( &trace_mutex );
+		ring->next = trace_rings;
+		trace_rings = ring;
+		pthread_mutex_unlock ( &trace_mutex );
+		trace_ring = ring;
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	span = &ring->span[ring->head & ( ring->size - 1 )];
+	span->name = name;
+	span->start = start;
+	span->duration = now.tv_sec * 1000000000ULL + now.tv_nsec - start;
+	__atomic_store_n ( &ring->head, ring->head + 1, __ATOMIC_RELEASE );
+}
+
+/*
+Asks the event thread to write out the trace, which is not safe to
+do in a signal handler.
+*/
+void trace_signal_handler ( int signal ) {
+	trace_dump_wanted = 1;
+}
+
+/*
+Begins a span.
+
+Returns the CLOCK_MONOTONIC time in nanoseconds, or 0 if tracing is
+off.
+*/
+inline unsigned long long trace_start ( ) {
+	struct timespec now;
+	if ( __builtin_expect ( !tracing, 1 ) ) {
+		return 0;
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+Writes the trace to TRACE_FILE. Runs in the event thread.
+*/
+void trace_write_file ( ) {
+	char * dump;
+	int length = trace_dump ( &dump );
+	FILE * file;
+	if ( length < 0 ) {
+		log_message ( LOG_WARN, "Out of memory for the trace.\n" );
+		return;
+	}
+	file = fopen ( TRACE_FILE, "w" );
+	if ( file ) {
+		fwrite ( dump, 1, length, file );
+		fclose ( file );
+		log_message ( LOG_INFO, "Trace written to %s.\n", TRACE_FILE );
+	} else {
+		error ( "ERROR writing trace" );
+	}
+	free ( dump );
 }
 
 /*
-Initialise everything that needs it
-*/
-void initialise() {
-//	int mmap_fd;
-//	int length;
-	struct sigaction act;
+Opens the socket for the UDP publisher, connected to the address
+and port given by the udp option. A multicast group is reached with
+a time to live of 1, so datagrams stay on the local network, through
+the interface with the address given by udp_interface if there is
+one.
 
-	try_catch_count = 0;
+Returns false if the address is not understood or the socket cannot
+be opened.
+*/
+bool udp_open ( ) {
+	struct sockaddr_in addr;
+	char host[64];
+	int length = locate_char ( ':', ( char * ) opt_udp );
+	unsigned char ttl = 1;
+	struct in_addr interface;
+	int fd;
 
-	//  Configure the PiFace digital 2 things
-	pifacedigital_open( pif_hw_addr );
-	if ( verbose ) {
-		printf("Opened PiFace Digfital 2 with hardware addess %d\n", pif_hw_addr );
+	memset ( &addr, 0, sizeof ( addr ) );
+	addr.sin_family = AF_INET;
+	if ( length <= 0 || length >= (int) sizeof ( host ) ) {
+		log_message ( LOG_ERROR, "ERROR, udp=%s is not address:port\n", opt_udp );
+		return false;
 	}
-	pif_interrupts_enabled = !pifacedigital_enable_interrupts();
-	if ( pif_interrupts_enabled ) {
-		if ( verbose ) {
-			printf("PiFace Digfital 2 interrups enabled.\n" );
+	memcpy ( host, opt_udp, length );
+	host[length] = 0;
+	addr.sin_port = htons ( atoi ( opt_udp + length + 1 ) );
+	if ( !inet_aton ( host, &addr.sin_addr ) || addr.sin_port == 0 ) {
+		log_message ( LOG_ERROR, "ERROR, udp=%s is not address:port\n", opt_udp );
+		return false;
+	}
+	fd = socket ( AF_INET, SOCK_DGRAM, 0 );
+	if ( fd < 0 ) {
+		error ( "ERROR opening UDP socket" );
+		return false;
+	}
+	if ( IN_MULTICAST ( ntohl ( addr.sin_addr.s_addr ) ) ) {
+		setsockopt ( fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ( ttl ) );
+		if ( opt_udp_interface && inet_aton ( opt_udp_interface, &interface ) ) {
+			setsockopt ( fd, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof ( interface ) );
 		}
-	} else {
-		printf("PiFace Digfital 2 interrups NOT enabled.\n" );
 	}
-	pif_output = 0;
-
-	//  Set up the event streams
-	int i;
-	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
-		event_stream[i] = -1;
-		event_waiting[i] = false;
+	if ( connect ( fd, ( struct sockaddr * ) &addr, sizeof ( addr ) ) < 0 ) {
+		error ( "ERROR connecting UDP socket" );
+		close ( fd );
+		return false;
 	}
-	//  Zero the outputs
-	for ( i = 0; i < 8 ; i++ ) {
-		output[i] = 0;
+	if ( opt_board == 0 ) {
+		opt_board = pif_hw_addr;
 	}
-
-	//  Be graceful about web browser closing down
-	memset ( &act, 0, sizeof(act));
-	act.sa_handler = SIG_IGN;
-	act.sa_flags = SA_RESTART;
-	sigaction (SIGPIPE, &act, NULL);
+	udp_fd = fd;
+	log_message ( LOG_INFO, "Publishing state to %s.\n", opt_udp );
+	return true;
 }
 
 /*
-This procedure advises the connected web browser to expect
-server-side events. It is response to the request for the
-pseudo file "events.qif".
+Sends a datagram if the state has changed since the last one, or a
+keyframe if there has been nothing for keyframe seconds. Never waits;
+a datagram the socket cannot take is lost, as it might be on the
+network, and shows up as a gap in the sequence.
 */
-void open_event_stream ( int fd ) {
-	char header[300];
-	int header_length;
-	header_length = sprintf (header, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream; charset=UTF-8\n\n" );
-	if ( verbose ) {
-		printf ("Event header created.\n");
+void udp_publish ( int input, int output ) {
+	struct State_Datagram datagram;
+	struct timespec now;
+	bool changed;
+
+	clock_gettime ( CLOCK_MONOTONIC, &now );
+	pthread_mutex_lock ( &udp_mutex );
+	changed = input != udp_input || output != udp_output;
+	if ( !changed && now.tv_sec - udp_sent < opt_keyframe ) {
+		pthread_mutex_unlock ( &udp_mutex );
+		return;
 	}
-	write_header ( fd, header, header_length );
-	register_event_stream ( fd );
+	udp_input = input;
+	udp_output = output;
+	udp_sent = now.tv_sec;
+	udp_sequence++;
+	clock_gettime ( CLOCK_REALTIME, &now );
+	memset ( &datagram, 0, sizeof ( datagram ) );
+	datagram.version = STATE_DATAGRAM_VERSION;
+	datagram.flags = changed ? 0 : STATE_DATAGRAM_KEYFRAME;
+	datagram.board = htons ( opt_board );
+	datagram.sequence = htonl ( udp_sequence );
+	datagram.time = htobe64 ( now.tv_sec * 1000000000ULL + now.tv_nsec );
+	datagram.input = input;
+	datagram.output = output;
+	send ( udp_fd, &datagram, sizeof ( datagram ), MSG_DONTWAIT );
+	pthread_mutex_unlock ( &udp_mutex );
 }
 
 /*
-This procedure returns the web page requested by the web browser.
+Attempts to close the event stream using the given file descriptor.
 
-Initiates server-side events if the requested page is "events.qif".
+Returns false if it is not an event stream.
 */
-void process_get_request ( char * from_browser, int service_socket_fd ) {
-	char  page_name[300];
-	char  disk_page[MAX_DISK_PAGE_SIZE];
-	int   disk_page_length;
-	int   expanded_page_length;
-	char  expanded_page[MAX_EXPANDED_PAGE_SIZE];
-	int   event_socket_fd;
+bool unregister_event_stream ( int fd ) {
+	bool found = false;
+	int i;
+	pthread_mutex_lock ( &event_mutex );
+	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+		if ( event_stream[i].fd == fd ) {
+			close_event_stream ( &event_stream[i] );
+			found = true;
+		}
+	}
+	pthread_mutex_unlock ( &event_mutex );
+	return found;
+}
 
-	//  Get the request file from disk
-	disk_page_length = get_page ( from_browser, page_name, sizeof ( page_name ), disk_page, sizeof ( disk_page ) );
+#ifdef HAVE_URING
 
-	//  Deal with *.png file
-	if (test_tail_string (page_name, ".png")) {
-		if ( verbose ) {
-			printf ("Serving image\n");
-		}
-		serve_page (service_socket_fd, disk_page, disk_page_length, false);
+/*
+Adds the buffers to the response being gathered up for the request
+being handled on the ring.
 
-	//  Deal with *.qif files
-	} else if (test_tail_string (page_name, ".qif")) {
-		if ( verbose ) {
-			printf ("Serving qif\n");
-		}
-		if ( test_lead_string ( page_name, "events." ) ) {
-			if ( verbose ) {
-				printf ("Serving events\n");
+Returns false if memory runs out.
+*/
+bool uring_capture_iov ( struct iovec * iov, int count ) {
+	return buffer_append_iov ( &uring_capture->response, &uring_capture->response_length, iov, count );
+}
+
+/*
+Deals with one completion from the ring. The kind of operation is
+held in the bottom bits of the user data, above which is the
+connection it belongs to.
+*/
+void uring_complete ( struct Uring * ring, struct io_uring_cqe * cqe ) {
+	unsigned long long user_data = cqe->user_data;
+	struct Uring_Connection * connection;
+	connection = ( struct Uring_Connection * ) ( user_data & ~ (unsigned long long) URING_OP_MASK );
+
+	switch ( user_data & URING_OP_MASK ) {
+	case URING_ACCEPT:
+		if ( cqe->res >= 0 ) {
+			connection = ring->free_connections;
+			if ( opt_connect_rate > 0 && !rate_allow ( get_peer_address ( cqe->res ), RATE_CONNECT ) ) {
+				reject_connection ( cqe->res, header_too_many, sizeof ( header_too_many ) - 1 );
+			} else if ( connection ) {
+				ring->free_connections = connection->next_free;
+				connection->fd = cqe->res;
+				uring_queue_recv ( connection );
+			} else {
+				reject_connection ( cqe->res, header_unavailable, sizeof ( header_unavailable ) - 1 );
 			}
-			event_socket_fd = service_socket_fd;
-			open_event_stream ( event_socket_fd );
-			send_events ( event_socket_fd );
-		}
-		if ( verbose ) {
-			printf ("PiFace events sent\n");
+		} else if ( cqe->res == -EINVAL && ring->multishot ) {
+
+			//  Kernels before 5.19 refuse multishot accept, so
+			//  fall back to one accept at a time
+			ring->multishot = false;
+		} else {
+			errno = -cqe->res;
+			error ( "ERROR on accept" );
 		}
-	//  Deal with all other file types
-	} else {
-		if ( verbose ) {
-			printf ("Serving text\n");
+		if ( !( cqe->flags & IORING_CQE_F_MORE ) ) {
+			uring_queue_accept ( ring );
 		}
-		expanded_page_length = expand_page (disk_page, expanded_page, sizeof ( expanded_page ) - 2);
-		if ( verbose ) {
-			printf ("Text now expanded\n");
+		break;
+	case URING_RECV:
+		uring_complete_recv ( connection, cqe->res, cqe->flags );
+		break;
+	case URING_WRITE:
+		uring_complete_write ( connection, cqe->res, !connection->keep_open );
+		break;
+	case URING_CLOSE:
+
+		//  A close cancelled by a failed or short send is reissued
+		//  by uring_complete_write
+		if ( cqe->res != -ECANCELED ) {
+			uring_free_connection ( connection );
 		}
-		serve_page (service_socket_fd, expanded_page, expanded_page_length, false);
+		break;
+	case URING_EVENT:
+		uring_complete_event ( user_data >> 3, cqe->res );
+		break;
 	}
 }
 
 /*
-This procedure services PUT requests from the web browser.
-
-It is used to provide the functionality needed when the user
-changes an output.
+Deals with the completion of an event written by the ring on behalf
+of the event thread. The tag identifies the event stream slot and
+the generation of the slot when the event was queued. If the stream
+has been closed since, its frame is let go of now.
 */
-void process_put_request ( char * from_browser, int fd ) {
-	int i;
-	int mask;
-	if ( verbose ) {
-		printf ("Started process_put_request\n");
-	}
-	char header[300];
-	int header_length;
-	char *ptr = from_browser;
-	while ( *ptr != '?' ) {
-		ptr++;
-	}
-	ptr++;
+void uring_complete_event ( unsigned long long tag, int res ) {
+	struct Event_Stream * stream = &event_stream[tag & 0xff];
+	pthread_mutex_lock ( &event_mutex );
+	stream->sending = false;
+	if ( stream->fd >= 0 && (unsigned) stream->generation == ( tag >> 8 ) ) {
+		stream->busy = false;
 
-	//  Extract which bit is being modified
-	ptr++;
-	int bit = (*ptr) - '0';
-
-	//  Extract the required value
-	ptr += 2;
-	int value = (*ptr) - '0';
-	if ( value ) {
-		value <<= bit;
-		pif_output |= value;
+		//  A partial event would garble the stream, so a browser
+		//  that cannot take a whole event is let go
+		if ( res < stream->frame->length ) {
+			close_event_stream ( stream );
+		}
 	} else {
-		mask = 1;
-		mask <<= bit;
-		pif_output &= ~mask;
+		event_frame_put ( stream->frame );
+		stream->frame = 0;
 	}
+	pthread_mutex_unlock ( &event_mutex );
+}
 
-	//  Write to the PiFace Digital 2
-	pifacedigital_write_reg ( pif_output, OUTPUT, pif_hw_addr );
+/*
+Deals with the arrival of a request, or part of one, in one of the
+provided buffers. A complete request is serviced at once, on this
+thread; the handlers only queue their responses, so never block.
+*/
+void uring_complete_recv ( struct Uring_Connection * connection, int res, unsigned flags ) {
+	struct Uring * ring = connection->ring;
+	char * data;
+	int    buffer_id;
+	int    expected = -1;
+	int    n;
 
-	try {
-		//  Send off the acknowledgement to the web browser
-		header_length = sprintf (header, "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: %d\n\n", 0);
-		write_header ( fd, header, header_length );
-
-		//  Update the master copy of the output bits
-		mask = 1;
-		for ( i = 0; i < 8; i++ ) {
-			if ( mask & pif_output ) {
-				output[i] = '1';
-			} else {
-				output[i] = '0';
-			}
-			mask <<= 1;
+	if ( res <= 0 ) {
+
+		//  All of the buffers are in use; they are returned as each
+		//  request is serviced, so simply ask again
+		if ( res == -ENOBUFS ) {
+			uring_queue_recv ( connection );
+			return;
 		}
 
-		//  Advise all currently connected browsers and future
-		//  connected web browser that the output has changed.
-		for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
-			event_waiting[i] = true;
+		//  The browser went away, or sent nothing before the
+		//  linked timeout expired
+		uring_queue_close ( connection );
+		return;
+	}
+	buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+	data = ring->buffers + buffer_id * MAX_REQUEST_SIZE;
+	data[res] = 0;
+	if ( !connection->request ) {
+		expected = get_request_length ( data, res );
+	}
+
+	//  A request that arrives in pieces is gathered up, so that the
+	//  buffer can go straight back to the kernel
+	if ( expected < 0 || expected > res ) {
+		if ( !connection->request ) {
+			connection->request = buffer_get ( MAX_REQUEST_SIZE );
+			if ( !connection->request ) {
+				uring_provide_buffers ( ring, buffer_id, 1 );
+				uring_queue_close ( connection );
+				return;
+			}
+		}
+		n = MAX_REQUEST_SIZE - 2 - connection->request_length;
+		if ( n > res ) {
+			n = res;
 		}
+		memcpy ( connection->request + connection->request_length, data, n );
+		connection->request_length += n;
+		connection->request[connection->request_length] = 0;
+		uring_provide_buffers ( ring, buffer_id, 1 );
+		buffer_id = -1;
+		data = connection->request;
+		res = connection->request_length;
+		expected = get_request_length ( data, res );
+		if ( ( expected < 0 || expected > res ) && res < MAX_REQUEST_SIZE - 2 ) {
+			uring_queue_recv ( connection );
+			return;
+		}
+	}
 
-	//  Catch and deal with the expections
-	} catch ( exception &e ) {
-		printf ("Process put exception: %s\n", e.what());
-		cleanup_server_connections( fd );
-		throw;
-		pthread_exit ( NULL );
+	//  Service the request, gathering up the response
+	uring_capture = connection;
+	unsigned long long trace = trace_start ( );
+	try {
+		connection->keep_open = process_request ( data, res, connection->fd );
 	} catch ( ... ) {
-		printf ("Process put unknown exception.\n");
-		unregister_event_stream( fd ) ;
-		throw;
-		pthread_exit ( NULL );
+		log_message ( LOG_ERROR, "uring_complete_recv unknown exception.\n" );
+		connection->keep_open = false;
 	}
-	if ( verbose ) {
-		printf ("Exit process_page.\n");
+	uring_capture = 0;
+	trace_end ( "uring_request", trace );
+	if ( buffer_id >= 0 ) {
+		uring_provide_buffers ( ring, buffer_id, 1 );
+	}
+	if ( connection->response_length > 0 ) {
+		uring_queue_write ( connection, !connection->keep_open );
+	} else if ( connection->keep_open ) {
+
+		//  Parked until the state changes; the socket is no longer
+		//  the ring's
+		uring_free_connection ( connection );
+	} else {
+		uring_queue_close ( connection );
 	}
 }
 
 /*
-Attempt to register the given file descriptor as an event stream.
-Silently ignore if there is no spare slot
+Deals with the completion of a response. A send that fails or falls
+short also cancels the close linked to it, so the close is reissued
+here along with whatever is left to send.
 */
-void register_event_stream ( int fd ) {
+void uring_complete_write ( struct Uring_Connection * connection, int res, bool linked ) {
 	int i;
-	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
-		if ( event_stream[i] < 0 ) {
-			event_stream[i] = fd;
-			if ( verbose ) {
-				printf ( "Registered event stream %d\n", fd);
+	if ( res < 0 ) {
+		if ( connection->keep_open ) {
+			unregister_event_stream ( connection->fd );
+			uring_free_connection ( connection );
+		} else {
+			uring_queue_close ( connection );
+		}
+		return;
+	}
+	connection->response_sent += res;
+	if ( connection->response_sent < connection->response_length ) {
+		uring_queue_write ( connection, linked );
+		return;
+	}
+
+	//  An event stream now has its header, so the event thread can
+	//  take over. The socket stays open, owned by the event stream.
+	if ( connection->keep_open ) {
+		pthread_mutex_lock ( &event_mutex );
+		for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
+			if ( event_stream[i].fd == connection->fd ) {
+				event_stream[i].busy = false;
 			}
-			break;
 		}
+		pthread_mutex_unlock ( &event_mutex );
+		uring_free_connection ( connection );
 	}
 }
 
 /*
-Send the current state of the digital inputs to the connected
-web browser.
-
-If the digital outputs have changed, append that to the event
-message.
+Returns a connection to the free list once its socket is closed or
+handed over.
 */
-void send_events( int event_socket_fd ) {
-	int i;
-	int j;
-	int event_length;
-	char event[200];
-	if ( verbose ) {
-		printf ("Send events entered\n");
-	}
-	for ( ;; ) {
+void uring_free_connection ( struct Uring_Connection * connection ) {
+	struct Uring * ring = connection->ring;
+	buffer_put ( connection->request );
+	buffer_put ( connection->response );
+	memset ( connection, 0, sizeof ( *connection ) );
+	connection->fd = -1;
+	connection->ring = ring;
+	connection->next_free = ring->free_connections;
+	ring->free_connections = connection;
+}
 
-		//  Prepare the first mart of the event message
-		event_length = sprintf (event, "event: piface\ndata: ");
+/*
+Returns the next free submission queue entry, cleared and tagged
+with the given user data. If the queue is full, what is in it is
+handed to the kernel first to make room. The caller must hold
+the ring's mutex. The entry is not seen by the kernel until the next
+uring_submit.
+*/
+struct io_uring_sqe *uring_get_sqe ( struct Uring * ring, unsigned long long user_data ) {
+	struct io_uring_sqe * sqe;
+	unsigned index;
 
-		//  Get the current state of the digital inputs
-		pif_input = pifacedigital_read_reg( INPUT, pif_hw_addr);
+	uring_make_room ( ring, 1 );
+	index = ring->sq_pending_tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset ( sqe, 0, sizeof ( *sqe ) );
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	ring->sq_pending_tail++;
+	return sqe;
+}
 
-		//  Write the current state as a binary number
-		write_binary ( pif_input, &event[event_length], 8 );
-		event_length += 8;
+/*
+Sets up a ring, checks that the kernel supports everything the
+backend uses, and provides the receive buffers.
 
-		//  See if there is an output waiting to be sent
-		for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
-			if ( event_stream[i] == event_socket_fd ) {
-				if ( event_waiting[i] ) {
-					event_waiting[i] = false;
-					for ( j = 0; j < 8; j++ ) {
-						event[event_length] = output[j];
-						event_length++;
-					}
-				}
-			}
-		}
+Returns false, leaving the blocking backend in use, if io_uring is
+not available.
+*/
+bool uring_init ( struct Uring * ring ) {
+	struct io_uring_params params;
+	struct io_uring_probe * probe;
+	static const int needed[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CLOSE,
+		IORING_OP_LINK_TIMEOUT, IORING_OP_PROVIDE_BUFFERS
+	};
+	unsigned sq_size;
+	unsigned cq_size;
+	char * sq_ring;
+	char * cq_ring;
+	int fd;
+	int i;
 
-		//  Add the terminator to the event message
-		event[event_length] = '\n';
-		event_length++;
-		event[event_length] = '\n';
-		event_length++;
-		event[event_length] = 0;
+	memset ( &params, 0, sizeof ( params ) );
+	fd = syscall ( __NR_io_uring_setup, URING_ENTRIES, &params );
+	if ( fd < 0 ) {
+		error ( "io_uring_setup" );
+		return false;
+	}
 
-		//  Send the event to the connected web browser
-		serve_page ( event_socket_fd, event, event_length, true);
-		if ( verbose ) {
-			printf (event);
+	//  Check the operations are supported
+	probe = ( struct io_uring_probe * ) calloc ( 1, sizeof ( *probe ) + 256 * sizeof ( struct io_uring_probe_op ) );
+	if ( syscall ( __NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256 ) < 0 ) {
+		free ( probe );
+		close ( fd );
+		return false;
+	}
+	for ( i = 0; i < (int) ( sizeof ( needed ) / sizeof ( needed[0] ) ); i++ ) {
+		if ( needed[i] > probe->last_op || !( probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED ) ) {
+			free ( probe );
+			close ( fd );
+			return false;
 		}
-		if ( verbose ) {
-			printf ("Send event sleep started\n");
+	}
+	free ( probe );
+
+	//  Map the rings
+	sq_size = params.sq_off.array + params.sq_entries * sizeof ( unsigned );
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof ( struct io_uring_cqe );
+	if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( cq_size > sq_size ) {
+			sq_size = cq_size;
 		}
-		sleep(1);
-		if ( verbose ) {
-			printf ("Send event sleep ended\n");
+		cq_size = sq_size;
+	}
+	sq_ring = ( char * ) mmap ( 0, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+	if ( sq_ring == MAP_FAILED ) {
+		close ( fd );
+		return false;
+	}
+	cq_ring = sq_ring;
+	if ( !( params.features & IORING_FEAT_SINGLE_MMAP ) ) {
+		cq_ring = ( char * ) mmap ( 0, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+		if ( cq_ring == MAP_FAILED ) {
+			close ( fd );
+			return false;
 		}
 	}
+	ring->sqes = ( struct io_uring_sqe * ) mmap ( 0, params.sq_entries * sizeof ( struct io_uring_sqe ),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+	if ( ring->sqes == MAP_FAILED ) {
+		close ( fd );
+		return false;
+	}
+	ring->sq_head = ( unsigned * ) ( sq_ring + params.sq_off.head );
+	ring->sq_tail = ( unsigned * ) ( sq_ring + params.sq_off.tail );
+	ring->sq_mask = ( unsigned * ) ( sq_ring + params.sq_off.ring_mask );
+	ring->sq_array = ( unsigned * ) ( sq_ring + params.sq_off.array );
+	ring->sq_entries = params.sq_entries;
+	ring->sq_pending_tail = *ring->sq_tail;
+	ring->cq_head = ( unsigned * ) ( cq_ring + params.cq_off.head );
+	ring->cq_tail = ( unsigned * ) ( cq_ring + params.cq_off.tail );
+	ring->cq_mask = ( unsigned * ) ( cq_ring + params.cq_off.ring_mask );
+	ring->cqes = ( struct io_uring_cqe * ) ( cq_ring + params.cq_off.cqes );
+	pthread_mutex_init ( &ring->mutex, NULL );
 
-	//  This should never be reached
-	if ( verbose ) {
-		printf ("Send event exited\n");
+	//  One receive buffer, and one connection, per queue slot
+	if ( opt_queue < 1 ) {
+		opt_queue = 1;
+	}
+	ring->buffer_count = opt_queue;
+	ring->buffers = ( char * ) malloc ( ring->buffer_count * MAX_REQUEST_SIZE );
+	ring->connections = ( struct Uring_Connection * ) calloc ( opt_queue, sizeof ( struct Uring_Connection ) );
+	for ( i = 0; i < opt_queue; i++ ) {
+		ring->connections[i].ring = ring;
+		uring_free_connection ( &ring->connections[i] );
 	}
+	ring->fd = fd;
+	uring_provide_buffers ( ring, 0, ring->buffer_count );
+	uring_submit ( ring, 0 );
+	return true;
 }
 
 /*
-Send a 404 file not found error message to the connected web browser
+Makes room in the submission queue for count entries, handing what
+is in it to the kernel first if there is not. Entries linked together
+must reach the kernel in the same submission, so room is made for
+all of them before the first is filled in. The caller must hold the
+ring's mutex.
 */
-int send_error ( char * disk_page ) {
-	int i;
-	strcpy (disk_page, "<html><head></head><body>404: File not found</body></html>");
-	for ( i = 0; i < MAX_DISK_PAGE_SIZE; i++ ) {
-		if (disk_page[i]==0) {
-			break;
-		}
+void uring_make_room ( struct Uring * ring, unsigned count ) {
+	if ( ring->sq_pending_tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE ) + count > ring->sq_entries ) {
+		__atomic_store_n ( ring->sq_tail, ring->sq_pending_tail, __ATOMIC_RELEASE );
+		syscall ( __NR_io_uring_enter, ring->fd, ring->sq_entries, 0, 0, NULL, 0 );
 	}
-	return -1;
 }
 
 /*
-Send the requested page to the connected wbe browser
+Queues an accept on the listening socket. A multishot accept stays
+armed, producing a completion for each new connection.
 */
-void serve_page (int fd, char * page, int page_length, bool event) {
-	char header[300];
-	int n;
-	int header_length;
-	try {
-		//  If it is not an event, write the required HTTP heaxder
-		if ( !event ) {
-			header_length = sprintf (header, "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=UTF-8\r\nContent-Length: %d\n\n", page_length);
-			write_header ( fd, header, header_length );
-		}
-
-		//  Send the requestd page to the connecetd web browser
-		if ( verbose ) {
-			printf ("About to write %d bytes of content.\n", page_length);
-		}
-		n = write( fd, page, page_length);
-		if ( verbose ) {
-			printf ("Wrote %d bytes of content.\n",n);
-		}
-
-		//  Deal with sock issues
-		if (n < 0) {
-			thread_error("ERROR writing to socket");
-		}
-
-	//  Deal with otehr socket issues
-	} catch ( exception &e ) {
-		printf ("Serve page exception: %s\n", e.what());
-		cleanup_server_connections( fd );
-		throw;
-		pthread_exit ( NULL );
-	} catch ( ... ) {
-		printf ("Serve page unknown exception.\n");
-		throw;
-		pthread_exit ( NULL );
-	}
-	if ( verbose ) {
-		printf ("Exit serve_page.\n");
+void uring_queue_accept ( struct Uring * ring ) {
+	struct io_uring_sqe * sqe;
+	pthread_mutex_lock ( &ring->mutex );
+	sqe = uring_get_sqe ( ring, URING_ACCEPT );
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring->listen_fd;
+	if ( ring->multishot ) {
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
 	}
+	pthread_mutex_unlock ( &ring->mutex );
 }
 
 /*
-The procedure runs on the main thread. It listens to connection
-requests from web browsers.
-
-When a connection request is received, it initiates a separate
-thread and passes the connection request to it.
-
+Queues the close of a connection's socket on its own.
 */
-void server( int listen_socket_fd ) {
-	struct Thread_Args *thread_args;
-	int service_socket_fd;
-	int n;
-	struct sockaddr_in cli_addr;
-	socklen_t clilen;
-	clilen = sizeof(cli_addr);
-	char output_put[9];
-	printf ("Enter server.\n");
-	thread_args = ( Thread_Args * ) malloc(sizeof(Thread_Args));
-	thread_args->fd = -1;
-/*
-The following lines are to provide extensibility to provide additional
-parameters to the newly created thread.
-	thread_args->counter_unused = -1;
-	// As in "Mary had a little lamb."
-	output_put[0] = 'M';
-	output_put[1] = 'a';
-	output_put[2] = 'r';
-	output_put[3] = 'y';
-	output_put[4] = 0;
-	thread_args->extra_unused = output_put;
+void uring_queue_close ( struct Uring_Connection * connection ) {
+	struct Uring * ring = connection->ring;
+	struct io_uring_sqe * sqe;
+	pthread_mutex_lock ( &ring->mutex );
+	sqe = uring_get_sqe ( ring, (unsigned long long) connection | URING_CLOSE );
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = connection->fd;
+	pthread_mutex_unlock ( &ring->mutex );
+}
+
+/*
+Queues the event held in an event stream. Called by the event thread,
+holding event_mutex. The stream is marked busy until the send
+completes.
 */
-	for (;;) {
-		try {
-			if ( verbose ) {
-				printf ("server: try catch count: %d\n", try_catch_count);
-			}
-			if ( verbose ) {
-				printf ("server: waiting for connection.\n");
-			}
+bool uring_queue_event ( struct Event_Stream * stream ) {
+	struct Uring * ring = stream->ring;
+	struct io_uring_sqe * sqe;
+	unsigned long long tag;
+	int length = stream->frame->length;
 
-			//  Accept the new connection request from a web browser
-			service_socket_fd = accept(listen_socket_fd,
-				(struct sockaddr *) &cli_addr,
-				&clilen);
-			if ( verbose ) {
-				printf ("server: connection request received.\n");
-			}
-			if (service_socket_fd < 0) {
-				error("ERROR on accept");
-			}
+	stream->frame_sent = length;
+	stream->busy = true;
+	stream->sending = true;
+	tag = ( stream - event_stream ) | ( (unsigned long long) (unsigned) stream->generation << 8 );
+	pthread_mutex_lock ( &ring->mutex );
+	sqe = uring_get_sqe ( ring, ( tag << 3 ) | URING_EVENT );
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = stream->fd;
+	sqe->addr = (unsigned long) stream->frame->data;
+	sqe->len = length;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	pthread_mutex_unlock ( &ring->mutex );
+	return true;
+}
 
-			//  Create a new thread to deal with request from the web browser
-			thread_args->fd = service_socket_fd;
-			n = pthread_create ( &thread, NULL, accept_connection, (void*) thread_args );
-			if ( verbose ) {
-				printf ("server: thread created.\n");
-			}
+/*
+Queues a receive into whichever provided buffer the kernel picks
+when data arrives, linked to a timeout so that a browser which never
+sends its request does not hold the connection for ever.
+*/
+void uring_queue_recv ( struct Uring_Connection * connection ) {
+	struct Uring * ring = connection->ring;
+	static struct __kernel_timespec timeout = { 5, 0 };
+	struct io_uring_sqe * sqe;
+	pthread_mutex_lock ( &ring->mutex );
+	uring_make_room ( ring, 2 );
+	sqe = uring_get_sqe ( ring, (unsigned long long) connection | URING_RECV );
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->fd;
+	sqe->len = MAX_REQUEST_SIZE - 2;
+	sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe = uring_get_sqe ( ring, URING_IGNORE );
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (unsigned long) &timeout;
+	sqe->len = 1;
+	pthread_mutex_unlock ( &ring->mutex );
+}
 
-		//  Deal with exceptions
-		} catch ( exception &e ) {
-			printf ("Server exception: %s\n", e.what());
-			cleanup_server_connections( service_socket_fd );
-		} catch ( ... ) {
-			printf ("Server unknown exception.\n");
-		}
+/*
+Queues a send of what remains of a connection's response, linked to
+the close of the socket unless it is now an event stream.
+*/
+void uring_queue_write ( struct Uring_Connection * connection, bool close_after ) {
+	struct Uring * ring = connection->ring;
+	struct io_uring_sqe * sqe;
+	pthread_mutex_lock ( &ring->mutex );
+	uring_make_room ( ring, close_after ? 2 : 1 );
+	sqe = uring_get_sqe ( ring, (unsigned long long) connection | URING_WRITE );
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = connection->fd;
+	sqe->addr = (unsigned long) ( connection->response + connection->response_sent );
+	sqe->len = connection->response_length - connection->response_sent;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	if ( close_after ) {
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = uring_get_sqe ( ring, (unsigned long long) connection | URING_CLOSE );
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = connection->fd;
 	}
+	pthread_mutex_unlock ( &ring->mutex );
+}
 
-//  Should never reach here
-	printf ("Exit server.\n");
+/*
+Hands receive buffers, numbered from first, to the kernel.
+*/
+void uring_provide_buffers ( struct Uring * ring, int first, int count ) {
+	struct io_uring_sqe * sqe;
+	pthread_mutex_lock ( &ring->mutex );
+	sqe = uring_get_sqe ( ring, URING_IGNORE );
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = (unsigned long) ( ring->buffers + first * MAX_REQUEST_SIZE );
+	sqe->len = MAX_REQUEST_SIZE;
+	sqe->off = first;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	pthread_mutex_unlock ( &ring->mutex );
 }
 
 /*
-Handler for TCP connection issues. It does nothing.
+The io_uring counterpart of server(). Runs on a listener's acceptor
+thread, submitting queued work on the listener's ring and waiting
+for completions in a single system call each time round.
 */
-void sigpipe_handler ( int i ) {
+void *uring_server ( void * arg ) {
+	struct Listener * listener = ( struct Listener * ) arg;
+	struct Uring * ring = &listener->ring;
+	struct io_uring_cqe * cqe;
+	unsigned head;
+	unsigned tail;
+
+	log_message ( LOG_INFO, "Enter server, io_uring, cpu %d.\n", listener->cpu );
+	ring->listen_fd = listener->fd;
+	ring->multishot = true;
+	uring_queue_accept ( ring );
+	for (;;) {
+		uring_submit ( ring, 1 );
+		head = *ring->cq_head;
+		tail = __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE );
+		while ( head != tail ) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			uring_complete ( ring, cqe );
+			head++;
+			__atomic_store_n ( ring->cq_head, head, __ATOMIC_RELEASE );
+		}
+	}
+
+//  Should never reach here
+	log_message ( LOG_ERROR, "Exit server.\n" );
+	return 0;
 }
 
 /*
-Attempts to remove the given file descriptor as an event stream.
-Silently ignore if there it is not found
+Makes the queued entries visible to the kernel and submits them,
+optionally waiting for at least one completion. Without a wait,
+there is no system call unless something is queued.
 */
-void unregister_event_stream ( int fd ) {
-	int i;
-	for ( i = 0; i < MAX_EVENT_STREAM; i++ ) {
-		if ( event_stream[i] == fd ) {
-			event_stream[i] = -1;
+void uring_submit ( struct Uring * ring, int wait ) {
+	unsigned to_submit;
+	pthread_mutex_lock ( &ring->mutex );
+	__atomic_store_n ( ring->sq_tail, ring->sq_pending_tail, __ATOMIC_RELEASE );
+	to_submit = ring->sq_pending_tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE );
+	pthread_mutex_unlock ( &ring->mutex );
+	if ( !to_submit && !wait ) {
+		return;
+	}
+	if ( syscall ( __NR_io_uring_enter, ring->fd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 ) < 0 ) {
+		if ( errno != EINTR && errno != EBUSY ) {
+			error ( "io_uring_enter" );
 		}
 	}
+}
 
+#else
+
+//  Stand-ins for kernel headers without io_uring multishot accept
+bool uring_capture_iov ( struct iovec * iov, int count ) {
+	return false;
+}
+bool uring_init ( struct Uring * ring ) {
+	return false;
+}
+bool uring_queue_event ( struct Event_Stream * stream ) {
+	return false;
+}
+void *uring_server ( void * arg ) {
+	return 0;
+}
+void uring_submit ( struct Uring * ring, int wait ) {
 }
 
+#endif
+
 /*
-Prints an error message and terminates the calling thread.
+A worker thread. Services accepted connections from its listener's
+queue, one at a time, for ever.
 */
-void thread_error(const char *msg)
-{
-    perror(msg);
-    pthread_exit(NULL);
+void *worker_thread ( void * arg ) {
+	struct Connection_Queue * queue = ( struct Connection_Queue * ) arg;
+	for (;;) {
+		service_connection ( connection_queue_pop ( queue ) );
+	}
+	return 0;
 }
 
 /*
 Writes the indicated HTTP header to the connected web browser.
+
+Returns false if the socket could not be written to.
 */
-void write_header ( int fd, char * header, int length ) {
+bool write_header ( int fd, const char * header, int length ) {
+	struct iovec iov;
 	int n;
-	try {
-		if ( verbose ) {
-			printf ("About to write header.\n");
+	log_message ( LOG_DEBUG, "About to write header.\n" );
+	iov.iov_base = (void *) header;
+	iov.iov_len = length;
+	n = write_iov( fd, &iov, 1 );
+	log_message ( LOG_DEBUG, "Wrote %d bytes of header.\n", n );
+
+	//  Deal with an exception
+	if (n < 0) {
+		error("ERROR writing to socket");
+		return false;
+	}
+	return true;
+}
+
+/*
+Writes all of the indicated buffers to the socket, issuing further
+writev() calls only when the kernel accepts a short write. The iovec
+array is consumed in the process. One writev() needs no cork, as the
+kernel makes full segments of it; only after a short write is the
+socket corked, so that the rest does not go out in small segments
+as the socket drains, and uncorked once it has all been written. On the io_uring backend, the
+buffers are instead gathered up to be sent by the ring.
+
+Returns the number of bytes written, or -1 on error.
+*/
+int write_iov ( int fd, struct iovec * iov, int count ) {
+	bool corked = false;
+	ssize_t n;
+	int total = 0;
+
+	//  Over HTTP/2 the response is sent as frames, and on the ring
+	//  once the request is done
+	if ( h2_capture && h2_capture->fd == fd ) {
+		return buffer_append_iov ( &h2_capture->capture, &h2_capture->capture_length, iov, count ) ? 0 : -1;
+	}
+	if ( uring_capture && uring_capture->fd == fd ) {
+		return uring_capture_iov ( iov, count ) ? 0 : -1;
+	}
+	unsigned long long trace = trace_start ( );
+	while ( count > 0 ) {
+		n = writev ( fd, iov, count );
+		if ( n < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			if ( corked ) {
+				set_tcp_option ( fd, TCP_CORK, 0 );
+			}
+			trace_end ( "write", trace );
+			return -1;
 		}
-		n = write( fd, header, length);
-		if ( verbose ) {
-			printf ("Wrote %d bytes of header.\n", n);
+		total += n;
+
+		//  Step over the buffers that were completely written
+		while ( count > 0 && (size_t) n >= iov->iov_len ) {
+			n -= iov->iov_len;
+			iov++;
+			count--;
 		}
 
-		//  Deal with an exception
-		if (n < 0) {
-			thread_error("ERROR writing to socket");
-			unregister_event_stream ( fd );
+		//  Resume part way through a partially written buffer
+		if ( count > 0 ) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+			if ( !corked ) {
+				set_tcp_option ( fd, TCP_CORK, 1 );
+				corked = true;
+			}
 		}
-	//  Deal with all other exceptions
-	} catch ( exception &e ) {
-		printf ("Write header exception: %s\n", e.what());
-		unregister_event_stream ( fd );
 	}
+	if ( corked ) {
+		set_tcp_option ( fd, TCP_CORK, 0 );
+	}
+	trace_end ( "write", trace );
+	return total;
+}
+
+/*
+Sets the outputs picked out by mask to the corresponding bits of
+value, for web browsers and control programs alike, and lets every
+one of them know.
+
+Returns the outputs as written.
+*/
+int write_outputs ( int mask, int value ) {
+	int i;
+	int bit;
+	int new_output;
+
+	pthread_mutex_lock ( &event_mutex );
+	__atomic_store_n ( &pif_output, ( pif_output & ~mask ) | ( value & mask ), __ATOMIC_RELAXED );
+
+	//  Write to the PiFace Digital 2
+	unsigned long long trace = trace_start ( );
+	pifacedigital_write_reg ( pif_output, OUTPUT, pif_hw_addr );
+	trace_end ( "write_reg", trace );
+
+	//  Update the master copy of the output bits
+	bit = 1;
+	for ( i = 0; i < 8; i++ ) {
+		if ( bit & pif_output ) {
+			output[i] = '1';
+		} else {
+			output[i] = '0';
+		}
+		bit <<= 1;
+	}
+
+	//  Advise all currently connected browsers and future
+	//  connected web browser that the output has changed.
+	output_sequence++;
+	new_output = pif_output;
+	pthread_mutex_unlock ( &event_mutex );
+
+	//  And everything else that follows the state
+	publish_state ( );
+	return new_output;
 }
 
 /*
@@ -804,18 +8030,14 @@ Entry point
 */
 int main(int argc, char *argv[])
 {
-    int   listen_socket_fd;
     int   portno;
     int   page_served = 0;
     char  from_browser[5000];
     char  page_name[300];
     char *page_parameters;
 
-    struct sockaddr_in serv_addr;
     struct ifreq ifr;
 
-    int enable = 1;
-    int result;
     verbose = 0;
 
     //   Get the port number
@@ -824,12 +8046,24 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    //  See if we need to be verbose or are being asked about version
-    if ( argc >= 3 ) {
-        if ( *argv[2] == 'v' ) {
+    //  See if we need to be verbose or are being asked about version,
+    //  and pick up any name=value options
+    for ( int i = 2; i < argc; i++ ) {
+        if ( locate_char ( '=', argv[i] ) > 0 ) {
+            if ( !set_option ( argv[i] ) ) {
+                fprintf(stderr,"ERROR, unknown option %s\n", argv[i]);
+                exit(1);
+            }
+            continue;
+        }
+        if ( *argv[i] == 'v' ) {
             verbose = 1;
         }
-        if ( *argv[2] == 'a' ) {
+        if ( *argv[i] == 'b' ) {
+            route_benchmark ( );
+            exit ( 0 );
+        }
+        if ( *argv[i] == 'a' ) {
             printf ( "Version: %s\n", version);
             exit (0);
         }
@@ -838,32 +8072,19 @@ int main(int argc, char *argv[])
     //  Initialise everything that needs to be initalised
     initialise();
 
-    //  Create and configure a socket to listen to connection requests
-    listen_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_socket_fd < 0)
-        error("ERROR opening socket");
-    result = setsockopt ( listen_socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int) );
-    if ( result < 0 )
-	error ("ERROR setsockopt SO_REUSERADDR");
+    //  Open the sockets that listen to connection requests, and
+    //  start the web server
+    portno = atoi(argv[1]);
+    start_threads ( portno );
     ifr.ifr_addr.sa_family = AF_INET;
     strncpy ( ifr.ifr_name, "wlan0", IFNAMSIZ-1);
-    ioctl ( listen_socket_fd, SIOCGIFADDR, &ifr);
-    fprintf(stdout, "My IP address: %s\n", inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr));
+    ioctl ( listeners[0].fd, SIOCGIFADDR, &ifr);
+    log_message ( LOG_INFO, "My IP address: %s\n", inet_ntoa(((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr));
 
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[1]);
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(portno);
-    if (bind(listen_socket_fd, (struct sockaddr *) &serv_addr,
-              sizeof(serv_addr)) < 0)
-              error("ERROR on binding");
-    listen( listen_socket_fd, 5 );
-
-    //  Start the web server
-    server( listen_socket_fd );
-
-    //  Should never get here
-    close( listen_socket_fd );
+    //  Should never get past here
+    for ( int i = 0; i < listener_count; i++ ) {
+        pthread_join ( listeners[i].thread, NULL );
+        close ( listeners[i].fd );
+    }
     return 0;
 }
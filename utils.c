@@ -3,6 +3,7 @@
 File: util.c
 
 ***************************/
+static unsigned long long hash_buffer (const char *, int);
 static int    read_decimal (char *);
 static double read_double (char *);
 static int    read_hex (char *);
@@ -31,6 +32,21 @@ static int locate_char (char a, char  * b) {
 	}
 }
 
+/***********************************
+*
+*	Return the 64 bit FNV-1a hash of a buffer
+*
+***********************************/
+static unsigned long long hash_buffer (const char *buffer, int length) {
+	unsigned long long hash = 14695981039346656037ULL;
+	int i;
+	for (i=0; i<length; i++) {
+		hash ^= (unsigned char) buffer[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
 /***********************************
 *
 *	Find the start of the next number after this number